@@ -10,6 +10,7 @@ import binascii
 import traceback
 import os
 import hashlib
+import errno
 try:
     import serial
 except ImportError:
@@ -27,13 +28,37 @@ except ImportError:
     termios_used = False
     print("termios not oaded\r\n")
 
+try:
+    import lz4.block
+    lz4_lib = True
+except ImportError:
+    lz4_lib = False
+
+try:
+    import usb.core
+    import usb.util
+    usb_lib = True
+except ImportError:
+    usb_lib = False
+
 
 CMD_GET_VERSION          = 0x0000D001
+CMD_GET_CAPS             = 0x0000D00A
 CMD_READ_FLASH           = 0x0000D102
 CMD_WRITE_FLASH          = 0x0000D103
 CMD_APP_RECORD_READ      = 0x0000D204
 CMD_APP_RECORD_WRITE     = 0x0000D205
 CMD_APP_GETSHA256        = 0x0000D206
+CMD_WRITE_FLASH_WIN      = 0x0000D107
+CMD_WRITE_BLOCK          = 0x0000D108
+CMD_READ_FLASH_STREAM    = 0x0000D109
+CMD_WRITE_PATCH          = 0x0000D10B
+CMD_FLASH_MANIFEST       = 0x0000D10C
+CMD_FLASH_ERASE          = 0x0000D10D
+CMD_FLASH_STATS          = 0x0000D10E
+CMD_SESSION_BEGIN        = 0x0000D10F
+CMD_JOURNAL_BEGIN        = 0x0000D110
+CMD_JOURNAL_READ         = 0x0000D111
 
 CMD_ERR_OK               = 0x00000000
 CMD_ERR_CRC              = 0x0000E101
@@ -50,6 +75,10 @@ CMD_ERR_BOOTREC_WRITE    = 0x0000E10B
 CMD_ERR_BKPBOOTREC_WRITE = 0x0000E10C
 CMD_ERR_FLASHDATACRC     = 0x0000E10D
 CMD_ERR_FLASHERASE       = 0x0000E10E
+CMD_ERR_SEQ              = 0x0000E10F
+CMD_ERR_INPROGRESS       = 0x0000E110
+CMD_ERR_CANCELED         = 0x0000E111
+CMD_ERR_JOURNAL          = 0x0000E112
 
 FCFB_BLOCK_ID            = 0x42464346
 IVT_BLOCK_ID             = 0x412000D1
@@ -59,10 +88,76 @@ DATA_TX_BLOK_SIZE        = 4096
 BOOT_RECORD_SIZE         = 140
 APP_RECORD_SIZE          = 60
 
+WRITE_WINDOW             = 8
+
+CAPS_FEAT_WRITE_WIN      = 0x00000001
+CAPS_FEAT_READ_STREAM    = 0x00000002
+CAPS_FEAT_VERIFY         = 0x00000004
+CAPS_FEAT_LZ4            = 0x00000008
+CAPS_FEAT_PATCH          = 0x00000010
+CAPS_FEAT_MANIFEST       = 0x00000020
+CAPS_FEAT_ERASE          = 0x00000040
+CAPS_FEAT_STATS          = 0x00000080
+CAPS_FEAT_PREERASE       = 0x00000100
+CAPS_FEAT_SHA_PROGRESS   = 0x00000200
+CAPS_FEAT_JOURNAL        = 0x00000400
+CAPS_FEAT_USB_VENDOR     = 0x00000800
+
+WRITE_BLOCK_LZ4          = 0x01000000
+WRITE_BLOCK_NOVERIFY     = 0x02000000
+WRITE_VERSION_SHIFT      = 16
+WRITE_VERSION_V2         = 2
+WRITE_V2_FLAGS_SHIFT     = 11
+APP_FLAG_ACTIVE          = 0x01000000
+
+ERASE_CHUNK_SIZE         = 0x100000
+ERASE_BLOCK_TIMEOUT      = 2.0
+
+SHA256_REQ_PROGRESS      = 1
+SHA256_CANCEL            = b'\x18'
+
+JOURNAL_HDR_SIZE         = 60
+
+PATCH_KEY_LEN            = 16
+PATCH_INDEX_STRIDE       = 8
+
+USB_SPEED_HIGH           = 2
+
+# Vendor specific bulk interface, used through libusb instead of the CDC port when present
+USB_VID                  = 0xF055
+USB_PID                  = 0x9802
+USB_VENDOR_INTERFACE     = 2
+USB_VENDOR_REQ_LINK      = 0x01
+USB_VENDOR_REQ_TYPE      = 0x41
+USB_READ_SIZE            = 0x10000
+USB_WRITE_TIMEOUT        = 10.0
+
+# Device capabilities, the defaults are used with bootloaders not supporting CMD_GET_CAPS
+caps = {
+    'version':      0,
+    'max_block':    DATA_BLOK_SIZE,
+    'max_window':   0,
+    'features':     0,
+    'flash_base':   0x60000000,
+    'flash_size':   0x800000,
+    'page_size':    256,
+    'sector_size':  4096,
+    'erase_sizes':  0x1000,
+    'app_address':  0x60010000,
+    'app_max_size': 0x200000,
+    'usb_speed':    0,
+}
+CAPS_FIELDS = ('version', 'max_block', 'max_window', 'features', 'flash_base', 'flash_size', 'page_size',
+               'sector_size', 'erase_sizes', 'app_address', 'app_max_size', 'usb_speed')
+WRITE_SEQ_RESYNC         = 0xFFFF
+WRITE_MAX_TRIES          = 5
+
 VERSION = "1.0.1"
 UART_DEVICE = '/dev/ttyACM0'
 uart = None
 uart_is_open = False
+use_usb = True
+rx_buf = bytearray()
 debug = False
 
 if termios_used is True:
@@ -108,6 +203,14 @@ def err_str(code):
         res = "Backup boot record write error"
     elif code == CMD_ERR_FLASHERASE:
         res = "Flash erase error"
+    elif code == CMD_ERR_SEQ:
+        res = "Block sequence out of window"
+    elif code == CMD_ERR_INPROGRESS:
+        res = "Operation in progress"
+    elif code == CMD_ERR_CANCELED:
+        res = "Operation canceled"
+    elif code == CMD_ERR_JOURNAL:
+        res = "Write journal error"
     elif code == 1000:
         res = "CMD: No response to command"
     elif code == 9999:
@@ -144,9 +247,92 @@ def debug_print(msg):
     if debug is True:
         print("DEBUG: {}".format(msg))
 
+#============
+class UsbLink:
+    # the bootloader's vendor specific bulk interface through libusb,
+    # provides the part of serial.Serial interface used by this script
+    def __init__(self, dev, intf, timeout):
+        self.dev = dev
+        self.intf = intf
+        self.timeout = timeout
+        self.buf = bytearray()
+        usb.util.claim_interface(dev, intf)
+        self.ep_in = usb.util.find_descriptor(intf, custom_match=lambda e:
+            usb.util.endpoint_direction(e.bEndpointAddress) == usb.util.ENDPOINT_IN)
+        self.ep_out = usb.util.find_descriptor(intf, custom_match=lambda e:
+            usb.util.endpoint_direction(e.bEndpointAddress) == usb.util.ENDPOINT_OUT)
+        # the device's input and output are moved from the CDC port to this interface
+        dev.ctrl_transfer(USB_VENDOR_REQ_TYPE, USB_VENDOR_REQ_LINK, 1, USB_VENDOR_INTERFACE)
+
+    def _receive(self, timeout):
+        # one bulk transfer, the device ends each of its transfers with a short or zero length packet
+        try:
+            self.buf += self.ep_in.read(USB_READ_SIZE, max(1, int(timeout * 1000)))
+        except usb.core.USBError as e:
+            if e.errno != errno.ETIMEDOUT:
+                raise
+
+    @property
+    def in_waiting(self):
+        return len(self.buf)
+
+    def read(self, size):
+        end = time.time() + self.timeout
+        while len(self.buf) < size:
+            left = end - time.time()
+            if left <= 0:
+                break
+            self._receive(left)
+        data = bytes(self.buf[:size])
+        del self.buf[:size]
+        return data
+
+    def write(self, data):
+        return self.ep_out.write(data, int(USB_WRITE_TIMEOUT * 1000))
+
+    def reset_input_buffer(self):
+        # discard the data already sent by the device
+        while True:
+            self.buf = bytearray()
+            self._receive(0.01)
+            if len(self.buf) == 0:
+                break
+
+    def close(self):
+        try:
+            # the CDC port is used by the device again
+            self.dev.ctrl_transfer(USB_VENDOR_REQ_TYPE, USB_VENDOR_REQ_LINK, 0, USB_VENDOR_INTERFACE)
+        finally:
+            usb.util.release_interface(self.dev, self.intf)
+            usb.util.dispose_resources(self.dev)
+
+#----------------------------
+def usb_link_open(timeout):
+    # the vendor interface of the first bootloader found, None if not present or libusb can't be used
+    if usb_lib is False:
+        return None
+    try:
+        dev = usb.core.find(idVendor=USB_VID, idProduct=USB_PID)
+        if dev is None:
+            return None
+        intf = usb.util.find_descriptor(dev.get_active_configuration(),
+                                        bInterfaceNumber=USB_VENDOR_INTERFACE, bInterfaceClass=0xFF)
+        if intf is None:
+            return None
+        return UsbLink(dev, intf, timeout)
+    except Exception as e:
+        debug_print("[usb] vendor interface not used ({})".format(e))
+        return None
+
 #---------------
 def uart_init():
     global uart, uart_is_open
+    if use_usb is True:
+        uart = usb_link_open(1.25)
+        if uart is not None:
+            uart_is_open = True
+            print("Using the USB vendor interface\r\n")
+            return
     try:
         uart = serial.Serial(
             port     = UART_DEVICE,
@@ -164,23 +350,42 @@ def uart_init():
     except:
         do_exit("Cannot open UART port ({})".format(UART_DEVICE))
 
+#----------------------
+def uart_read(size):
+    # read 'size' bytes, all bytes already received are taken with the same read
+    # the response header and its data sent in one transfer are read at once
+    global rx_buf
+    if len(rx_buf) < size:
+        rx_buf += uart.read(max(size - len(rx_buf), uart.in_waiting))
+    data = bytes(rx_buf[:size])
+    del rx_buf[:size]
+    return data
+
+#-----------------------
+def uart_reset_input():
+    global rx_buf
+    rx_buf = bytearray()
+    uart.reset_input_buffer()
+
 #------------------
 def get_response():
     err = 0
     err1 = 0
+    param = 0
     resp_data = None
     try:
-        resp = uart.read(20)
+        resp = uart_read(20)
         if len(resp) == 20:
             debug_print("[get_response] received: {}".format(binascii.hexlify(resp).decode()))
             resp_crc = binascii.crc32(resp[0:16])
             response = struct.unpack("IIIII", resp)
             if response[4] == resp_crc:
                 err1 = response[3]
+                param = response[1]
                 if response[2] > 0:
                     # some data follows
                     debug_print("[get_response] Read response data (len={})".format(response[2]))
-                    resp_data = uart.read(response[2])
+                    resp_data = uart_read(response[2])
                     if len(resp_data) == response[2]:
                         resp_crc = binascii.crc32(resp_data)
                         if resp_crc != response[3]:
@@ -204,7 +409,7 @@ def get_response():
         error_string = repr(error)
         debug_print("[get_response] {}".format(error_string))
         err = 9999
-    return (err, resp_data, err1)
+    return (err, resp_data, err1, param)
 
 #------------------------------------------------
 def send_command(cmd, par=0, size=0, data_crc=0):
@@ -229,6 +434,62 @@ def send_data(data_buf):
     res = get_response()
     return res
 
+#-------------------------------------------------------------------
+def send_block_v2(seq, index, data_buf, flags=0, data_crc=None):
+    # v2 block header [data_crc, seq, index, data_len | flags>>11, crc16] followed by data
+    # the block address is 'session start + index * block size'
+    if data_crc is None:
+        data_crc = binascii.crc32(data_buf)
+    blk_buf = struct.pack('<IHHH', data_crc, seq & 0xFFFF, index, len(data_buf) | (flags >> WRITE_V2_FLAGS_SHIFT))
+    blk_bytes = blk_buf + struct.pack('<H', binascii.crc32(blk_buf) & 0xFFFF)
+    debug_print("[send block] seq={}, index={}, len={}".format(seq, index, len(data_buf)))
+    uart.write(blk_bytes + data_buf)
+
+#---------------------------------------------------------------
+def send_block(seq, address, data_buf, flags=0, data_crc=None):
+    # block header [CMD_WRITE_BLOCK | seq<<16, address, data_len | flags, data_crc, crc] followed by data
+    if data_crc is None:
+        data_crc = binascii.crc32(data_buf)
+    blk_buf = struct.pack('IIII', CMD_WRITE_BLOCK | ((seq & 0xFFFF) << 16), address, len(data_buf) | flags, data_crc)
+    blk_bytes = blk_buf + struct.pack('I', binascii.crc32(blk_buf))
+    debug_print("[send block] seq={}, addr={}, len={}".format(seq, hex(address), len(data_buf)))
+    uart.write(blk_bytes + data_buf)
+
+#-------------
+def get_ack():
+    # read the block acknowledge, returns (status, seq, device_base, detail) or None
+    try:
+        resp = uart_read(20)
+    except Exception as error:
+        debug_print("[get_ack] {}".format(repr(error)))
+        return None
+    if len(resp) != 20:
+        debug_print("[get_ack] No response [{}]".format(resp))
+        return None
+    response = struct.unpack("IIIII", resp)
+    if response[4] != binascii.crc32(resp[0:16]):
+        debug_print("[get_ack] Response CRC error")
+        return None
+    return (response[0], response[1] & 0xFFFF, response[1] >> 16, response[3])
+
+#----------------
+def get_ack_v2():
+    # read the v2 block acknowledge [seq, base, detail, status, crc16], status is the NAK reason
+    # returns (status, seq, device_base, detail) or None
+    try:
+        resp = uart_read(12)
+    except Exception as error:
+        debug_print("[get_ack] {}".format(repr(error)))
+        return None
+    if len(resp) != 12:
+        debug_print("[get_ack] No response [{}]".format(resp))
+        return None
+    seq, base, detail, status, crc = struct.unpack('<HHIHH', resp)
+    if crc != (binascii.crc32(resp[0:10]) & 0xFFFF):
+        debug_print("[get_ack] Response CRC error")
+        return None
+    return (status, seq, base, detail)
+
 '''
 ----------------------
 Boot record structure:
@@ -299,6 +560,94 @@ def get_boot_info():
     else:
         print("Error requesting app boot record ({})".format(err_str(res[0])))
 
+#----------------------
+def get_app_records():
+    # returns both app records as [(name, address, size, timestamp, sha256), ...] or None
+    res = send_command(CMD_APP_RECORD_READ | 0x00030000)
+    if (res[0] != 0) or (res[1] is None) or (len(res[1]) != (APP_RECORD_SIZE*2)):
+        return None
+    return [struct.unpack('16sIII32s', res[1][idx*APP_RECORD_SIZE:(idx+1)*APP_RECORD_SIZE]) for idx in range(2)]
+
+#--------------
+def get_caps():
+    global DATA_TX_BLOK_SIZE
+    res = send_command(CMD_GET_CAPS)
+    if res[0] != 0:
+        debug_print("[get_caps] not supported ({})".format(err_str(res[0])))
+        return
+    if (res[1] is None) or (len(res[1]) < len(CAPS_FIELDS)*4):
+        print("Wrong capabilities response received")
+        return
+    values = struct.unpack('{}I'.format(len(CAPS_FIELDS)), res[1][0:len(CAPS_FIELDS)*4])
+    for idx in range(len(CAPS_FIELDS)):
+        caps[CAPS_FIELDS[idx]] = values[idx]
+    DATA_TX_BLOK_SIZE = min(caps['max_block'], caps['sector_size'])
+    print("Flash: {} KB at {}, page={}, sector={}; USB: {} speed{}; protocol v.{}\r\n".format(
+        caps['flash_size'] // 1024, hex(caps['flash_base']), caps['page_size'], caps['sector_size'],
+        "high" if caps['usb_speed'] == USB_SPEED_HIGH else "full",
+        ", vendor interface" if isinstance(uart, UsbLink) else "", caps['version']))
+
+#-----------------------
+def has_feature(feature):
+    # devices not supporting CMD_GET_CAPS are probed with the command itself
+    return (caps['version'] == 0) or ((caps['features'] & feature) != 0)
+
+#----------------------
+def flash_end_address():
+    return caps['flash_base'] + caps['flash_size']
+
+#-----------------------------
+def get_flash_stats(reset=False):
+    # flash operations counters [erases, erases_skipped, pages, writes_skipped]
+    if (caps['version'] == 0) or (not has_feature(CAPS_FEAT_STATS)):
+        return None
+    res = send_command(CMD_FLASH_STATS, 1 if reset is True else 0)
+    if (res[0] != 0) or (res[1] is None) or (len(res[1]) < 16):
+        return None
+    return struct.unpack('IIII', res[1][0:16])
+
+#-----------------------------------
+def session_begin(address, length):
+    # the whole range will be written, the device erases it in background ahead of the data
+    if (caps['version'] == 0) or (not has_feature(CAPS_FEAT_PREERASE)):
+        return
+    res = send_command(CMD_SESSION_BEGIN, address, length)
+    if res[0] != 0:
+        debug_print("[session begin] pre-erase not started ({})".format(err_str(res[0])))
+
+#----------------------
+def journal_read():
+    # the write journal as (address, length, sha256, committed sectors flags) or None
+    res = send_command(CMD_JOURNAL_READ)
+    if (res[0] != 0) or (res[1] is None) or (len(res[1]) < JOURNAL_HDR_SIZE):
+        debug_print("[journal] no journal ({})".format(err_str(res[0])))
+        return None
+    _, address, length, sha, _ = struct.unpack('16sII32sI', res[1][0:JOURNAL_HDR_SIZE])
+    bitmap = res[1][JOURNAL_HDR_SIZE:]
+    sectors = (length + caps['sector_size'] - 1) // caps['sector_size']
+    if len(bitmap) < ((sectors + 7) // 8):
+        return None
+    # the bit is cleared when the sector is committed
+    committed = [(bitmap[idx >> 3] & (1 << (idx & 7))) == 0 for idx in range(sectors)]
+    return (address, length, sha, committed)
+
+#---------------------------------------------
+def journal_begin(address, length, fw_sha):
+    # start the device's write journal, the journal of the same range and image is continued
+    # returns the committed sectors flags if the previous write can be resumed, otherwise None
+    if (caps['version'] == 0) or (not has_feature(CAPS_FEAT_JOURNAL)) or (caps['sector_size'] != DATA_TX_BLOK_SIZE):
+        return None
+    journal = journal_read()
+    res = send_command(CMD_JOURNAL_BEGIN, address, length, binascii.crc32(fw_sha))
+    if res[0] == 0:
+        res = send_data(fw_sha)
+    if res[0] != 0:
+        debug_print("[journal] not started ({})".format(err_str(res[0])))
+        return None
+    if (res[3] == 0) or (journal is None) or (journal[0:3] != (address, length, fw_sha)):
+        return None
+    return journal[3]
+
 #--------------
 def get_info():
     if uart_is_open is False:
@@ -306,14 +655,18 @@ def get_info():
     res = send_command(CMD_GET_VERSION)
     if res[0] == 0:
         print("Device detected: {}\r\n".format(res[1].decode()))
+        get_caps()
         get_boot_info()
     else:
         print("Error requesting device information ({})\r\n".format(err_str(res[0])))
 
-#---------------------------------------------------
-def check_address(addr, length, minaddr=0x60010000):
-    if (addr < minaddr) or (addr > 0x607FF000):
-        print("ERROR: Address not in range {} - 0x607FF000".format(hex(minaddr)))
+#-----------------------------------------
+def check_address(addr, length, minaddr=None):
+    if minaddr is None:
+        minaddr = caps['app_address']
+    flash_end = flash_end_address()
+    if (addr < minaddr) or (addr >= flash_end):
+        print("ERROR: Address not in range {} - {}".format(hex(minaddr), hex(flash_end)))
         return False
     if (addr % DATA_BLOK_SIZE) != 0:
         print("ERROR: Address must be alligned to 4KB")
@@ -321,15 +674,49 @@ def check_address(addr, length, minaddr=0x60010000):
     if (length <= 0) or ((length % DATA_BLOK_SIZE) != 0):
         print("ERROR: Length must be greater tha 0 and 4KB multiple")
         return False
-    if ((addr + length) > 0x607FF000):
-        print("ERROR: End address greater than 0x607FF000")
+    if ((addr + length) > flash_end):
+        print("ERROR: End address greater than {}".format(hex(flash_end)))
         return False
 
+#---------------------------------------------
+def read_stream(address, length, dest_file):
+    # request all data with single command, the device streams the data in chunks
+    # returns the number of bytes received or None if not supported by the device
+    res = send_command(CMD_READ_FLASH_STREAM, address, length)
+    if res[0] == CMD_ERR_UNKNOWN_CMD:
+        debug_print("[read] streaming read not supported")
+        return None
+    if res[0] != 0:
+        print("error at address {}: no valid response ({})".format(hex(address), err_str(res[0])))
+        return 0
+
+    received = 0
+    while received < length:
+        res = get_response()
+        if (res[0] != 0) or (res[1] is None):
+            print("error at address {}: no valid response ({})".format(hex(address+received), err_str(res[0])))
+            break
+        if res[3] != (address + received):
+            print("error at address {}: wrong chunk address ({})".format(hex(address+received), hex(res[3])))
+            break
+        if dest_file is not None:
+            try:
+                dest_file.write(res[1])
+            except:
+                print("  Error writing data at {} to dest file".format(hex(address+received)))
+        received += len(res[1])
+
+    if received < length:
+        # discard the rest of the stream
+        time.sleep(0.2)
+        uart_reset_input()
+    return received
+
 #------------------------------------------
 def read_data(address, length, fname=None):
     if length <= 2048:
         length *= DATA_BLOK_SIZE
-    if check_address(address, length, 0x60000000) is False:
+    if check_address(address, length, caps['flash_base']) is False:
         return
     if uart_is_open is False:
         uart_init()
@@ -346,7 +733,14 @@ def read_data(address, length, fname=None):
     print("Reading Flash data...")
     tstart = time.time()
 
-    while length > 0:
+    received = None
+    if has_feature(CAPS_FEAT_READ_STREAM):
+        received = read_stream(address, length, dest_file)
+    if received is not None:
+        length -= received
+
+    # block by block read if streaming is not supported
+    while (received is None) and (length > 0):
         res = send_command(CMD_READ_FLASH, address, DATA_BLOK_SIZE)
         if res[0] == 0:
             if res[1] is not None:
@@ -378,6 +772,45 @@ def read_data(address, length, fname=None):
         tellapsed = time.time() - tstart
         print("{} bytes received in {:.3f} seconds ({:.2f} KB/sec){}".format(total_length, tellapsed, (total_length / tellapsed) / 1024.0, tofile))
 
+#-------------------------------------------
+def erase_flash(address, length):
+    # erase the range with CMD_FLASH_ERASE, the device uses block erases where possible
+    if address == 0:
+        address = caps['app_address']
+    if length == 0:
+        length = flash_end_address() - address
+    elif length <= 2048:
+        length *= DATA_BLOK_SIZE
+    if check_address(address, length) is False:
+        return
+    if uart_is_open is False:
+        uart_init()
+    if (caps['version'] == 0) or (not has_feature(CAPS_FEAT_ERASE)):
+        print("Flash erase not supported by the device")
+        return
+
+    print("Erasing Flash {} - {}...".format(hex(address), hex(address + length)))
+    tstart = time.time()
+    total = length // caps['sector_size']
+    done = 0
+    # the response to each chunk can take several seconds, worst case 64KB block erase time is used
+    timeout = uart.timeout
+    uart.timeout = (ERASE_CHUNK_SIZE // 0x10000) * ERASE_BLOCK_TIMEOUT + timeout
+    try:
+        while length > 0:
+            chunk = min(length, ERASE_CHUNK_SIZE)
+            res = send_command(CMD_FLASH_ERASE, address, chunk)
+            if res[0] != 0:
+                print("\r\nerror at address {}: {}".format(hex(address), err_str(res[0])))
+                return
+            address += chunk
+            length -= chunk
+            done += chunk // caps['sector_size']
+            show_progress(done, total)
+    finally:
+        uart.timeout = timeout
+    print("Erased in {:.3f} seconds".format(time.time() - tstart))
+
 #---------------------------
 def check_fw_file(src_file):
     addr = 0
@@ -397,7 +830,7 @@ def check_fw_file(src_file):
         if ivt_id != IVT_BLOCK_ID:
             print("File nat a firmware file: IVT id missing")
             return 0
-        if (addr < 0x60010000) or (addr > 0x60200000):
+        if (addr < caps['app_address']) or (addr >= flash_end_address()):
             print("File nat a firmware file: wrong address")
             return 0
         return addr
@@ -405,11 +838,33 @@ def check_fw_file(src_file):
         addr = 0
     return addr
 
+#-------------------------------------
+def request_sha(address, size):
+    # the device reports the progress of long calculation, Ctrl-C cancels it
+    if (caps['version'] == 0) or (not has_feature(CAPS_FEAT_SHA_PROGRESS)):
+        return send_command(CMD_APP_GETSHA256, address, size)
+    res = send_command(CMD_APP_GETSHA256, address, size, SHA256_REQ_PROGRESS)
+    shown = False
+    while res[0] == CMD_ERR_INPROGRESS:
+        if debug is False:
+            shown = True
+            print("\r  SHA256: {}%".format((res[3] * 100) // size), end='', flush=True)
+        try:
+            res = get_response()
+        except KeyboardInterrupt:
+            uart.write(SHA256_CANCEL)
+            res = (CMD_ERR_INPROGRESS, None, 0, 0)
+            while res[0] == CMD_ERR_INPROGRESS:
+                res = get_response()
+    if shown is True:
+        print("\r              \r", end='', flush=True)
+    return res
+
 #--------------------------------------
 def get_app_sha(address, size, fw_sha):
     sha = b''
     try:
-        res = send_command(CMD_APP_GETSHA256, address, size)
+        res = request_sha(address, size)
         if res[0] == 0:
             if res[1] is not None:
                 if len(res[1]) == (32):
@@ -431,71 +886,104 @@ def get_app_sha(address, size, fw_sha):
         sha = b''
     return sha
 
-#-------------------------------------------------
-def write_firmware(fname, app_name="MicroPython"):
-    try:
-        filesize = os.path.getsize(fname)
-        src_file = open(fname, 'rb')
-    except:
-        print("Error opening firmware file")
-        return
+#-------------------------------
+def show_progress(done, total):
+    # per block write progress
+    if debug is False:
+        print("\r  {}/{} blocks ({}%)".format(done, total, (done * 100) // total), end='', flush=True)
+        if done >= total:
+            print("")
 
-    if (filesize < 0x10000) or (filesize > 0x200000):
-        print("File size must be greater than 64KB and less tham 2MB")
-        src_file.close()
-        return
+#-------------------------------
+def lz4_put_length(out, length):
+    # LZ4 length extension bytes
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
 
-    address = check_fw_file(src_file)
-    if address == 0:
-        src_file.close()
-        return
+#----------------------
+def lz4_compress(src):
+    # compress the buffer into a single LZ4 block (raw block format, no frame header)
+    if lz4_lib is True:
+        return lz4.block.compress(src, mode='high_compression', store_size=False)
+    # simple greedy compressor, used if the lz4 package is not installed
+    out = bytearray()
+    table = {}
+    srclen = len(src)
+    mflimit = srclen - 12  # the last match must start at least 12 bytes before the end
+    anchor = 0
+    idx = 0
+    while idx < mflimit:
+        key = src[idx:idx+4]
+        ref = table.get(key)
+        table[key] = idx
+        if (ref is None) or ((idx - ref) > 0xFFFF):
+            idx += 1
+            continue
+        # extend the match, the last 5 bytes are always literals
+        mlen = 4
+        maxlen = srclen - 5 - idx
+        while (mlen < maxlen) and (src[ref+mlen] == src[idx+mlen]):
+            mlen += 1
+        litlen = idx - anchor
+        out.append((min(litlen, 15) << 4) | min(mlen - 4, 15))
+        if litlen >= 15:
+            lz4_put_length(out, litlen - 15)
+        out += src[anchor:idx]
+        out += struct.pack('<H', idx - ref)
+        if (mlen - 4) >= 15:
+            lz4_put_length(out, mlen - 4 - 15)
+        idx += mlen
+        anchor = idx
+    # last literals
+    litlen = srclen - anchor
+    out.append(min(litlen, 15) << 4)
+    if litlen >= 15:
+        lz4_put_length(out, litlen - 15)
+    out += src[anchor:]
+    return bytes(out)
 
-    # read the content of the file into buffer
-    src_file.seek(0, os.SEEK_SET)
-    srcbuf = src_file.read()
-    src_file.close()
-
-    # adjust the file so taht the size is multiple of 4096
-    add_bytes = len(srcbuf) % DATA_TX_BLOK_SIZE
-    if add_bytes != 0:
-        srcbuf = srcbuf + b'\xFF'*(DATA_TX_BLOK_SIZE-add_bytes)
-    # Calculate SHA256 of the file
-    file_sha = hashlib.sha256(srcbuf).digest()
-    if uart_is_open is False:
-        uart_init()
+#------------------------------------------
+def prepare_blocks(srcbuf, compress=False):
+    # split the buffer into blocks, returns the list of (payload, flags, data_crc)
+    # the compressed payload is used only if it is smaller than the block
+    blocks = []
+    for fidx in range(0, len(srcbuf), DATA_TX_BLOK_SIZE):
+        buf = srcbuf[fidx:fidx+DATA_TX_BLOK_SIZE]
+        data_crc = binascii.crc32(buf)
+        if compress is True:
+            cbuf = lz4_compress(buf)
+            if len(cbuf) < len(buf):
+                blocks.append((cbuf, WRITE_BLOCK_LZ4, data_crc))
+                continue
+        blocks.append((buf, 0, data_crc))
+    return blocks
 
-    fw_address = address
-    fw_length = len(srcbuf)
-    length = filesize
-    total_length = 0
-    print("Write file to flash address {}, size={} ...".format(hex(address), filesize))
-    tstart = time.time()
+#----------------------------------
+def write_blocks(address, srcbuf):
+    # write the buffer block by block, every block is confirmed before the next one is sent
     fidx = 0
     retries = 0
+    length = len(srcbuf)
+    res = (0, None, 0)
 
     while length > 0:
-        #if fidx > (DATA_TX_BLOK_SIZE*3):
-        #    length = 0
-        #    break
         buf = srcbuf[fidx:fidx+DATA_TX_BLOK_SIZE]
         data_crc = binascii.crc32(buf)
         # send write to flash request
         blksize = DATA_TX_BLOK_SIZE
-        if length == DATA_TX_BLOK_SIZE:
-            # last bloc
-            blksize |= 0x01000000
         retry = 0
-        while retry < 5:
+        while retry < WRITE_MAX_TRIES:
             retry += 1
             res = send_command(CMD_WRITE_FLASH, address, blksize, data_crc)
             if res[0] == 0:
-                time.sleep(0.01)
                 res = send_data(buf)
                 if res[0] == 0:
                     address += DATA_TX_BLOK_SIZE
                     length -= DATA_TX_BLOK_SIZE
-                    total_length += DATA_TX_BLOK_SIZE
                     fidx += DATA_TX_BLOK_SIZE
+                    show_progress(fidx // DATA_TX_BLOK_SIZE, len(srcbuf) // DATA_TX_BLOK_SIZE)
                     break
                 else:
                     #print("  error sending data at address {} ({}), try={}".format(hex(address), err_str(res[0]), retry))
@@ -512,17 +1000,410 @@ def write_firmware(fname, app_name="MicroPython"):
                 print("  [{}]".format(binascii.hexlify(res[1]).decode()))
             break
 
+    return (res[0], fidx, retries)
+
+#--------------------------------------------------
+def write_blocks_windowed(address, blocks, window, sel=None, verify=True):
+    # write the blocks prepared by 'prepare_blocks' keeping up to 'window' blocks in flight
+    # 'sel' holds the indexes of the blocks to be sent, all blocks are sent if None
+    # v2 block frames are used if the device supports them
+    # returns None if the device does not support windowed write
+    if sel is None:
+        sel = list(range(len(blocks)))
+    nblocks = len(sel)
+    version = 0
+    if (caps['version'] >= WRITE_VERSION_V2) and (caps['max_block'] == DATA_TX_BLOK_SIZE):
+        version = WRITE_VERSION_V2
+    res = send_command(CMD_WRITE_FLASH_WIN, address, len(blocks) * DATA_TX_BLOK_SIZE, window | (version << WRITE_VERSION_SHIFT))
+    if res[0] == CMD_ERR_UNKNOWN_CMD:
+        print("  windowed write not supported, using block by block write")
+        return None
+    if res[0] != 0:
+        print("  error starting write session ({})".format(err_str(res[0])))
+        return (res[0], 0, 0)
+    v2 = (res[2] >> WRITE_VERSION_SHIFT) == WRITE_VERSION_V2
+    window = max(1, min(window, res[2] & 0xFFFF))
+    debug_print("[write] window={}, v2={}".format(window, v2))
+    flags = 0
+    if (verify is False) and (caps['version'] >= WRITE_VERSION_V2):
+        flags = WRITE_BLOCK_NOVERIFY
+
+    def send(blk):
+        payload, blk_flags, data_crc = blocks[sel[blk]]
+        blk_flags |= flags
+        if v2:
+            send_block_v2(blk, sel[blk], payload, blk_flags, data_crc)
+        else:
+            send_block(blk, address + sel[blk]*DATA_TX_BLOK_SIZE, payload, blk_flags, data_crc)
+
+    acked = [False] * nblocks
+    tries = [0] * nblocks
+    inflight = []   # blocks sent and not yet acknowledged
+    resend = []     # rejected blocks waiting to be sent again
+    base = 0        # lowest not acknowledged block
+    nxt = 0         # next block to be sent the first time
+    retries = 0
+    resyncs = 0
+    done = 0
+    err = 0
+
+    while base < nblocks:
+        # keep the window full, the rejected blocks first
+        while (len(resend) > 0) and (len(inflight) < window):
+            blk = resend.pop(0)
+            send(blk)
+            inflight.append(blk)
+        while (nxt < nblocks) and ((nxt - base) < window) and (len(inflight) < window):
+            send(nxt)
+            inflight.append(nxt)
+            nxt += 1
+
+        ack = get_ack_v2() if v2 else get_ack()
+        if (ack is None) or (ack[1] == WRITE_SEQ_RESYNC) or (ack[0] in (CMD_ERR_CRC, CMD_ERR_DATA, CMD_ERR_LENGTH)):
+            # the device lost the frame sync and discards its input, resend all not acknowledged blocks
+            resyncs += 1
+            retries += 1
+            if resyncs > WRITE_MAX_TRIES:
+                err = 1000 if ack is None else ack[0]
+                break
+            debug_print("[write] resync, ack={}".format(ack))
+            time.sleep(0.05)
+            uart_reset_input()
+            resend = sorted(set(resend + inflight))
+            inflight = []
+            continue
+
+        status, blk, dev_base, detail = ack
+        if blk in inflight:
+            inflight.remove(blk)
+        if blk >= nblocks:
+            continue
+        if status == CMD_ERR_OK:
+            if not acked[blk]:
+                acked[blk] = True
+                done += 1
+                show_progress(done, nblocks)
+            resyncs = 0
+        else:
+            debug_print("[write] block {} rejected ({}), detail={}".format(blk, err_str(status), hex(detail)))
+            tries[blk] += 1
+            retries += 1
+            # the block outside the session range is never accepted
+            if (tries[blk] >= WRITE_MAX_TRIES) or (status == CMD_ERR_ADDRESS):
+                if done > 0:
+                    print("")
+                err = status
+                erridx = ""
+                if status == CMD_ERR_FLASHDATACRC:
+                    erridx = "idx={} ".format(detail)
+                print("  error at address {}: {}{}".format(hex(address + sel[blk]*DATA_TX_BLOK_SIZE), erridx, err_str(status)))
+                break
+            if (blk not in resend) and (not acked[blk]):
+                resend.append(blk)
+        while (base < nblocks) and acked[base]:
+            base += 1
+
+    # end the session, the acknowledges of the resent blocks can come before the end acknowledge
+    if err != 0:
+        time.sleep(0.1)
+        uart_reset_input()
+    if v2:
+        send_block_v2(nblocks, 0, b'')
+        ack = get_ack_v2()
+        while (err == 0) and (ack is not None) and (ack[1] != (nblocks & 0xFFFF)):
+            ack = get_ack_v2()
+    else:
+        send_block(nblocks, 0, b'')
+        ack = get_ack()
+        while (err == 0) and (ack is not None) and (ack[1] != (nblocks & 0xFFFF)):
+            ack = get_ack()
+    if err != 0:
+        uart_reset_input()
+    while (base < nblocks) and acked[base]:
+        base += 1
+    # written length up to the first not written block
+    return (err, (len(blocks) if base >= nblocks else sel[base]) * DATA_TX_BLOK_SIZE, retries)
+
+#------------------------------------
+def get_manifest(address, length):
+    # CRC32 of every flash sector in the range, None if not supported
+    if (not has_feature(CAPS_FEAT_MANIFEST)) or (caps['sector_size'] != DATA_TX_BLOK_SIZE):
+        return None
+    crcs = []
+    max_length = (DATA_BLOK_SIZE // 4) * caps['sector_size']
+    while length > 0:
+        req_length = min(length, max_length)
+        res = send_command(CMD_FLASH_MANIFEST, address, req_length)
+        if (res[0] != 0) or (res[1] is None) or (len(res[1]) != ((req_length // caps['sector_size']) * 4)):
+            debug_print("[get_manifest] error ({})".format(err_str(res[0])))
+            return None
+        crcs += struct.unpack('{}I'.format(len(res[1]) // 4), res[1])
+        address += req_length
+        length -= req_length
+    return crcs
+
+#------------------------------------------------
+def patch_match_len(old, opos, new, npos):
+    # length of the approximate match, maximizing 2*matches - length (as bsdiff does)
+    maxlen = min(len(old) - opos, len(new) - npos)
+    score = 0
+    best = 0
+    bestlen = 0
+    idx = 0
+    while (idx < maxlen) and ((idx - bestlen) < 256):
+        n = min(64, maxlen - idx)
+        if old[opos+idx:opos+idx+n] == new[npos+idx:npos+idx+n]:
+            score += n
+            idx += n
+        else:
+            score += 1 if old[opos+idx] == new[npos+idx] else -1
+            idx += 1
+        if score > best:
+            best = score
+            bestlen = idx
+    return bestlen
+
+#--------------------------
+def make_patch(old, new):
+    # bsdiff style patch stream, sequence of records:
+    # [diff_len, extra_len, seek] + diff_len bytes (new - old) + extra_len bytes of new data
+    # the diff bytes are mostly zeros, the stream is LZ4 compressed when sent
+    index = {}
+    for idx in range(0, len(old) - PATCH_KEY_LEN + 1, PATCH_INDEX_STRIDE):
+        index.setdefault(old[idx:idx+PATCH_KEY_LEN], idx)
+    out = bytearray()
+    # pending diff region, new[dpos:dpos+dlen] against old[dopos:dopos+dlen]
+    dpos = 0
+    dopos = 0
+    dlen = 0
+    pos = 0
+    while pos < len(new):
+        scan = pos
+        match = None
+        while scan <= (len(new) - PATCH_KEY_LEN):
+            match = index.get(new[scan:scan+PATCH_KEY_LEN])
+            if match is not None:
+                break
+            scan += 1
+        if match is None:
+            break
+        # extend the match backwards into the not matched data
+        while (scan > pos) and (match > 0) and (new[scan-1] == old[match-1]):
+            scan -= 1
+            match -= 1
+        length = patch_match_len(old, match, new, scan)
+        out += struct.pack('<IIi', dlen, scan - dpos - dlen, match - dopos - dlen)
+        out += bytes((n - o) & 0xFF for n, o in zip(new[dpos:dpos+dlen], old[dopos:dopos+dlen]))
+        out += new[dpos+dlen:scan]
+        dpos = scan
+        dopos = match
+        dlen = length
+        pos = scan + length
+    out += struct.pack('<IIi', dlen, len(new) - dpos - dlen, 0)
+    out += bytes((n - o) & 0xFF for n, o in zip(new[dpos:dpos+dlen], old[dopos:dopos+dlen]))
+    out += new[dpos+dlen:]
+    return bytes(out)
+
+#-----------------------------------------------
+def prepare_patch(base_fname, address, srcbuf):
+    # prepare the patch against the image in one of the boot slots
+    # returns (base_slot, patch blocks) or None if the patch can not be used
+    if not has_feature(CAPS_FEAT_PATCH):
+        print("  delta update not supported by the bootloader")
+        return None
+    try:
+        with open(base_fname, 'rb') as base_file:
+            basebuf = base_file.read()
+    except:
+        print("  error opening base firmware file")
+        return None
+    add_bytes = len(basebuf) % DATA_TX_BLOK_SIZE
+    if add_bytes != 0:
+        basebuf = basebuf + b'\xFF'*(DATA_TX_BLOK_SIZE-add_bytes)
+    base_sha = hashlib.sha256(basebuf).digest()
+
+    apps = get_app_records()
+    if apps is None:
+        print("  error reading app boot records")
+        return None
+    for slot in range(2):
+        if (apps[slot][4] == base_sha) and ((apps[slot][2] & 0x00FFFFFF) == len(basebuf)):
+            break
+    else:
+        print("  base firmware not found in the boot slots")
+        return None
+    base_address = apps[slot][1]
+    if (address < (base_address + len(basebuf))) and (base_address < (address + len(srcbuf))):
+        print("  firmware address overlaps the base firmware in slot {}".format(slot))
+        return None
+
+    tstart = time.time()
+    patch = make_patch(basebuf, srcbuf)
+    blocks = prepare_blocks(patch, True)
+    print("  patch against slot {}: {} bytes, {} bytes compressed ({:.3f} seconds)".format(
+        slot, len(patch), sum(len(blk[0]) for blk in blocks), time.time() - tstart))
+    return (slot, blocks)
+
+#-------------------------------------------------
+def write_patch(address, length, base_slot, blocks):
+    # send the patch blocks one by one, the device rebuilds the image at 'address'
+    # returns (error, retries)
+    res = send_command(CMD_WRITE_PATCH, address, length, base_slot)
+    if res[0] != 0:
+        print("  error starting patch session ({})".format(err_str(res[0])))
+        return (res[0], 0)
+    nblocks = len(blocks)
+    retries = 0
+    tries = 0
+    seq = 0
+    while seq <= nblocks:
+        # zero length block ends the session
+        if seq < nblocks:
+            send_block(seq, seq * DATA_TX_BLOK_SIZE, *blocks[seq])
+        else:
+            send_block(seq, 0, b'')
+        ack = get_ack()
+        if (ack is not None) and (ack[1] == (seq & 0xFFFF)):
+            if ack[0] == CMD_ERR_OK:
+                seq += 1
+                tries = 0
+                show_progress(min(seq, nblocks), nblocks)
+                continue
+            if ack[0] not in (CMD_ERR_CRC, CMD_ERR_DATA, CMD_ERR_DATACRC):
+                # the device can not continue
+                print("  patch error at block {}: {}, detail={}".format(seq, err_str(ack[0]), hex(ack[3])))
+                return (ack[0], retries)
+        debug_print("[patch] block {} not accepted, ack={}".format(seq, ack))
+        retries += 1
+        tries += 1
+        if tries >= WRITE_MAX_TRIES:
+            return (1000 if ack is None else ack[0], retries)
+        time.sleep(0.05)
+        uart_reset_input()
+    return (0, retries)
+
+#-------------------------------------------------------------------
+def write_firmware(fname, app_name="MicroPython", window=WRITE_WINDOW, compress=False, base=None, full=False, verify=True):
+    try:
+        filesize = os.path.getsize(fname)
+        src_file = open(fname, 'rb')
+    except:
+        print("Error opening firmware file")
+        return
+
+    if (filesize < 0x10000) or (filesize > caps['app_max_size']):
+        print("File size must be greater than 64KB and less tham {}KB".format(caps['app_max_size'] // 1024))
+        src_file.close()
+        return
+
+    address = check_fw_file(src_file)
+    if address == 0:
+        src_file.close()
+        return
+
+    # read the content of the file into buffer
+    src_file.seek(0, os.SEEK_SET)
+    srcbuf = src_file.read()
+    src_file.close()
+
+    # adjust the file so taht the size is multiple of 4096
+    add_bytes = len(srcbuf) % DATA_TX_BLOK_SIZE
+    if add_bytes != 0:
+        srcbuf = srcbuf + b'\xFF'*(DATA_TX_BLOK_SIZE-add_bytes)
+    if (address + len(srcbuf)) > flash_end_address():
+        print("Firmware does not fit into Flash")
+        return
+    # Calculate SHA256 of the file
+    file_sha = hashlib.sha256(srcbuf).digest()
+    if uart_is_open is False:
+        uart_init()
+
+    fw_address = address
+    fw_length = len(srcbuf)
+    print("Write file to flash address {}, size={} ...".format(hex(address), filesize))
+    get_flash_stats(reset=True)
+    tstart = time.time()
+
+    res = None
+    tx_length = 0
+    slot = 0
+    patch = None
+    # the sectors already written by the interrupted write of the same file are not sent again
+    committed = journal_begin(address, fw_length, file_sha)
+    if (committed is not None) and (True in committed) and (full is False):
+        base = None
+    else:
+        committed = None
+    if base is not None:
+        patch = prepare_patch(base, address, srcbuf)
+        if patch is None:
+            print("  writing the full firmware")
+    if caps['max_window'] > 0:
+        window = min(window, caps['max_window'])
+    if patch is not None:
+        # the new firmware goes to the other boot slot
+        slot = patch[0] ^ 1
+        tx_length = sum(len(blk[0]) for blk in patch[1])
+        session_begin(address, fw_length)
+        err, retries = write_patch(address, fw_length, patch[0], patch[1])
+        res = (err, fw_length if err == 0 else 0, retries)
+    elif (window > 0) and has_feature(CAPS_FEAT_WRITE_WIN):
+        if (compress is True) and (not has_feature(CAPS_FEAT_LZ4)):
+            print("  compressed write not supported by the bootloader")
+            compress = False
+        blocks = prepare_blocks(srcbuf, compress)
+        sel = None
+        manifest = None if (full is True) or (committed is not None) else get_manifest(address, fw_length)
+        if committed is not None:
+            # resume the interrupted write
+            sel = [idx for idx in range(len(blocks)) if committed[idx] is False]
+            print("  resuming interrupted write, {} of {} blocks already written".format(len(blocks) - len(sel), len(blocks)))
+        elif manifest is not None:
+            # send only the blocks which differ from the flash content
+            sel = [idx for idx in range(len(blocks)) if blocks[idx][2] != manifest[idx]]
+            print("  {} of {} blocks unchanged, skipped".format(len(blocks) - len(sel), len(blocks)))
+        if compress is True:
+            tx_blocks = range(len(blocks)) if sel is None else sel
+            tx_length = sum(len(blocks[idx][0]) for idx in tx_blocks)
+            tx_raw = len(tx_blocks) * DATA_TX_BLOK_SIZE
+        if (sel is not None) and (len(sel) == 0):
+            res = (0, fw_length, 0)
+        else:
+            if (sel is None) or (len(sel) == len(blocks)):
+                session_begin(address, fw_length)
+            res = write_blocks_windowed(address, blocks, window, sel, verify)
+    elif compress is True:
+        print("  compressed write requires windowed write")
+    if res is None:
+        tx_length = 0
+        session_begin(address, fw_length)
+        res = write_blocks(address, srcbuf)
+    err, total_length, retries = res
+    length = fw_length - total_length
+
     if length <= 0:
-        tellapsed = time.time() - tstart
+        tellapsed = max(time.time() - tstart, 0.001)
         print("{} bytes written in {:.3f} seconds ({:.2f} KB/sec) from '{}'; retries:{}".format(total_length, tellapsed, (total_length / tellapsed) / 1024.0, fname, retries))
+        if patch is not None:
+            print("Patch sent in {} bytes, ratio {:.2f}; effective throughput {:.2f} KB/sec".format(
+                tx_length, fw_length / tx_length, (fw_length / tellapsed) / 1024.0))
+        elif tx_length > 0:
+            print("LZ4 compressed to {} bytes, ratio {:.2f}; effective throughput {:.2f} KB/sec ({:.2f} KB/sec on the link)".format(
+                tx_length, tx_raw / tx_length, (fw_length / tellapsed) / 1024.0, (tx_length / tellapsed) / 1024.0))
+        stats = get_flash_stats()
+        if stats is not None:
+            print("Flash: {} erases, {} erases skipped (programmed without erase), {} pages programmed, {} writes unchanged".format(*stats))
         fwsha = get_app_sha(fw_address, fw_length, file_sha)
         if fwsha == file_sha:
             # write the app boot record for the file
             print("Write boot record")
             is_ok = False
-            boot_rec = struct.pack('16sIII32s', app_name.encode(), fw_address, fw_length, int(time.time()), file_sha)
+            # the new firmware is set as active, the bootloader clears the flag in the other slot
+            boot_rec = struct.pack('16sIII32s', app_name.encode(), fw_address, fw_length | APP_FLAG_ACTIVE, int(time.time()), file_sha)
             data_crc = binascii.crc32(boot_rec)
-            res = send_command(CMD_APP_RECORD_WRITE, address, len(boot_rec), data_crc)
+            # slot 1 is selected in upper 16 bits of the length
+            rec_flags = 0x00020000 if slot == 1 else 0
+            res = send_command(CMD_APP_RECORD_WRITE, address, len(boot_rec) | rec_flags, data_crc)
             if res[0] == 0:
                 res = send_data(boot_rec)
                 if res[0] == 0:
@@ -544,12 +1425,18 @@ if __name__ == '__main__':
         )
 
         parser.add_argument("-p", "--port", help="COM Port", default="/dev/ttyACM0")
+        parser.add_argument("-s", "--serial", help="Use the COM port even if the USB vendor interface is available through libusb", default=False, action="store_true")
         parser.add_argument("-W", "--write", help="Write file to Flash", default=False, action="store_true")
-        parser.add_argument("-E", "--erase", help="Erase the Falsh chip!", default=False, action="store_true")
+        parser.add_argument("-E", "--erase", help="Erase the Flash range given by address and length, the whole application area if not given", default=False, action="store_true")
         parser.add_argument("-R", "--read", help="Read data from Flash", default=False, action="store_true")
-        parser.add_argument("-L", "--rdlen", type=auto_int, help="Length of data to read from Flash", default=0)
+        parser.add_argument("-L", "--rdlen", type=auto_int, help="Length of data to read or erase", default=0)
         parser.add_argument("-a", "--address", type=auto_int, help="Load firmware/data to Flash at address", default=0)
         parser.add_argument("-D", "--debug", help="Print debug messages", default=False, action="store_true")
+        parser.add_argument("-w", "--window", type=int, help="Number of blocks in flight on write, 0 for block by block write", default=WRITE_WINDOW)
+        parser.add_argument("-c", "--compress", help="Send LZ4 compressed blocks on write", default=False, action="store_true")
+        parser.add_argument("-F", "--full", help="Write all blocks, do not skip the sectors which are already equal to the file", default=False, action="store_true")
+        parser.add_argument("-n", "--noverify", help="Do not read back the written blocks, only the firmware SHA-256 is checked", default=False, action="store_true")
+        parser.add_argument("-b", "--base", help="Firmware file in one of the boot slots, write only the delta against it to the other slot", default=None)
         parser.add_argument("firmware", nargs='?', help="firmware bin path, can be omited for read and erase commands", default=None)
 
         args = parser.parse_args()
@@ -562,15 +1449,20 @@ if __name__ == '__main__':
             debug = True
 
         UART_DEVICE = args.port
+        use_usb = not args.serial
         get_info()
 
         if args.read is True:
             read_data(args.address, args.rdlen, args.firmware)
             do_exit("Finished.", 0)
 
+        if args.erase is True:
+            erase_flash(args.address, args.rdlen)
+            do_exit("Finished.", 0)
+
         if args.write is True:
             if args.firmware is not None:
-                write_firmware(args.firmware)
+                write_firmware(args.firmware, window=args.window, compress=args.compress, base=args.base, full=args.full, verify=(not args.noverify))
             else:
                 print("No firmware file name given.")
             do_exit("Finished.", 0)
@@ -51,7 +51,7 @@
 /*! @brief CDC ACM instance count */
 #define USB_DEVICE_CONFIG_CDC_ACM (1U)
 
-/*! @brief MSC instance count */
+/*! @brief MSC instance count, 1U adds the UF2 drag-and-drop flashing volume */
 #define USB_DEVICE_CONFIG_MSC (0U)
 
 /*! @brief Audio instance count */
@@ -69,7 +69,7 @@
 /*! @brief Printer instance count */
 #define USB_DEVICE_CONFIG_PRINTER (0U)
 
-/*! @brief DFU instance count */
+/*! @brief DFU instance count, 1U adds the standard DFU 1.1 firmware download interface */
 #define USB_DEVICE_CONFIG_DFU (0U)
 
 /* @} */
@@ -78,7 +78,11 @@
 #define USB_DEVICE_CONFIG_SELF_POWER (1U)
 
 /*! @brief How many endpoints are supported in the stack. */
-#define USB_DEVICE_CONFIG_ENDPOINTS (4U)
+#if ((defined(USB_DEVICE_CONFIG_MSC)) && (USB_DEVICE_CONFIG_MSC > 0U))
+#define USB_DEVICE_CONFIG_ENDPOINTS (7U)
+#else
+#define USB_DEVICE_CONFIG_ENDPOINTS (6U)
+#endif
 
 /*! @brief Whether the device task is enabled. */
 #define USB_DEVICE_CONFIG_USE_TASK (0U)
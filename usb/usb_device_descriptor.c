@@ -36,6 +36,9 @@
 
 #include "usb_device_class.h"
 #include "usb_device_cdc_acm.h"
+#if ((defined(USB_DEVICE_CONFIG_DFU)) && (USB_DEVICE_CONFIG_DFU > 0U))
+#include "usb_device_dfu.h"
+#endif
 
 #include "usb_device_descriptor.h"
 
@@ -59,6 +62,80 @@ usb_device_endpoint_struct_t g_UsbDeviceCdcVcomDicEndpoints[USB_CDC_VCOM_ENDPOIN
         USB_CDC_VCOM_BULK_OUT_ENDPOINT | (USB_OUT << 7U), USB_ENDPOINT_BULK, FS_CDC_VCOM_BULK_OUT_PACKET_SIZE, 0U,
     }};
 
+/* Define endpoints for the vendor specific interface, initialized by the application */
+usb_device_endpoint_struct_t g_UsbDeviceVendorEndpoints[USB_VENDOR_ENDPOINT_COUNT] = {
+    {
+        USB_VENDOR_BULK_IN_ENDPOINT | (USB_IN << 7U), USB_ENDPOINT_BULK, FS_VENDOR_BULK_IN_PACKET_SIZE, 0U,
+    },
+    {
+        USB_VENDOR_BULK_OUT_ENDPOINT | (USB_OUT << 7U), USB_ENDPOINT_BULK, FS_VENDOR_BULK_OUT_PACKET_SIZE, 0U,
+    }};
+
+#if ((defined(USB_DEVICE_CONFIG_MSC)) && (USB_DEVICE_CONFIG_MSC > 0U))
+/* Define endpoints for mass storage class */
+usb_device_endpoint_struct_t g_UsbDeviceMscEndpoints[USB_MSC_ENDPOINT_COUNT] = {
+    {
+        USB_MSC_BULK_IN_ENDPOINT | (USB_IN << 7U), USB_ENDPOINT_BULK, FS_MSC_BULK_IN_PACKET_SIZE, 0U,
+    },
+    {
+        USB_MSC_BULK_OUT_ENDPOINT | (USB_OUT << 7U), USB_ENDPOINT_BULK, FS_MSC_BULK_OUT_PACKET_SIZE, 0U,
+    }};
+
+/* Define interface for mass storage class */
+usb_device_interface_struct_t g_UsbDeviceMscInterface[] = {
+    {0,
+     {
+         USB_MSC_ENDPOINT_COUNT, g_UsbDeviceMscEndpoints,
+     },
+     NULL}};
+
+/* Define interfaces for mass storage */
+usb_device_interfaces_struct_t g_UsbDeviceMscInterfaces[USB_MSC_INTERFACE_COUNT] = {
+    {USB_MSC_CLASS, USB_MSC_SUBCLASS, USB_MSC_PROTOCOL, USB_MSC_INTERFACE_INDEX, g_UsbDeviceMscInterface,
+     sizeof(g_UsbDeviceMscInterface) / sizeof(usb_device_interface_struct_t)},
+};
+
+/* Define configurations for mass storage */
+usb_device_interface_list_t g_UsbDeviceMscInterfaceList[USB_DEVICE_CONFIGURATION_COUNT] = {
+    {
+        USB_MSC_INTERFACE_COUNT, g_UsbDeviceMscInterfaces,
+    },
+};
+
+/* Define class information for mass storage */
+usb_device_class_struct_t g_UsbDeviceMscConfig = {
+    g_UsbDeviceMscInterfaceList, kUSB_DeviceClassTypeMsc, USB_DEVICE_CONFIGURATION_COUNT,
+};
+#endif
+
+#if ((defined(USB_DEVICE_CONFIG_DFU)) && (USB_DEVICE_CONFIG_DFU > 0U))
+/* Define interface for DFU class */
+usb_device_interface_struct_t g_UsbDeviceDfuInterface[] = {
+    {0,
+     {
+         0U, NULL,
+     },
+     NULL}};
+
+/* Define interfaces for DFU */
+usb_device_interfaces_struct_t g_UsbDeviceDfuInterfaces[USB_DFU_INTERFACE_COUNT] = {
+    {USB_DFU_CLASS, USB_DFU_SUBCLASS, USB_DFU_PROTOCOL, USB_DFU_INTERFACE_INDEX, g_UsbDeviceDfuInterface,
+     sizeof(g_UsbDeviceDfuInterface) / sizeof(usb_device_interface_struct_t)},
+};
+
+/* Define configurations for DFU */
+usb_device_interface_list_t g_UsbDeviceDfuInterfaceList[USB_DEVICE_CONFIGURATION_COUNT] = {
+    {
+        USB_DFU_INTERFACE_COUNT, g_UsbDeviceDfuInterfaces,
+    },
+};
+
+/* Define class information for DFU */
+usb_device_class_struct_t g_UsbDeviceDfuConfig = {
+    g_UsbDeviceDfuInterfaceList, kUSB_DeviceClassTypeDfu, USB_DEVICE_CONFIGURATION_COUNT,
+};
+#endif
+
 /* Define interface for communication class */
 usb_device_interface_struct_t g_UsbDeviceCdcVcomCommunicationInterface[] = {
     {0,
@@ -141,14 +218,18 @@ uint8_t g_UsbDeviceConfigurationDescriptor[] = {
                       USB_DESCRIPTOR_LENGTH_CDC_HEADER_FUNC + USB_DESCRIPTOR_LENGTH_CDC_CALL_MANAG +
                       USB_DESCRIPTOR_LENGTH_CDC_ABSTRACT + USB_DESCRIPTOR_LENGTH_CDC_UNION_FUNC +
                       USB_DESCRIPTOR_LENGTH_ENDPOINT + USB_DESCRIPTOR_LENGTH_INTERFACE +
-                      USB_DESCRIPTOR_LENGTH_ENDPOINT + USB_DESCRIPTOR_LENGTH_ENDPOINT),
+                      USB_DESCRIPTOR_LENGTH_ENDPOINT + USB_DESCRIPTOR_LENGTH_ENDPOINT + USB_IAD_DESC_SIZE +
+                      USB_DESCRIPTOR_LENGTH_INTERFACE + USB_DESCRIPTOR_LENGTH_ENDPOINT + USB_DESCRIPTOR_LENGTH_ENDPOINT +
+                      USB_MSC_DESCRIPTOR_LENGTH + USB_DFU_DESCRIPTOR_LENGTH),
     USB_SHORT_GET_HIGH(USB_DESCRIPTOR_LENGTH_CONFIGURE + USB_DESCRIPTOR_LENGTH_INTERFACE +
                        USB_DESCRIPTOR_LENGTH_CDC_HEADER_FUNC + USB_DESCRIPTOR_LENGTH_CDC_CALL_MANAG +
                        USB_DESCRIPTOR_LENGTH_CDC_ABSTRACT + USB_DESCRIPTOR_LENGTH_CDC_UNION_FUNC +
                        USB_DESCRIPTOR_LENGTH_ENDPOINT + USB_DESCRIPTOR_LENGTH_INTERFACE +
-                       USB_DESCRIPTOR_LENGTH_ENDPOINT + USB_DESCRIPTOR_LENGTH_ENDPOINT),
+                       USB_DESCRIPTOR_LENGTH_ENDPOINT + USB_DESCRIPTOR_LENGTH_ENDPOINT + USB_IAD_DESC_SIZE +
+                       USB_DESCRIPTOR_LENGTH_INTERFACE + USB_DESCRIPTOR_LENGTH_ENDPOINT + USB_DESCRIPTOR_LENGTH_ENDPOINT +
+                       USB_MSC_DESCRIPTOR_LENGTH + USB_DFU_DESCRIPTOR_LENGTH),
     /* Number of interfaces supported by this configuration */
-    USB_CDC_VCOM_INTERFACE_COUNT,
+    USB_DEVICE_INTERFACE_COUNT,
     /* Value to use as an argument to the SetConfiguration() request to select this configuration */
     USB_CDC_VCOM_CONFIGURE_INDEX,
     /* Index of string descriptor describing this configuration */
@@ -162,6 +243,11 @@ uint8_t g_UsbDeviceConfigurationDescriptor[] = {
        fully * operational. Expressed in 2 mA units *  (i.e., 50 = 100 mA).  */
     USB_DEVICE_MAX_POWER,
 
+    /* Interface Association Descriptor of the CDC interfaces */
+    USB_IAD_DESC_SIZE, USB_DESCRIPTOR_TYPE_INTERFACE_ASSOCIATION, USB_CDC_VCOM_COMM_INTERFACE_INDEX,
+    USB_CDC_VCOM_INTERFACE_COUNT, USB_CDC_VCOM_CIC_CLASS, USB_CDC_VCOM_CIC_SUBCLASS, USB_CDC_VCOM_CIC_PROTOCOL,
+    0x00, /* Function Description String Index */
+
     /* Communication Interface Descriptor */
     USB_DESCRIPTOR_LENGTH_INTERFACE, USB_DESCRIPTOR_TYPE_INTERFACE, USB_CDC_VCOM_COMM_INTERFACE_INDEX, 0x00,
     USB_CDC_VCOM_ENDPOINT_CIC_COUNT, USB_CDC_VCOM_CIC_CLASS, USB_CDC_VCOM_CIC_SUBCLASS, USB_CDC_VCOM_CIC_PROTOCOL,
@@ -211,6 +297,52 @@ uint8_t g_UsbDeviceConfigurationDescriptor[] = {
     USB_DESCRIPTOR_LENGTH_ENDPOINT, USB_DESCRIPTOR_TYPE_ENDPOINT, USB_CDC_VCOM_BULK_OUT_ENDPOINT | (USB_OUT << 7U),
     USB_ENDPOINT_BULK, USB_SHORT_GET_LOW(FS_CDC_VCOM_BULK_OUT_PACKET_SIZE),
     USB_SHORT_GET_HIGH(FS_CDC_VCOM_BULK_OUT_PACKET_SIZE), 0x00, /* The polling interval value is every 0 Frames */
+
+    /* Vendor Specific Interface Descriptor */
+    USB_DESCRIPTOR_LENGTH_INTERFACE, USB_DESCRIPTOR_TYPE_INTERFACE, USB_VENDOR_INTERFACE_INDEX, 0x00,
+    USB_VENDOR_ENDPOINT_COUNT, USB_VENDOR_CLASS, USB_VENDOR_SUBCLASS, USB_VENDOR_PROTOCOL,
+    0x00, /* Interface Description String Index*/
+
+    /*Bulk IN Endpoint descriptor */
+    USB_DESCRIPTOR_LENGTH_ENDPOINT, USB_DESCRIPTOR_TYPE_ENDPOINT, USB_VENDOR_BULK_IN_ENDPOINT | (USB_IN << 7U),
+    USB_ENDPOINT_BULK, USB_SHORT_GET_LOW(FS_VENDOR_BULK_IN_PACKET_SIZE),
+    USB_SHORT_GET_HIGH(FS_VENDOR_BULK_IN_PACKET_SIZE), 0x00, /* The polling interval value is every 0 Frames */
+
+    /*Bulk OUT Endpoint descriptor */
+    USB_DESCRIPTOR_LENGTH_ENDPOINT, USB_DESCRIPTOR_TYPE_ENDPOINT, USB_VENDOR_BULK_OUT_ENDPOINT | (USB_OUT << 7U),
+    USB_ENDPOINT_BULK, USB_SHORT_GET_LOW(FS_VENDOR_BULK_OUT_PACKET_SIZE),
+    USB_SHORT_GET_HIGH(FS_VENDOR_BULK_OUT_PACKET_SIZE), 0x00, /* The polling interval value is every 0 Frames */
+#if ((defined(USB_DEVICE_CONFIG_MSC)) && (USB_DEVICE_CONFIG_MSC > 0U))
+
+    /* Mass Storage Interface Descriptor */
+    USB_DESCRIPTOR_LENGTH_INTERFACE, USB_DESCRIPTOR_TYPE_INTERFACE, USB_MSC_INTERFACE_INDEX, 0x00,
+    USB_MSC_ENDPOINT_COUNT, USB_MSC_CLASS, USB_MSC_SUBCLASS, USB_MSC_PROTOCOL,
+    0x00, /* Interface Description String Index*/
+
+    /*Bulk IN Endpoint descriptor */
+    USB_DESCRIPTOR_LENGTH_ENDPOINT, USB_DESCRIPTOR_TYPE_ENDPOINT, USB_MSC_BULK_IN_ENDPOINT | (USB_IN << 7U),
+    USB_ENDPOINT_BULK, USB_SHORT_GET_LOW(FS_MSC_BULK_IN_PACKET_SIZE),
+    USB_SHORT_GET_HIGH(FS_MSC_BULK_IN_PACKET_SIZE), 0x00, /* The polling interval value is every 0 Frames */
+
+    /*Bulk OUT Endpoint descriptor */
+    USB_DESCRIPTOR_LENGTH_ENDPOINT, USB_DESCRIPTOR_TYPE_ENDPOINT, USB_MSC_BULK_OUT_ENDPOINT | (USB_OUT << 7U),
+    USB_ENDPOINT_BULK, USB_SHORT_GET_LOW(FS_MSC_BULK_OUT_PACKET_SIZE),
+    USB_SHORT_GET_HIGH(FS_MSC_BULK_OUT_PACKET_SIZE), 0x00, /* The polling interval value is every 0 Frames */
+#endif
+#if ((defined(USB_DEVICE_CONFIG_DFU)) && (USB_DEVICE_CONFIG_DFU > 0U))
+
+    /* DFU Interface Descriptor */
+    USB_DESCRIPTOR_LENGTH_INTERFACE, USB_DESCRIPTOR_TYPE_INTERFACE, USB_DFU_INTERFACE_INDEX, 0x00,
+    0x00, USB_DFU_CLASS, USB_DFU_SUBCLASS, USB_DFU_PROTOCOL,
+    0x00, /* Interface Description String Index*/
+
+    /* DFU Functional Descriptor */
+    USB_DESCRIPTOR_LENGTH_DFU_FUNCTIONAL, USB_DESCRIPTOR_TYPE_DFU_FUNCTIONAL,
+    USB_DEVICE_DFU_ATTRIBUTES, /* bmAttributes */
+    USB_SHORT_GET_LOW(USB_DEVICE_DFU_DETACH_TIMEOUT), USB_SHORT_GET_HIGH(USB_DEVICE_DFU_DETACH_TIMEOUT),
+    USB_SHORT_GET_LOW(USB_DEVICE_DFU_TRANSFER_SIZE), USB_SHORT_GET_HIGH(USB_DEVICE_DFU_TRANSFER_SIZE),
+    USB_SHORT_GET_LOW(USB_DEVICE_DFU_VERSION), USB_SHORT_GET_HIGH(USB_DEVICE_DFU_VERSION), /* bcdDFUVersion 1.1 */
+#endif
 };
 
 /* Define string descriptor */
@@ -255,6 +387,45 @@ uint8_t g_UsbDeviceString2[] = {2U + 2U * 19U, USB_DESCRIPTOR_TYPE_STRING,
                                 'r',           0,
 };
 
+/* Microsoft OS string descriptor, "MSFT100" signature and the vendor code of the OS descriptors request */
+USB_DMA_INIT_DATA_ALIGN(USB_DATA_ALIGN_SIZE)
+uint8_t g_UsbDeviceMsOsString[] = {2U + 2U * 7U + 2U, USB_DESCRIPTOR_TYPE_STRING,
+                                   'M',           0,
+                                   'S',           0,
+                                   'F',           0,
+                                   'T',           0,
+                                   '1',           0,
+                                   '0',           0,
+                                   '0',           0,
+                                   USB_MS_OS_VENDOR_CODE,
+                                   0x00U,
+};
+
+/* Extended compat ID descriptor, WinUSB function on the vendor interface */
+USB_DMA_INIT_DATA_ALIGN(USB_DATA_ALIGN_SIZE)
+uint8_t g_UsbDeviceMsCompatId[USB_MS_OS_COMPAT_ID_LENGTH] = {
+    /* dwLength */
+    USB_MS_OS_COMPAT_ID_LENGTH, 0x00U, 0x00U, 0x00U,
+    /* bcdVersion 1.00 */
+    0x00U, 0x01U,
+    /* wIndex */
+    USB_SHORT_GET_LOW(USB_MS_OS_COMPAT_ID_INDEX), USB_SHORT_GET_HIGH(USB_MS_OS_COMPAT_ID_INDEX),
+    /* bCount, one function section */
+    0x01U,
+    /* Reserved */
+    0x00U, 0x00U, 0x00U, 0x00U, 0x00U, 0x00U, 0x00U,
+    /* bFirstInterfaceNumber */
+    USB_VENDOR_INTERFACE_INDEX,
+    /* Reserved, must be 1 */
+    0x01U,
+    /* compatibleID */
+    'W', 'I', 'N', 'U', 'S', 'B', 0x00U, 0x00U,
+    /* subCompatibleID */
+    0x00U, 0x00U, 0x00U, 0x00U, 0x00U, 0x00U, 0x00U, 0x00U,
+    /* Reserved */
+    0x00U, 0x00U, 0x00U, 0x00U, 0x00U, 0x00U,
+};
+
 uint8_t *g_UsbDeviceStringDescriptorArray[USB_DEVICE_STRING_COUNT] = {g_UsbDeviceString0, g_UsbDeviceString1,
                                                                       g_UsbDeviceString2};
 
@@ -330,6 +501,11 @@ usb_status_t USB_DeviceGetStringDescriptor(usb_device_handle handle,
         stringDescriptor->buffer = (uint8_t *)g_UsbDeviceLanguageList.languageString;
         stringDescriptor->length = g_UsbDeviceLanguageList.stringLength;
     }
+    else if (stringDescriptor->stringIndex == USB_MS_OS_STRING_INDEX)
+    {
+        stringDescriptor->buffer = g_UsbDeviceMsOsString;
+        stringDescriptor->length = sizeof(g_UsbDeviceMsOsString);
+    }
     else
     {
         uint8_t languageId = 0U;
@@ -357,6 +533,30 @@ usb_status_t USB_DeviceGetStringDescriptor(usb_device_handle handle,
     return kStatus_USB_Success;
 }
 
+/*!
+ * @brief USB device get Microsoft OS descriptor function.
+ *
+ * This function handles the vendor request with the Microsoft OS vendor code, only the extended
+ * compat ID descriptor is supported.
+ *
+ * @param handle The USB device handle.
+ * @param request The pointer to the vendor control request structure.
+ *
+ * @return A USB error code or kStatus_USB_Success.
+ */
+usb_status_t USB_DeviceGetMsOsDescriptor(usb_device_handle handle, usb_device_control_request_struct_t *request)
+{
+    if ((request->isSetup) &&
+        ((request->setup->bmRequestType & USB_REQUEST_TYPE_DIR_MASK) == USB_REQUEST_TYPE_DIR_IN) &&
+        (USB_MS_OS_COMPAT_ID_INDEX == request->setup->wIndex))
+    {
+        request->buffer = g_UsbDeviceMsCompatId;
+        request->length = sizeof(g_UsbDeviceMsCompatId);
+        return kStatus_USB_Success;
+    }
+    return kStatus_USB_InvalidRequest;
+}
+
 /*!
  * @brief USB device set speed function.
  *
@@ -408,6 +608,32 @@ usb_status_t USB_DeviceSetSpeed(usb_device_handle handle, uint8_t speed)
                 {
                     USB_SHORT_TO_LITTLE_ENDIAN_ADDRESS(HS_CDC_VCOM_BULK_OUT_PACKET_SIZE, ptr1->endpoint.wMaxPacketSize);
                 }
+                else if (((ptr1->endpoint.bEndpointAddress & USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_MASK) ==
+                     USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_IN) &&
+                         (USB_VENDOR_BULK_IN_ENDPOINT == (ptr1->endpoint.bEndpointAddress & USB_ENDPOINT_NUMBER_MASK)))
+                {
+                    USB_SHORT_TO_LITTLE_ENDIAN_ADDRESS(HS_VENDOR_BULK_IN_PACKET_SIZE, ptr1->endpoint.wMaxPacketSize);
+                }
+                else if (((ptr1->endpoint.bEndpointAddress & USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_MASK) ==
+                     USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_OUT) &&
+                         (USB_VENDOR_BULK_OUT_ENDPOINT == (ptr1->endpoint.bEndpointAddress & USB_ENDPOINT_NUMBER_MASK)))
+                {
+                    USB_SHORT_TO_LITTLE_ENDIAN_ADDRESS(HS_VENDOR_BULK_OUT_PACKET_SIZE, ptr1->endpoint.wMaxPacketSize);
+                }
+#if ((defined(USB_DEVICE_CONFIG_MSC)) && (USB_DEVICE_CONFIG_MSC > 0U))
+                else if (((ptr1->endpoint.bEndpointAddress & USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_MASK) ==
+                     USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_IN) &&
+                         (USB_MSC_BULK_IN_ENDPOINT == (ptr1->endpoint.bEndpointAddress & USB_ENDPOINT_NUMBER_MASK)))
+                {
+                    USB_SHORT_TO_LITTLE_ENDIAN_ADDRESS(HS_MSC_BULK_IN_PACKET_SIZE, ptr1->endpoint.wMaxPacketSize);
+                }
+                else if (((ptr1->endpoint.bEndpointAddress & USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_MASK) ==
+                     USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_OUT) &&
+                         (USB_MSC_BULK_OUT_ENDPOINT == (ptr1->endpoint.bEndpointAddress & USB_ENDPOINT_NUMBER_MASK)))
+                {
+                    USB_SHORT_TO_LITTLE_ENDIAN_ADDRESS(HS_MSC_BULK_OUT_PACKET_SIZE, ptr1->endpoint.wMaxPacketSize);
+                }
+#endif
                 else
                 {
                 }
@@ -434,6 +660,32 @@ usb_status_t USB_DeviceSetSpeed(usb_device_handle handle, uint8_t speed)
                 {
                     USB_SHORT_TO_LITTLE_ENDIAN_ADDRESS(FS_CDC_VCOM_BULK_OUT_PACKET_SIZE, ptr1->endpoint.wMaxPacketSize);
                 }
+                else if (((ptr1->endpoint.bEndpointAddress & USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_MASK) ==
+                     USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_IN) &&
+                      (USB_VENDOR_BULK_IN_ENDPOINT == (ptr1->endpoint.bEndpointAddress & USB_ENDPOINT_NUMBER_MASK)))
+                {
+                    USB_SHORT_TO_LITTLE_ENDIAN_ADDRESS(FS_VENDOR_BULK_IN_PACKET_SIZE, ptr1->endpoint.wMaxPacketSize);
+                }
+                else if (((ptr1->endpoint.bEndpointAddress & USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_MASK) ==
+                     USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_OUT) &&
+                    (USB_VENDOR_BULK_OUT_ENDPOINT == (ptr1->endpoint.bEndpointAddress & USB_ENDPOINT_NUMBER_MASK)))
+                {
+                    USB_SHORT_TO_LITTLE_ENDIAN_ADDRESS(FS_VENDOR_BULK_OUT_PACKET_SIZE, ptr1->endpoint.wMaxPacketSize);
+                }
+#if ((defined(USB_DEVICE_CONFIG_MSC)) && (USB_DEVICE_CONFIG_MSC > 0U))
+                else if (((ptr1->endpoint.bEndpointAddress & USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_MASK) ==
+                     USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_IN) &&
+                      (USB_MSC_BULK_IN_ENDPOINT == (ptr1->endpoint.bEndpointAddress & USB_ENDPOINT_NUMBER_MASK)))
+                {
+                    USB_SHORT_TO_LITTLE_ENDIAN_ADDRESS(FS_MSC_BULK_IN_PACKET_SIZE, ptr1->endpoint.wMaxPacketSize);
+                }
+                else if (((ptr1->endpoint.bEndpointAddress & USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_MASK) ==
+                     USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_OUT) &&
+                    (USB_MSC_BULK_OUT_ENDPOINT == (ptr1->endpoint.bEndpointAddress & USB_ENDPOINT_NUMBER_MASK)))
+                {
+                    USB_SHORT_TO_LITTLE_ENDIAN_ADDRESS(FS_MSC_BULK_OUT_PACKET_SIZE, ptr1->endpoint.wMaxPacketSize);
+                }
+#endif
                 else
                 {
                 }
@@ -480,6 +732,58 @@ usb_status_t USB_DeviceSetSpeed(usb_device_handle handle, uint8_t speed)
             }
         }
     }
+    for (int i = 0; i < USB_VENDOR_ENDPOINT_COUNT; i++)
+    {
+        if (USB_SPEED_HIGH == speed)
+        {
+            if (g_UsbDeviceVendorEndpoints[i].endpointAddress & USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_MASK)
+            {
+                g_UsbDeviceVendorEndpoints[i].maxPacketSize = HS_VENDOR_BULK_IN_PACKET_SIZE;
+            }
+            else
+            {
+                g_UsbDeviceVendorEndpoints[i].maxPacketSize = HS_VENDOR_BULK_OUT_PACKET_SIZE;
+            }
+        }
+        else
+        {
+            if (g_UsbDeviceVendorEndpoints[i].endpointAddress & USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_MASK)
+            {
+                g_UsbDeviceVendorEndpoints[i].maxPacketSize = FS_VENDOR_BULK_IN_PACKET_SIZE;
+            }
+            else
+            {
+                g_UsbDeviceVendorEndpoints[i].maxPacketSize = FS_VENDOR_BULK_OUT_PACKET_SIZE;
+            }
+        }
+    }
+#if ((defined(USB_DEVICE_CONFIG_MSC)) && (USB_DEVICE_CONFIG_MSC > 0U))
+    for (int i = 0; i < USB_MSC_ENDPOINT_COUNT; i++)
+    {
+        if (USB_SPEED_HIGH == speed)
+        {
+            if (g_UsbDeviceMscEndpoints[i].endpointAddress & USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_MASK)
+            {
+                g_UsbDeviceMscEndpoints[i].maxPacketSize = HS_MSC_BULK_IN_PACKET_SIZE;
+            }
+            else
+            {
+                g_UsbDeviceMscEndpoints[i].maxPacketSize = HS_MSC_BULK_OUT_PACKET_SIZE;
+            }
+        }
+        else
+        {
+            if (g_UsbDeviceMscEndpoints[i].endpointAddress & USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_MASK)
+            {
+                g_UsbDeviceMscEndpoints[i].maxPacketSize = FS_MSC_BULK_IN_PACKET_SIZE;
+            }
+            else
+            {
+                g_UsbDeviceMscEndpoints[i].maxPacketSize = FS_MSC_BULK_OUT_PACKET_SIZE;
+            }
+        }
+    }
+#endif
 
     return kStatus_USB_Success;
 }
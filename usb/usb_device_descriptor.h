@@ -37,7 +37,7 @@
 * Definitions
 ******************************************************************************/
 #define USB_DEVICE_SPECIFIC_BCD_VERSION (0x0200)
-#define USB_DEVICE_DEMO_BCD_VERSION (0x0101U)
+#define USB_DEVICE_DEMO_BCD_VERSION (0x0102U)
 
 /* Communication  Class Codes */
 #define CDC_COMM_CLASS (0x02)
@@ -135,6 +135,35 @@
 #define USB_CDC_VCOM_COMM_INTERFACE_INDEX (0)
 #define USB_CDC_VCOM_DATA_INTERFACE_INDEX (1)
 
+/* Vendor specific interface with a bulk IN/OUT pair, used by the host through libusb/WinUSB */
+#define USB_VENDOR_ENDPOINT_COUNT (2)
+#define USB_VENDOR_BULK_IN_ENDPOINT (4)
+#define USB_VENDOR_BULK_OUT_ENDPOINT (5)
+#define USB_VENDOR_INTERFACE_INDEX (2)
+
+/* Mass storage interface of the UF2 drag-and-drop flashing, one endpoint number for both directions */
+#if ((defined(USB_DEVICE_CONFIG_MSC)) && (USB_DEVICE_CONFIG_MSC > 0U))
+#define USB_MSC_INTERFACE_COUNT (1)
+#else
+#define USB_MSC_INTERFACE_COUNT (0)
+#endif
+#define USB_MSC_ENDPOINT_COUNT (2)
+#define USB_MSC_BULK_IN_ENDPOINT (6)
+#define USB_MSC_BULK_OUT_ENDPOINT (6)
+#define USB_MSC_INTERFACE_INDEX (3)
+
+/* DFU interface of the standard firmware download, it has no endpoints */
+#if ((defined(USB_DEVICE_CONFIG_DFU)) && (USB_DEVICE_CONFIG_DFU > 0U))
+#define USB_DFU_INTERFACE_COUNT (1)
+#else
+#define USB_DFU_INTERFACE_COUNT (0)
+#endif
+#define USB_DFU_INTERFACE_INDEX (USB_MSC_INTERFACE_INDEX + USB_MSC_INTERFACE_COUNT)
+
+/* All interfaces of the composite device */
+#define USB_DEVICE_INTERFACE_COUNT \
+    (USB_CDC_VCOM_INTERFACE_COUNT + 1 + USB_MSC_INTERFACE_COUNT + USB_DFU_INTERFACE_COUNT)
+
 /* Packet size. */
 #define HS_CDC_VCOM_INTERRUPT_IN_PACKET_SIZE (16)
 #define FS_CDC_VCOM_INTERRUPT_IN_PACKET_SIZE (16)
@@ -144,6 +173,14 @@
 #define FS_CDC_VCOM_BULK_IN_PACKET_SIZE (64)
 #define HS_CDC_VCOM_BULK_OUT_PACKET_SIZE (512)
 #define FS_CDC_VCOM_BULK_OUT_PACKET_SIZE (64)
+#define HS_VENDOR_BULK_IN_PACKET_SIZE (512)
+#define FS_VENDOR_BULK_IN_PACKET_SIZE (64)
+#define HS_VENDOR_BULK_OUT_PACKET_SIZE (512)
+#define FS_VENDOR_BULK_OUT_PACKET_SIZE (64)
+#define HS_MSC_BULK_IN_PACKET_SIZE (512)
+#define FS_MSC_BULK_IN_PACKET_SIZE (64)
+#define HS_MSC_BULK_OUT_PACKET_SIZE (512)
+#define FS_MSC_BULK_OUT_PACKET_SIZE (64)
 
 /* String descriptor length. */
 #define USB_DESCRIPTOR_LENGTH_STRING0 (sizeof(g_UsbDeviceString0))
@@ -153,10 +190,16 @@
 #define USB_DESCRIPTOR_TYPE_CDC_CS_INTERFACE (0x24)
 #define USB_DESCRIPTOR_TYPE_CDC_CS_ENDPOINT (0x25)
 
-/* Class code. */
-#define USB_DEVICE_CLASS (0x02)
-#define USB_DEVICE_SUBCLASS (0x00)
-#define USB_DEVICE_PROTOCOL (0x00)
+/* Interface association descriptor, groups the CDC interfaces of the composite device */
+#define USB_IAD_DESC_SIZE (8)
+#ifndef USB_DESCRIPTOR_TYPE_INTERFACE_ASSOCIATION
+#define USB_DESCRIPTOR_TYPE_INTERFACE_ASSOCIATION (0x0BU)
+#endif
+
+/* Class code, miscellaneous device using interface association descriptors */
+#define USB_DEVICE_CLASS (0xEF)
+#define USB_DEVICE_SUBCLASS (0x02)
+#define USB_DEVICE_PROTOCOL (0x01)
 
 #define USB_DEVICE_MAX_POWER (0x32)
 
@@ -168,6 +211,43 @@
 #define USB_CDC_VCOM_DIC_SUBCLASS (0x00)
 #define USB_CDC_VCOM_DIC_PROTOCOL (USB_CDC_NO_CLASS_SPECIFIC_PROTOCOL)
 
+#define USB_VENDOR_CLASS (0xFF)
+#define USB_VENDOR_SUBCLASS (0x00)
+#define USB_VENDOR_PROTOCOL (0x00)
+
+/* Mass storage class, SCSI transparent command set, Bulk-Only Transport */
+#define USB_MSC_CLASS (0x08)
+#define USB_MSC_SUBCLASS (0x06)
+#define USB_MSC_PROTOCOL (0x50)
+
+/* Length of the mass storage interface descriptors in the configuration descriptor */
+#if ((defined(USB_DEVICE_CONFIG_MSC)) && (USB_DEVICE_CONFIG_MSC > 0U))
+#define USB_MSC_DESCRIPTOR_LENGTH (USB_DESCRIPTOR_LENGTH_INTERFACE + USB_DESCRIPTOR_LENGTH_ENDPOINT * USB_MSC_ENDPOINT_COUNT)
+#else
+#define USB_MSC_DESCRIPTOR_LENGTH (0)
+#endif
+
+/* Device firmware upgrade class, DFU mode */
+#define USB_DFU_CLASS (0xFE)
+#define USB_DFU_SUBCLASS (0x01)
+#define USB_DFU_PROTOCOL (0x02)
+
+#define USB_DESCRIPTOR_TYPE_DFU_FUNCTIONAL (0x21)
+#define USB_DESCRIPTOR_LENGTH_DFU_FUNCTIONAL (9)
+
+/* Length of the DFU interface descriptors in the configuration descriptor */
+#if ((defined(USB_DEVICE_CONFIG_DFU)) && (USB_DEVICE_CONFIG_DFU > 0U))
+#define USB_DFU_DESCRIPTOR_LENGTH (USB_DESCRIPTOR_LENGTH_INTERFACE + USB_DESCRIPTOR_LENGTH_DFU_FUNCTIONAL)
+#else
+#define USB_DFU_DESCRIPTOR_LENGTH (0)
+#endif
+
+/* Microsoft OS 1.0 descriptors, Windows binds WinUSB to the vendor interface without an .inf file */
+#define USB_MS_OS_STRING_INDEX (0xEE)
+#define USB_MS_OS_VENDOR_CODE (0x20)
+#define USB_MS_OS_COMPAT_ID_INDEX (0x0004)
+#define USB_MS_OS_COMPAT_ID_LENGTH (40)
+
 /*******************************************************************************
 * API
 ******************************************************************************/
@@ -225,4 +305,17 @@ usb_status_t USB_DeviceGetStringDescriptor(usb_device_handle handle,
  */
 extern usb_status_t USB_DeviceGetConfigurationDescriptor(
     usb_device_handle handle, usb_device_get_configuration_descriptor_struct_t *configurationDescriptor);
+/*!
+ * @brief USB device get Microsoft OS descriptor function.
+ *
+ * This function handles the vendor request with the Microsoft OS vendor code, only the extended
+ * compat ID descriptor is supported.
+ *
+ * @param handle The USB device handle.
+ * @param request The pointer to the vendor control request structure.
+ *
+ * @return A USB error code or kStatus_USB_Success.
+ */
+extern usb_status_t USB_DeviceGetMsOsDescriptor(usb_device_handle handle,
+                                                usb_device_control_request_struct_t *request);
 #endif /* _USB_DEVICE_DESCRIPTOR_H_ */
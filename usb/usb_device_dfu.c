@@ -0,0 +1,501 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Part of the iMX RT MicroPython port
+ * iMX RT CDC ACM Bootloader with OTA support
+ *
+ * Code inspired by CDC Arduino bootloader for SeeedStudio's ArchMix board
+ * https://github.com/Seeed-Studio/ArduinoCore-imxrt/tree/master/bootloaders
+ * 
+ * Author: LoBo (loboris@gmail.com)
+ * 
+ * Copyright (C) 2021  LoBo
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "usb_device_config.h"
+#include "usb.h"
+#include "usb_device.h"
+
+#include "usb_device_class.h"
+
+#if ((defined(USB_DEVICE_CONFIG_DFU)) && (USB_DEVICE_CONFIG_DFU > 0U))
+#include "usb_device_dfu.h"
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+
+/* Transfer buffers of one instance, DMA capable */
+typedef struct _usb_device_dfu_buffer
+{
+    uint8_t status[USB_DEVICE_DFU_STATUS_LENGTH];
+} usb_device_dfu_buffer_t;
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+/* DFU device instance */
+USB_GLOBAL USB_RAM_ADDRESS_ALIGNMENT(USB_DATA_ALIGN_SIZE) usb_device_dfu_struct_t g_dfuHandle[USB_DEVICE_CONFIG_DFU];
+
+USB_DMA_NONINIT_DATA_ALIGN(USB_DATA_ALIGN_SIZE) static usb_device_dfu_buffer_t s_dfuBuffer[USB_DEVICE_CONFIG_DFU];
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/*!
+ * @brief Allocates the DFU device handle.
+ *
+ * @param handle The class handle of the DFU class.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+static usb_status_t USB_DeviceDfuAllocateHandle(usb_device_dfu_struct_t **handle)
+{
+    uint32_t count;
+    for (count = 0; count < USB_DEVICE_CONFIG_DFU; count++)
+    {
+        if (NULL == g_dfuHandle[count].handle)
+        {
+            g_dfuHandle[count].statusBuffer = s_dfuBuffer[count].status;
+            *handle                         = &g_dfuHandle[count];
+            return kStatus_USB_Success;
+        }
+    }
+
+    return kStatus_USB_Busy;
+}
+
+/*!
+ * @brief Frees the DFU device handle.
+ *
+ * @param handle The class handle of the DFU class.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+static usb_status_t USB_DeviceDfuFreeHandle(usb_device_dfu_struct_t *handle)
+{
+    handle->handle        = NULL;
+    handle->configStruct  = NULL;
+    handle->configuration = 0;
+    handle->alternate     = 0;
+    handle->state         = kUSB_DeviceDfuStateIdle;
+    return kStatus_USB_Success;
+}
+
+/*!
+ * @brief Calls the application callback of the DFU class.
+ *
+ * @param dfuHandle The DFU device handle.
+ * @param event The usb_device_dfu_event_t event.
+ * @param param The parameter of the event.
+ * @return The error code returned by the application.
+ */
+static usb_status_t USB_DeviceDfuCallback(usb_device_dfu_struct_t *dfuHandle, uint32_t event, void *param)
+{
+    if ((NULL == dfuHandle->configStruct) || (NULL == dfuHandle->configStruct->classCallback))
+    {
+        return kStatus_USB_Error;
+    }
+    /* classCallback is initialized in classInit of s_UsbDeviceClassInterfaceMap,
+       it is from the second parameter of classInit */
+    return dfuHandle->configStruct->classCallback((class_handle_t)dfuHandle, event, param);
+}
+
+/*!
+ * @brief Returns to the dfuIDLE state, the download in progress is aborted.
+ *
+ * @param dfuHandle The DFU device handle.
+ */
+static void USB_DeviceDfuReset(usb_device_dfu_struct_t *dfuHandle)
+{
+    switch (dfuHandle->state)
+    {
+        case kUSB_DeviceDfuStateDnloadSync:
+        case kUSB_DeviceDfuStateDnBusy:
+        case kUSB_DeviceDfuStateDnloadIdle:
+        case kUSB_DeviceDfuStateManifestSync:
+            USB_DeviceDfuCallback(dfuHandle, kUSB_DeviceDfuEventAbort, NULL);
+            break;
+        default:
+            break;
+    }
+    dfuHandle->state  = kUSB_DeviceDfuStateIdle;
+    dfuHandle->status = kUSB_DeviceDfuStatusOk;
+    dfuHandle->offset = 0U;
+}
+
+/*!
+ * @brief Finds the DFU interface of the current configuration.
+ *
+ * @param dfuHandle The DFU device handle.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+static usb_status_t USB_DeviceDfuInterfaceInit(usb_device_dfu_struct_t *dfuHandle)
+{
+    usb_device_interface_list_t *interfaceList;
+
+    dfuHandle->interfaceHandle = NULL;
+    /* return error when configuration is invalid (0 or more than the configuration number) */
+    if ((dfuHandle->configuration == 0U) ||
+        (dfuHandle->configuration > dfuHandle->configStruct->classInfomation->configurations))
+    {
+        return kStatus_USB_Error;
+    }
+
+    interfaceList = &dfuHandle->configStruct->classInfomation->interfaceList[dfuHandle->configuration - 1];
+
+    for (uint32_t count = 0; count < interfaceList->count; count++)
+    {
+        if (USB_DEVICE_CONFIG_DFU_CLASS_CODE == interfaceList->interfaces[count].classCode)
+        {
+            for (uint32_t index = 0; index < interfaceList->interfaces[count].count; index++)
+            {
+                if (interfaceList->interfaces[count].interface[index].alternateSetting == dfuHandle->alternate)
+                {
+                    dfuHandle->interfaceHandle = &interfaceList->interfaces[count].interface[index];
+                    break;
+                }
+            }
+            dfuHandle->interfaceNumber = interfaceList->interfaces[count].interfaceNumber;
+            break;
+        }
+    }
+    return (dfuHandle->interfaceHandle) ? kStatus_USB_Success : kStatus_USB_Error;
+}
+
+/*!
+ * @brief Processes the DFU class request.
+ *
+ * DFU_DNLOAD is called twice, the block buffer is requested in the setup stage and the received block is
+ * passed to the application after the data stage. The request not valid in the current state moves the
+ * device to the dfuERROR state and is stalled.
+ *
+ * @param dfuHandle The DFU device handle.
+ * @param controlRequest The control request.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+static usb_status_t USB_DeviceDfuRequest(usb_device_dfu_struct_t *dfuHandle,
+                                         usb_device_control_request_struct_t *controlRequest)
+{
+    usb_setup_struct_t *setup = controlRequest->setup;
+    usb_device_dfu_block_struct_t block;
+    usb_device_dfu_status_struct_t status;
+    uint8_t state = dfuHandle->state;
+
+    block.offset      = dfuHandle->offset;
+    block.buffer      = NULL;
+    block.length      = setup->wLength;
+    block.blockNumber = setup->wValue;
+
+    switch (setup->bRequest)
+    {
+        case USB_DEVICE_DFU_DNLOAD:
+            if (!controlRequest->isSetup)
+            {
+                /* the block is received */
+                block.buffer = controlRequest->buffer;
+                block.length = controlRequest->length;
+                dfuHandle->offset += block.length;
+                dfuHandle->state = kUSB_DeviceDfuStateDnloadSync;
+                USB_DeviceDfuCallback(dfuHandle, kUSB_DeviceDfuEventDownload, &block);
+                return kStatus_USB_Success;
+            }
+            if ((kUSB_DeviceDfuStateIdle != state) && (kUSB_DeviceDfuStateDnloadIdle != state))
+            {
+                break;
+            }
+            if (0U == setup->wLength)
+            {
+                /* the zero length block ends the download */
+                if (kUSB_DeviceDfuStateIdle == state)
+                {
+                    break;
+                }
+                block.length     = 0U;
+                dfuHandle->state = kUSB_DeviceDfuStateManifestSync;
+                USB_DeviceDfuCallback(dfuHandle, kUSB_DeviceDfuEventManifest, &block);
+                return kStatus_USB_Success;
+            }
+            if (setup->wLength > USB_DEVICE_DFU_TRANSFER_SIZE)
+            {
+                break;
+            }
+            if (kUSB_DeviceDfuStateIdle == state)
+            {
+                block.offset = dfuHandle->offset = 0U;
+            }
+            if ((kStatus_USB_Success != USB_DeviceDfuCallback(dfuHandle, kUSB_DeviceDfuEventDownloadBuffer, &block)) ||
+                (NULL == block.buffer))
+            {
+                break;
+            }
+            controlRequest->buffer = block.buffer;
+            controlRequest->length = setup->wLength;
+            return kStatus_USB_Success;
+        case USB_DEVICE_DFU_UPLOAD:
+            if (((kUSB_DeviceDfuStateIdle != state) && (kUSB_DeviceDfuStateUploadIdle != state)) ||
+                (0U == setup->wLength) || (setup->wLength > USB_DEVICE_DFU_TRANSFER_SIZE))
+            {
+                break;
+            }
+            if (kUSB_DeviceDfuStateIdle == state)
+            {
+                block.offset = dfuHandle->offset = 0U;
+            }
+            if (kStatus_USB_Success != USB_DeviceDfuCallback(dfuHandle, kUSB_DeviceDfuEventUpload, &block))
+            {
+                break;
+            }
+            if (block.length > setup->wLength)
+            {
+                block.length = setup->wLength;
+            }
+            dfuHandle->offset += block.length;
+            /* the short block ends the upload */
+            dfuHandle->state       = (block.length < setup->wLength) ? kUSB_DeviceDfuStateIdle : kUSB_DeviceDfuStateUploadIdle;
+            controlRequest->buffer = block.buffer;
+            controlRequest->length = block.length;
+            return kStatus_USB_Success;
+        case USB_DEVICE_DFU_GETSTATUS:
+            if (kUSB_DeviceDfuStateManifestWaitReset == state)
+            {
+                break;
+            }
+            status.pollTimeout = 0U;
+            status.status      = kUSB_DeviceDfuStatusOk;
+            status.busy        = 0U;
+            if ((kUSB_DeviceDfuStateDnloadSync == state) || (kUSB_DeviceDfuStateManifestSync == state))
+            {
+                USB_DeviceDfuCallback(dfuHandle, kUSB_DeviceDfuEventGetStatus, &status);
+                if (kUSB_DeviceDfuStatusOk != status.status)
+                {
+                    dfuHandle->state  = kUSB_DeviceDfuStateError;
+                    dfuHandle->status = status.status;
+                    state             = kUSB_DeviceDfuStateError;
+                }
+                else if (status.busy)
+                {
+                    /* the state is synchronized again by the next DFU_GETSTATUS */
+                    state = (kUSB_DeviceDfuStateDnloadSync == state) ? kUSB_DeviceDfuStateDnBusy :
+                                                                        kUSB_DeviceDfuStateManifest;
+                }
+                else
+                {
+                    /* manifestation tolerant, the device is ready for the next download */
+                    state = (kUSB_DeviceDfuStateDnloadSync == state) ? kUSB_DeviceDfuStateDnloadIdle :
+                                                                        kUSB_DeviceDfuStateIdle;
+                    dfuHandle->state = state;
+                }
+            }
+            dfuHandle->statusBuffer[0] = dfuHandle->status;
+            dfuHandle->statusBuffer[1] = (uint8_t)status.pollTimeout;
+            dfuHandle->statusBuffer[2] = (uint8_t)(status.pollTimeout >> 8U);
+            dfuHandle->statusBuffer[3] = (uint8_t)(status.pollTimeout >> 16U);
+            dfuHandle->statusBuffer[4] = state;
+            dfuHandle->statusBuffer[5] = 0U;
+            controlRequest->buffer     = dfuHandle->statusBuffer;
+            controlRequest->length     = USB_DEVICE_DFU_STATUS_LENGTH;
+            return kStatus_USB_Success;
+        case USB_DEVICE_DFU_CLRSTATUS:
+            if (kUSB_DeviceDfuStateError != state)
+            {
+                break;
+            }
+            USB_DeviceDfuReset(dfuHandle);
+            return kStatus_USB_Success;
+        case USB_DEVICE_DFU_GETSTATE:
+            dfuHandle->statusBuffer[0] = state;
+            controlRequest->buffer     = dfuHandle->statusBuffer;
+            controlRequest->length     = 1U;
+            return kStatus_USB_Success;
+        case USB_DEVICE_DFU_ABORT:
+            if ((kUSB_DeviceDfuStateError == state) || (kUSB_DeviceDfuStateManifestWaitReset == state))
+            {
+                break;
+            }
+            USB_DeviceDfuReset(dfuHandle);
+            return kStatus_USB_Success;
+        default:
+            break;
+    }
+
+    /* not supported in this state */
+    if (kUSB_DeviceDfuStateError != dfuHandle->state)
+    {
+        USB_DeviceDfuReset(dfuHandle);
+        dfuHandle->state  = kUSB_DeviceDfuStateError;
+        dfuHandle->status = kUSB_DeviceDfuStatusErrStalledPacket;
+    }
+    return kStatus_USB_InvalidRequest;
+}
+
+/*!
+ * @brief Handles the DFU class event.
+ *
+ * This function responses to the common device events and the DFU class requests.
+ *
+ * @param handle The class handle of the DFU class.
+ * @param event The event type.
+ * @param param The parameter of the event.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+usb_status_t USB_DeviceDfuEvent(void *handle, uint32_t event, void *param)
+{
+    usb_device_dfu_struct_t *dfuHandle;
+    usb_status_t error = kStatus_USB_Error;
+    uint16_t interfaceAlternate;
+    uint8_t *temp8;
+
+    if ((!param) || (!handle))
+    {
+        return kStatus_USB_InvalidHandle;
+    }
+
+    dfuHandle = (usb_device_dfu_struct_t *)handle;
+
+    switch (event)
+    {
+        case kUSB_DeviceClassEventDeviceReset:
+            /* Bus reset, clear the configuration, the download is aborted. */
+            dfuHandle->configuration   = 0;
+            dfuHandle->interfaceHandle = NULL;
+            USB_DeviceDfuReset(dfuHandle);
+            break;
+        case kUSB_DeviceClassEventSetConfiguration:
+            temp8 = ((uint8_t *)param);
+            if (!dfuHandle->configStruct)
+            {
+                break;
+            }
+            if (*temp8 == dfuHandle->configuration)
+            {
+                break;
+            }
+            USB_DeviceDfuReset(dfuHandle);
+            dfuHandle->configuration = *temp8;
+            dfuHandle->alternate     = 0;
+            error                    = USB_DeviceDfuInterfaceInit(dfuHandle);
+            break;
+        case kUSB_DeviceClassEventSetInterface:
+            if (!dfuHandle->configStruct)
+            {
+                break;
+            }
+            interfaceAlternate = *((uint16_t *)param);
+
+            if (dfuHandle->interfaceNumber != ((uint8_t)(interfaceAlternate >> 8U)))
+            {
+                break;
+            }
+            USB_DeviceDfuReset(dfuHandle);
+            dfuHandle->alternate = (uint8_t)(interfaceAlternate & 0xFFU);
+            error                = USB_DeviceDfuInterfaceInit(dfuHandle);
+            break;
+        case kUSB_DeviceClassEventClassRequest:
+            if (param)
+            {
+                usb_device_control_request_struct_t *controlRequest = (usb_device_control_request_struct_t *)param;
+
+                if ((!dfuHandle->interfaceHandle) ||
+                    ((controlRequest->setup->bmRequestType & USB_REQUEST_TYPE_RECIPIENT_MASK) !=
+                     USB_REQUEST_TYPE_RECIPIENT_INTERFACE) ||
+                    ((controlRequest->setup->wIndex & 0xFFU) != dfuHandle->interfaceNumber))
+                {
+                    break;
+                }
+                error = USB_DeviceDfuRequest(dfuHandle, controlRequest);
+            }
+            break;
+        default:
+            break;
+    }
+    return error;
+}
+
+/*!
+ * @brief Initializes the USB DFU class.
+ *
+ * This function obtains a usb device handle according to the controller id and initializes the DFU class
+ * with the class configure parameters.
+ *
+ * @param controllerId The id of the controller.
+ * @param config The class configuration structure.
+ * @param handle It is out parameter. The class handle of the DFU class.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+usb_status_t USB_DeviceDfuInit(uint8_t controllerId, usb_device_class_config_struct_t *config, class_handle_t *handle)
+{
+    usb_device_dfu_struct_t *dfuHandle;
+    usb_status_t error = kStatus_USB_Error;
+
+    error = USB_DeviceDfuAllocateHandle(&dfuHandle);
+
+    if (kStatus_USB_Success != error)
+    {
+        return error;
+    }
+
+    error = USB_DeviceClassGetDeviceHandle(controllerId, &dfuHandle->handle);
+
+    if (kStatus_USB_Success != error)
+    {
+        return error;
+    }
+
+    if (!dfuHandle->handle)
+    {
+        return kStatus_USB_InvalidHandle;
+    }
+    dfuHandle->configStruct    = config;
+    dfuHandle->configuration   = 0;
+    dfuHandle->alternate       = 0xFF;
+    dfuHandle->interfaceHandle = NULL;
+    dfuHandle->state           = kUSB_DeviceDfuStateIdle;
+    dfuHandle->status          = kUSB_DeviceDfuStatusOk;
+    dfuHandle->offset          = 0U;
+
+    *handle = (class_handle_t)dfuHandle;
+    return error;
+}
+
+/*!
+ * @brief De-initializes the USB DFU class.
+ *
+ * @param handle The class handle of the DFU class.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+usb_status_t USB_DeviceDfuDeinit(class_handle_t handle)
+{
+    usb_device_dfu_struct_t *dfuHandle;
+
+    dfuHandle = (usb_device_dfu_struct_t *)handle;
+
+    if (!dfuHandle)
+    {
+        return kStatus_USB_InvalidHandle;
+    }
+    USB_DeviceDfuReset(dfuHandle);
+    USB_DeviceDfuFreeHandle(dfuHandle);
+    return kStatus_USB_Success;
+}
+
+#endif
@@ -0,0 +1,209 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Part of the iMX RT MicroPython port
+ * iMX RT CDC ACM Bootloader with OTA support
+ *
+ * Code inspired by CDC Arduino bootloader for SeeedStudio's ArchMix board
+ * https://github.com/Seeed-Studio/ArduinoCore-imxrt/tree/master/bootloaders
+ * 
+ * Author: LoBo (loboris@gmail.com)
+ * 
+ * Copyright (C) 2021  LoBo
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _USB_DEVICE_DFU_H_
+#define _USB_DEVICE_DFU_H_ 1
+
+/*!
+ * @addtogroup dfu
+ * @{
+ */
+
+/*******************************************************************************
+* Definitions
+******************************************************************************/
+#define USB_DEVICE_CONFIG_DFU_CLASS_CODE (0xFE) /*!< The application specific class code. */
+#define USB_DEVICE_DFU_SUBCLASS_CODE (0x01)     /*!< Device firmware upgrade. */
+
+/* DFU class requests */
+#define USB_DEVICE_DFU_DETACH (0x00U)
+#define USB_DEVICE_DFU_DNLOAD (0x01U)
+#define USB_DEVICE_DFU_UPLOAD (0x02U)
+#define USB_DEVICE_DFU_GETSTATUS (0x03U)
+#define USB_DEVICE_DFU_CLRSTATUS (0x04U)
+#define USB_DEVICE_DFU_GETSTATE (0x05U)
+#define USB_DEVICE_DFU_ABORT (0x06U)
+
+/* DFU functional descriptor attributes */
+#define USB_DEVICE_DFU_CAN_DOWNLOAD (0x01U)
+#define USB_DEVICE_DFU_CAN_UPLOAD (0x02U)
+#define USB_DEVICE_DFU_MANIFESTATION_TOLERANT (0x04U)
+#define USB_DEVICE_DFU_WILL_DETACH (0x08U)
+
+/*! @brief The device stays in DFU mode after the download, the host can read the image back. */
+#define USB_DEVICE_DFU_ATTRIBUTES \
+    (USB_DEVICE_DFU_CAN_DOWNLOAD | USB_DEVICE_DFU_CAN_UPLOAD | USB_DEVICE_DFU_MANIFESTATION_TOLERANT)
+
+/*! @brief Max DFU_DNLOAD/DFU_UPLOAD block, wTransferSize. */
+#ifndef USB_DEVICE_DFU_TRANSFER_SIZE
+#define USB_DEVICE_DFU_TRANSFER_SIZE (8192U)
+#endif
+#define USB_DEVICE_DFU_DETACH_TIMEOUT (0x00FFU) /*!< ms, wDetachTimeOut. */
+#define USB_DEVICE_DFU_VERSION (0x0110U)        /*!< DFU 1.1 */
+
+#define USB_DEVICE_DFU_STATUS_LENGTH (6U)
+
+/*! @brief DFU states, bState. */
+typedef enum _usb_device_dfu_state
+{
+    kUSB_DeviceDfuStateAppIdle = 0x00U,
+    kUSB_DeviceDfuStateAppDetach,
+    kUSB_DeviceDfuStateIdle,
+    kUSB_DeviceDfuStateDnloadSync,
+    kUSB_DeviceDfuStateDnBusy,
+    kUSB_DeviceDfuStateDnloadIdle,
+    kUSB_DeviceDfuStateManifestSync,
+    kUSB_DeviceDfuStateManifest,
+    kUSB_DeviceDfuStateManifestWaitReset,
+    kUSB_DeviceDfuStateUploadIdle,
+    kUSB_DeviceDfuStateError,
+} usb_device_dfu_state_t;
+
+/*! @brief DFU status codes, bStatus. */
+typedef enum _usb_device_dfu_status
+{
+    kUSB_DeviceDfuStatusOk = 0x00U,
+    kUSB_DeviceDfuStatusErrTarget,
+    kUSB_DeviceDfuStatusErrFile,
+    kUSB_DeviceDfuStatusErrWrite,
+    kUSB_DeviceDfuStatusErrErase,
+    kUSB_DeviceDfuStatusErrCheckErased,
+    kUSB_DeviceDfuStatusErrProg,
+    kUSB_DeviceDfuStatusErrVerify,
+    kUSB_DeviceDfuStatusErrAddress,
+    kUSB_DeviceDfuStatusErrNotDone,
+    kUSB_DeviceDfuStatusErrFirmware,
+    kUSB_DeviceDfuStatusErrVendor,
+    kUSB_DeviceDfuStatusErrUsbReset,
+    kUSB_DeviceDfuStatusErrPowerOnReset,
+    kUSB_DeviceDfuStatusErrUnknown,
+    kUSB_DeviceDfuStatusErrStalledPacket,
+} usb_device_dfu_status_t;
+
+/*! @brief Available DFU class events. */
+typedef enum _usb_device_dfu_event
+{
+    kUSB_DeviceDfuEventDownloadBuffer = 0x01U, /*!< Get the buffer receiving the download block. */
+    kUSB_DeviceDfuEventDownload,               /*!< The download block was received into the buffer. */
+    kUSB_DeviceDfuEventManifest,               /*!< The download is complete, start the manifestation. */
+    kUSB_DeviceDfuEventUpload,                 /*!< Get the upload block. */
+    kUSB_DeviceDfuEventGetStatus,              /*!< Get the status of the download or the manifestation. */
+    kUSB_DeviceDfuEventAbort,                  /*!< The download was aborted. */
+} usb_device_dfu_event_t;
+
+/*! @brief Download and upload block, the parameter of the block events. */
+typedef struct _usb_device_dfu_block_struct
+{
+    uint32_t offset;      /*!< Offset of the block in the image. */
+    uint8_t *buffer;      /*!< Block data. */
+    uint32_t length;      /*!< Block length, the upload block shorter than requested ends the upload. */
+    uint16_t blockNumber; /*!< wValue of the request. */
+} usb_device_dfu_block_struct_t;
+
+/*! @brief Download status, kUSB_DeviceDfuEventGetStatus parameter. */
+typedef struct _usb_device_dfu_status_struct
+{
+    uint32_t pollTimeout; /*!< ms before the next DFU_GETSTATUS if busy. */
+    uint8_t status;       /*!< usb_device_dfu_status_t, the download failed if not kUSB_DeviceDfuStatusOk. */
+    uint8_t busy;         /*!< The next block can not be received yet, or the manifestation is not finished. */
+} usb_device_dfu_status_struct_t;
+
+/*! @brief The DFU device structure. */
+typedef struct _usb_device_dfu_struct
+{
+    usb_device_handle handle;                       /*!< The handle of the USB device. */
+    usb_device_class_config_struct_t *configStruct; /*!< The class configure structure. */
+    usb_device_interface_struct_t *interfaceHandle; /*!< The current interface handle. */
+    uint8_t *statusBuffer;                          /*!< DFU_GETSTATUS/DFU_GETSTATE response buffer. */
+    uint32_t offset;                                /*!< Image bytes transferred by the download or upload. */
+    uint8_t configuration;                          /*!< The current configuration value. */
+    uint8_t interfaceNumber;                        /*!< The current interface number. */
+    uint8_t alternate;                              /*!< The alternate setting value of the interface. */
+    uint8_t state;                                  /*!< usb_device_dfu_state_t. */
+    uint8_t status;                                 /*!< usb_device_dfu_status_t of the error state. */
+} usb_device_dfu_struct_t;
+
+/*******************************************************************************
+* API
+******************************************************************************/
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*!
+ * @name USB DFU Class Driver
+ * @{
+ */
+
+/*!
+ * @brief Initializes the USB DFU class.
+ *
+ * @param controllerId The id of the controller.
+ * @param config The class configuration structure.
+ * @param handle It is out parameter. The class handle of the DFU class.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+extern usb_status_t USB_DeviceDfuInit(uint8_t controllerId,
+                                      usb_device_class_config_struct_t *config,
+                                      class_handle_t *handle);
+
+/*!
+ * @brief De-initializes the USB DFU class.
+ *
+ * @param handle The class handle of the DFU class.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+extern usb_status_t USB_DeviceDfuDeinit(class_handle_t handle);
+
+/*!
+ * @brief Handles the event passed to the DFU class.
+ *
+ * The download blocks are passed to the application as they are received, the application keeps the
+ * host waiting by reporting busy status until it has a free buffer for the next block.
+ *
+ * @param handle The class handle of the DFU class.
+ * @param event The event type.
+ * @param param The parameter of the event.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+extern usb_status_t USB_DeviceDfuEvent(void *handle, uint32_t event, void *param);
+
+/*! @}*/
+
+#if defined(__cplusplus)
+}
+#endif
+
+/*! @}*/
+
+#endif /* _USB_DEVICE_DFU_H_ */
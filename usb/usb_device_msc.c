@@ -0,0 +1,1054 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Part of the iMX RT MicroPython port
+ * iMX RT CDC ACM Bootloader with OTA support
+ *
+ * Code inspired by CDC Arduino bootloader for SeeedStudio's ArchMix board
+ * https://github.com/Seeed-Studio/ArduinoCore-imxrt/tree/master/bootloaders
+ * 
+ * Author: LoBo (loboris@gmail.com)
+ * 
+ * Copyright (C) 2021  LoBo
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "usb_device_config.h"
+#include "usb.h"
+#include "usb_device.h"
+
+#include "usb_device_class.h"
+
+#if ((defined(USB_DEVICE_CONFIG_MSC)) && (USB_DEVICE_CONFIG_MSC > 0U))
+#include "usb_device_msc.h"
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define USB_DEVICE_MSC_ENTER_CRITICAL() \
+    USB_OSA_SR_ALLOC();                 \
+    USB_OSA_ENTER_CRITICAL()
+
+#define USB_DEVICE_MSC_EXIT_CRITICAL() USB_OSA_EXIT_CRITICAL()
+
+#define USB_DEVICE_MSC_INQUIRY_LENGTH (36U)
+#define USB_DEVICE_MSC_SENSE_LENGTH (18U)
+
+/* Transfer buffers of one instance, DMA capable */
+typedef struct _usb_device_msc_buffer
+{
+    uint8_t block[USB_DEVICE_MSC_BLOCK_SIZE];
+    usb_device_msc_cbw_t cbw;
+    usb_device_msc_csw_t csw;
+} usb_device_msc_buffer_t;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static usb_status_t USB_DeviceMscSendCsw(usb_device_msc_struct_t *mscHandle);
+static usb_status_t USB_DeviceMscReadBlock(usb_device_msc_struct_t *mscHandle);
+static usb_status_t USB_DeviceMscSendBlock(usb_device_msc_struct_t *mscHandle, usb_status_t status);
+static usb_status_t USB_DeviceMscWriteNext(usb_device_msc_struct_t *mscHandle);
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+/* MSC device instance */
+USB_GLOBAL USB_RAM_ADDRESS_ALIGNMENT(USB_DATA_ALIGN_SIZE) usb_device_msc_struct_t g_mscHandle[USB_DEVICE_CONFIG_MSC];
+
+USB_DMA_NONINIT_DATA_ALIGN(USB_DATA_ALIGN_SIZE) static usb_device_msc_buffer_t s_mscBuffer[USB_DEVICE_CONFIG_MSC];
+
+/*******************************************************************************
+ * Code
+ ******************************************************************************/
+
+/* Big endian fields of the SCSI command blocks and responses */
+static uint32_t USB_DeviceMscGetBe32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24U) | ((uint32_t)p[1] << 16U) | ((uint32_t)p[2] << 8U) | (uint32_t)p[3];
+}
+
+static void USB_DeviceMscSetBe32(uint8_t *p, uint32_t value)
+{
+    p[0] = (uint8_t)(value >> 24U);
+    p[1] = (uint8_t)(value >> 16U);
+    p[2] = (uint8_t)(value >> 8U);
+    p[3] = (uint8_t)value;
+}
+
+/*!
+ * @brief Allocates the MSC device handle.
+ *
+ * @param handle The class handle of the MSC class.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+static usb_status_t USB_DeviceMscAllocateHandle(usb_device_msc_struct_t **handle)
+{
+    uint32_t count;
+    for (count = 0; count < USB_DEVICE_CONFIG_MSC; count++)
+    {
+        if (NULL == g_mscHandle[count].handle)
+        {
+            g_mscHandle[count].cbw    = &s_mscBuffer[count].cbw;
+            g_mscHandle[count].csw    = &s_mscBuffer[count].csw;
+            g_mscHandle[count].buffer = s_mscBuffer[count].block;
+            *handle                   = &g_mscHandle[count];
+            return kStatus_USB_Success;
+        }
+    }
+
+    return kStatus_USB_Busy;
+}
+
+/*!
+ * @brief Frees the MSC device handle.
+ *
+ * @param handle The class handle of the MSC class.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+static usb_status_t USB_DeviceMscFreeHandle(usb_device_msc_struct_t *handle)
+{
+    handle->handle        = NULL;
+    handle->configStruct  = NULL;
+    handle->configuration = 0;
+    handle->alternate     = 0;
+    handle->state         = kUSB_DeviceMscStateIdle;
+    return kStatus_USB_Success;
+}
+
+/*!
+ * @brief Calls the application callback of the MSC class.
+ *
+ * @param mscHandle The MSC device handle.
+ * @param event The usb_device_msc_event_t event.
+ * @param param The parameter of the event.
+ * @return The error code returned by the application.
+ */
+static usb_status_t USB_DeviceMscCallback(usb_device_msc_struct_t *mscHandle, uint32_t event, void *param)
+{
+    if ((NULL == mscHandle->configStruct) || (NULL == mscHandle->configStruct->classCallback))
+    {
+        return kStatus_USB_Error;
+    }
+    /* classCallback is initialized in classInit of s_UsbDeviceClassInterfaceMap,
+       it is from the second parameter of classInit */
+    return mscHandle->configStruct->classCallback((class_handle_t)mscHandle, event, param);
+}
+
+/*!
+ * @brief Primes the bulk OUT endpoint for the next command block wrapper.
+ *
+ * The stalled endpoint is primed when the host clears its halt.
+ *
+ * @param mscHandle The MSC device handle.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+static usb_status_t USB_DeviceMscPrimeCbw(usb_device_msc_struct_t *mscHandle)
+{
+    mscHandle->state = kUSB_DeviceMscStateCbw;
+    if (mscHandle->outStall)
+    {
+        return kStatus_USB_Success;
+    }
+    return USB_DeviceRecvRequest(mscHandle->handle, mscHandle->bulkOutEndpoint, (uint8_t *)mscHandle->cbw,
+                                 USB_DEVICE_MSC_CBW_LENGTH);
+}
+
+/*!
+ * @brief Stalls the data endpoint the host expects the data on.
+ *
+ * Used when the device has less data than the host expects, or none, or the direction differs.
+ * The CSW is sent when the host clears the bulk IN halt.
+ *
+ * @param mscHandle The MSC device handle.
+ */
+static void USB_DeviceMscStallData(usb_device_msc_struct_t *mscHandle)
+{
+    if (mscHandle->cbw->flags & USB_DEVICE_MSC_CBW_DIRECTION_IN)
+    {
+        mscHandle->inStall = 1U;
+        USB_DeviceStallEndpoint(mscHandle->handle, mscHandle->bulkInEndpoint | (USB_IN << 7U));
+    }
+    else
+    {
+        mscHandle->outStall = 1U;
+        USB_DeviceStallEndpoint(mscHandle->handle, mscHandle->bulkOutEndpoint | (USB_OUT << 7U));
+    }
+}
+
+/*!
+ * @brief Ends the command without (more) data.
+ *
+ * The data endpoint is stalled if the host expects more data.
+ *
+ * @param mscHandle The MSC device handle.
+ * @param status The CSW status.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+static usb_status_t USB_DeviceMscCommandDone(usb_device_msc_struct_t *mscHandle, uint8_t status)
+{
+    mscHandle->cswStatus = status;
+    if (mscHandle->residue)
+    {
+        USB_DeviceMscStallData(mscHandle);
+    }
+    return USB_DeviceMscSendCsw(mscHandle);
+}
+
+/*!
+ * @brief Fails the command with the sense data.
+ *
+ * @param mscHandle The MSC device handle.
+ * @param senseKey The sense key.
+ * @param asc The additional sense code.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+static usb_status_t USB_DeviceMscFail(usb_device_msc_struct_t *mscHandle, uint8_t senseKey, uint8_t asc)
+{
+    mscHandle->senseKey = senseKey;
+    mscHandle->asc      = asc;
+    return USB_DeviceMscCommandDone(mscHandle, USB_DEVICE_MSC_COMMAND_FAILED);
+}
+
+/*!
+ * @brief Sends the command status wrapper.
+ *
+ * @param mscHandle The MSC device handle.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+static usb_status_t USB_DeviceMscSendCsw(usb_device_msc_struct_t *mscHandle)
+{
+    mscHandle->state = kUSB_DeviceMscStateCsw;
+    if (mscHandle->inStall)
+    {
+        mscHandle->cswPending = 1U;
+        return kStatus_USB_Success;
+    }
+    mscHandle->cswPending       = 0U;
+    mscHandle->csw->signature   = USB_DEVICE_MSC_CSW_SIGNATURE;
+    mscHandle->csw->tag         = mscHandle->cbw->tag;
+    mscHandle->csw->dataResidue = mscHandle->residue;
+    mscHandle->csw->status      = mscHandle->cswStatus;
+    return USB_DeviceSendRequest(mscHandle->handle, mscHandle->bulkInEndpoint, (uint8_t *)mscHandle->csw,
+                                 USB_DEVICE_MSC_CSW_LENGTH);
+}
+
+/*!
+ * @brief Sends the response of a command with the data in.
+ *
+ * The response in the buffer is truncated to the length expected by the host,
+ * the shorter response ends the data phase with a short packet.
+ *
+ * @param mscHandle The MSC device handle.
+ * @param length The response length.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+static usb_status_t USB_DeviceMscSendData(usb_device_msc_struct_t *mscHandle, uint32_t length)
+{
+    if ((mscHandle->residue) && (!(mscHandle->cbw->flags & USB_DEVICE_MSC_CBW_DIRECTION_IN)))
+    {
+        return USB_DeviceMscCommandDone(mscHandle, USB_DEVICE_MSC_PHASE_ERROR);
+    }
+    if (length > mscHandle->residue)
+    {
+        length = mscHandle->residue;
+    }
+    if (0U == length)
+    {
+        return USB_DeviceMscCommandDone(mscHandle, USB_DEVICE_MSC_COMMAND_PASSED);
+    }
+    mscHandle->residue -= length;
+    mscHandle->cswStatus = USB_DEVICE_MSC_COMMAND_PASSED;
+    mscHandle->state     = kUSB_DeviceMscStateDataIn;
+    return USB_DeviceSendRequest(mscHandle->handle, mscHandle->bulkInEndpoint, mscHandle->buffer, length);
+}
+
+/*!
+ * @brief Reads the block from the application and sends it.
+ *
+ * @param mscHandle The MSC device handle.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+static usb_status_t USB_DeviceMscReadBlock(usb_device_msc_struct_t *mscHandle)
+{
+    usb_device_lba_app_struct_t lbaData;
+    usb_status_t error;
+
+    lbaData.offset = mscHandle->lba;
+    lbaData.buffer = mscHandle->buffer;
+    error          = USB_DeviceMscCallback(mscHandle, kUSB_DeviceMscEventReadRequest, &lbaData);
+    if (kStatus_USB_Busy == error)
+    {
+        /* the application continues the data phase by USB_DeviceMscReadDone() */
+        mscHandle->state = kUSB_DeviceMscStateReadWait;
+        return kStatus_USB_Success;
+    }
+    return USB_DeviceMscSendBlock(mscHandle, error);
+}
+
+/*!
+ * @brief Sends the block read by the application, or fails the command.
+ *
+ * @param mscHandle The MSC device handle.
+ * @param status kStatus_USB_Success if the block was read into the buffer.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+static usb_status_t USB_DeviceMscSendBlock(usb_device_msc_struct_t *mscHandle, usb_status_t status)
+{
+    if (kStatus_USB_Success != status)
+    {
+        return USB_DeviceMscFail(mscHandle, USB_DEVICE_MSC_SENSE_MEDIUM_ERROR, USB_DEVICE_MSC_ASC_READ_ERROR);
+    }
+    mscHandle->lba++;
+    mscHandle->blocks--;
+    return USB_DeviceMscSendData(mscHandle, USB_DEVICE_MSC_BLOCK_SIZE);
+}
+
+/*!
+ * @brief Receives the next block of the data out phase, or ends the command.
+ *
+ * @param mscHandle The MSC device handle.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+static usb_status_t USB_DeviceMscWriteNext(usb_device_msc_struct_t *mscHandle)
+{
+    if (0U == mscHandle->blocks)
+    {
+        if (mscHandle->writeFailed)
+        {
+            return USB_DeviceMscFail(mscHandle, USB_DEVICE_MSC_SENSE_MEDIUM_ERROR, USB_DEVICE_MSC_ASC_WRITE_ERROR);
+        }
+        return USB_DeviceMscCommandDone(mscHandle, USB_DEVICE_MSC_COMMAND_PASSED);
+    }
+    mscHandle->state = kUSB_DeviceMscStateDataOut;
+    return USB_DeviceRecvRequest(mscHandle->handle, mscHandle->bulkOutEndpoint, mscHandle->buffer,
+                                 USB_DEVICE_MSC_BLOCK_SIZE);
+}
+
+/*!
+ * @brief Starts the READ(10) or WRITE(10) data phase.
+ *
+ * @param mscHandle The MSC device handle.
+ * @param write 1 for WRITE(10).
+ * @return A USB error code or kStatus_USB_Success.
+ */
+static usb_status_t USB_DeviceMscReadWrite(usb_device_msc_struct_t *mscHandle, uint8_t write)
+{
+    uint8_t *cb     = mscHandle->cbw->cbwcb;
+    uint32_t lba    = USB_DeviceMscGetBe32(&cb[2]);
+    uint32_t blocks = ((uint32_t)cb[7] << 8U) | (uint32_t)cb[8];
+    uint8_t dirIn   = (mscHandle->cbw->flags & USB_DEVICE_MSC_CBW_DIRECTION_IN) ? 1U : 0U;
+
+    if ((blocks * USB_DEVICE_MSC_BLOCK_SIZE != mscHandle->residue) || ((mscHandle->residue) && (dirIn == write)))
+    {
+        /* the host expects other amount of data or the other direction */
+        return USB_DeviceMscCommandDone(mscHandle, USB_DEVICE_MSC_PHASE_ERROR);
+    }
+    if ((lba > mscHandle->totalBlocks) || (blocks > (mscHandle->totalBlocks - lba)))
+    {
+        return USB_DeviceMscFail(mscHandle, USB_DEVICE_MSC_SENSE_ILLEGAL_REQUEST, USB_DEVICE_MSC_ASC_LBA_OUT_OF_RANGE);
+    }
+    mscHandle->lba         = lba;
+    mscHandle->blocks      = blocks;
+    mscHandle->writeFailed = 0U;
+    mscHandle->cswStatus   = USB_DEVICE_MSC_COMMAND_PASSED;
+    if (write)
+    {
+        return USB_DeviceMscWriteNext(mscHandle);
+    }
+    if (0U == blocks)
+    {
+        return USB_DeviceMscCommandDone(mscHandle, USB_DEVICE_MSC_COMMAND_PASSED);
+    }
+    return USB_DeviceMscReadBlock(mscHandle);
+}
+
+/*!
+ * @brief Updates the number of logical blocks from the application.
+ *
+ * @param mscHandle The MSC device handle.
+ */
+static void USB_DeviceMscGetCapacity(usb_device_msc_struct_t *mscHandle)
+{
+    usb_device_lba_information_struct_t lbaInfo;
+
+    lbaInfo.totalLbaNumberSupports = 0U;
+    USB_DeviceMscCallback(mscHandle, kUSB_DeviceMscEventGetLbaInformation, &lbaInfo);
+    mscHandle->totalBlocks = lbaInfo.totalLbaNumberSupports;
+}
+
+/*!
+ * @brief Processes the SCSI command of the received command block wrapper.
+ *
+ * @param mscHandle The MSC device handle.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+static usb_status_t USB_DeviceMscScsiCommand(usb_device_msc_struct_t *mscHandle)
+{
+    uint8_t *cb  = mscHandle->cbw->cbwcb;
+    uint8_t *buf = mscHandle->buffer;
+    uint32_t length;
+
+    if ((mscHandle->mediumChanged) && (USB_DEVICE_MSC_INQUIRY != cb[0]) && (USB_DEVICE_MSC_REQUEST_SENSE != cb[0]))
+    {
+        /* the host reads the volume again */
+        mscHandle->mediumChanged = 0U;
+        USB_DeviceMscGetCapacity(mscHandle);
+        return USB_DeviceMscFail(mscHandle, USB_DEVICE_MSC_SENSE_UNIT_ATTENTION, USB_DEVICE_MSC_ASC_MEDIUM_CHANGED);
+    }
+
+    switch (cb[0])
+    {
+        case USB_DEVICE_MSC_READ_10:
+            return USB_DeviceMscReadWrite(mscHandle, 0U);
+        case USB_DEVICE_MSC_WRITE_10:
+            return USB_DeviceMscReadWrite(mscHandle, 1U);
+        case USB_DEVICE_MSC_TEST_UNIT_READY:
+        case USB_DEVICE_MSC_PREVENT_ALLOW_REMOVAL:
+        case USB_DEVICE_MSC_VERIFY_10:
+        case USB_DEVICE_MSC_SYNCHRONIZE_CACHE_10:
+            break;
+        case USB_DEVICE_MSC_START_STOP_UNIT:
+            if (0x02U == (cb[4] & 0x03U))
+            {
+                USB_DeviceMscCallback(mscHandle, kUSB_DeviceMscEventStopEjectMedia, cb);
+            }
+            break;
+        case USB_DEVICE_MSC_INQUIRY:
+            if (cb[1] & 0x01U)
+            {
+                /* vital product data pages are not supported */
+                return USB_DeviceMscFail(mscHandle, USB_DEVICE_MSC_SENSE_ILLEGAL_REQUEST,
+                                         USB_DEVICE_MSC_ASC_INVALID_FIELD_IN_CDB);
+            }
+            memset(buf, 0, USB_DEVICE_MSC_INQUIRY_LENGTH);
+            buf[1] = 0x80U; /* removable medium */
+            buf[2] = 0x04U; /* SPC-2 */
+            buf[3] = 0x02U; /* response data format */
+            buf[4] = USB_DEVICE_MSC_INQUIRY_LENGTH - 5U;
+            memcpy(&buf[8], USB_DEVICE_MSC_INQUIRY_VENDOR, 8U);
+            memcpy(&buf[16], USB_DEVICE_MSC_INQUIRY_PRODUCT, 16U);
+            memcpy(&buf[32], USB_DEVICE_MSC_INQUIRY_REVISION, 4U);
+            length = (cb[4] < USB_DEVICE_MSC_INQUIRY_LENGTH) ? cb[4] : USB_DEVICE_MSC_INQUIRY_LENGTH;
+            return USB_DeviceMscSendData(mscHandle, length);
+        case USB_DEVICE_MSC_REQUEST_SENSE:
+            memset(buf, 0, USB_DEVICE_MSC_SENSE_LENGTH);
+            buf[0]  = 0x70U; /* current error, fixed format */
+            buf[2]  = mscHandle->senseKey;
+            buf[7]  = USB_DEVICE_MSC_SENSE_LENGTH - 8U;
+            buf[12] = mscHandle->asc;
+            mscHandle->senseKey = USB_DEVICE_MSC_SENSE_NO_SENSE;
+            mscHandle->asc      = 0U;
+            length = (cb[4] < USB_DEVICE_MSC_SENSE_LENGTH) ? cb[4] : USB_DEVICE_MSC_SENSE_LENGTH;
+            return USB_DeviceMscSendData(mscHandle, length);
+        case USB_DEVICE_MSC_READ_CAPACITY_10:
+            USB_DeviceMscGetCapacity(mscHandle);
+            USB_DeviceMscSetBe32(&buf[0], mscHandle->totalBlocks - 1U);
+            USB_DeviceMscSetBe32(&buf[4], USB_DEVICE_MSC_BLOCK_SIZE);
+            return USB_DeviceMscSendData(mscHandle, 8U);
+        case USB_DEVICE_MSC_READ_FORMAT_CAPACITIES:
+            USB_DeviceMscGetCapacity(mscHandle);
+            memset(buf, 0, 12U);
+            buf[3] = 8U; /* capacity list length */
+            USB_DeviceMscSetBe32(&buf[4], mscHandle->totalBlocks);
+            USB_DeviceMscSetBe32(&buf[8], USB_DEVICE_MSC_BLOCK_SIZE);
+            buf[8] = 0x02U; /* formatted medium */
+            return USB_DeviceMscSendData(mscHandle, 12U);
+        case USB_DEVICE_MSC_MODE_SENSE_6:
+            /* no mode pages, not write protected */
+            memset(buf, 0, 4U);
+            buf[0] = 3U;
+            return USB_DeviceMscSendData(mscHandle, 4U);
+        case USB_DEVICE_MSC_MODE_SENSE_10:
+            memset(buf, 0, 8U);
+            buf[1] = 6U;
+            return USB_DeviceMscSendData(mscHandle, 8U);
+        default:
+            return USB_DeviceMscFail(mscHandle, USB_DEVICE_MSC_SENSE_ILLEGAL_REQUEST, USB_DEVICE_MSC_ASC_INVALID_COMMAND);
+    }
+    return USB_DeviceMscCommandDone(mscHandle, USB_DEVICE_MSC_COMMAND_PASSED);
+}
+
+/*!
+ * @brief Responds to the bulk in endpoint event.
+ *
+ * @param handle The device handle of the MSC device.
+ * @param message The pointer to the message of the endpoint callback.
+ * @param callbackParam The pointer to the parameter of the callback.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+static usb_status_t USB_DeviceMscBulkIn(usb_device_handle handle,
+                                        usb_device_endpoint_callback_message_struct_t *message,
+                                        void *callbackParam)
+{
+    usb_device_msc_struct_t *mscHandle = (usb_device_msc_struct_t *)callbackParam;
+
+    if (!mscHandle)
+    {
+        return kStatus_USB_InvalidHandle;
+    }
+    if (USB_UNINITIALIZED_VAL_32 == message->length)
+    {
+        /* canceled transfer */
+        return kStatus_USB_Success;
+    }
+
+    if (kUSB_DeviceMscStateDataIn == mscHandle->state)
+    {
+        if (mscHandle->blocks)
+        {
+            return USB_DeviceMscReadBlock(mscHandle);
+        }
+        return USB_DeviceMscCommandDone(mscHandle, mscHandle->cswStatus);
+    }
+    if (kUSB_DeviceMscStateCsw == mscHandle->state)
+    {
+        return USB_DeviceMscPrimeCbw(mscHandle);
+    }
+    return kStatus_USB_Success;
+}
+
+/*!
+ * @brief Responds to the bulk out endpoint event.
+ *
+ * @param handle The device handle of the MSC device.
+ * @param message The pointer to the message of the endpoint callback.
+ * @param callbackParam The pointer to the parameter of the callback.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+static usb_status_t USB_DeviceMscBulkOut(usb_device_handle handle,
+                                         usb_device_endpoint_callback_message_struct_t *message,
+                                         void *callbackParam)
+{
+    usb_device_msc_struct_t *mscHandle = (usb_device_msc_struct_t *)callbackParam;
+    usb_device_lba_app_struct_t lbaData;
+    usb_status_t error;
+
+    if (!mscHandle)
+    {
+        return kStatus_USB_InvalidHandle;
+    }
+    if (USB_UNINITIALIZED_VAL_32 == message->length)
+    {
+        /* canceled transfer */
+        return kStatus_USB_Success;
+    }
+
+    if (kUSB_DeviceMscStateCbw == mscHandle->state)
+    {
+        if ((USB_DEVICE_MSC_CBW_LENGTH != message->length) ||
+            (USB_DEVICE_MSC_CBW_SIGNATURE != mscHandle->cbw->signature))
+        {
+            /* invalid CBW, stall both endpoints until the reset recovery */
+            mscHandle->state        = kUSB_DeviceMscStateIdle;
+            mscHandle->resetPending = 1U;
+            mscHandle->inStall      = 1U;
+            mscHandle->outStall     = 1U;
+            USB_DeviceStallEndpoint(mscHandle->handle, mscHandle->bulkInEndpoint | (USB_IN << 7U));
+            USB_DeviceStallEndpoint(mscHandle->handle, mscHandle->bulkOutEndpoint | (USB_OUT << 7U));
+            return kStatus_USB_Success;
+        }
+        mscHandle->residue = mscHandle->cbw->dataTransferLength;
+        if (0U != mscHandle->cbw->logicalUnitNumber)
+        {
+            return USB_DeviceMscFail(mscHandle, USB_DEVICE_MSC_SENSE_ILLEGAL_REQUEST,
+                                     USB_DEVICE_MSC_ASC_INVALID_FIELD_IN_CDB);
+        }
+        return USB_DeviceMscScsiCommand(mscHandle);
+    }
+
+    if (kUSB_DeviceMscStateDataOut == mscHandle->state)
+    {
+        if (USB_DEVICE_MSC_BLOCK_SIZE != message->length)
+        {
+            /* the host ended the data phase early */
+            mscHandle->residue -= (message->length < mscHandle->residue) ? message->length : mscHandle->residue;
+            return USB_DeviceMscCommandDone(mscHandle, USB_DEVICE_MSC_PHASE_ERROR);
+        }
+        mscHandle->residue -= USB_DEVICE_MSC_BLOCK_SIZE;
+        mscHandle->blocks--;
+        if (!mscHandle->writeFailed)
+        {
+            lbaData.offset = mscHandle->lba;
+            lbaData.buffer = mscHandle->buffer;
+            error          = USB_DeviceMscCallback(mscHandle, kUSB_DeviceMscEventWriteResponse, &lbaData);
+            if (kStatus_USB_Busy == error)
+            {
+                /* the application continues the data phase by USB_DeviceMscWriteDone() */
+                mscHandle->state = kUSB_DeviceMscStateWriteWait;
+                return kStatus_USB_Success;
+            }
+            if (kStatus_USB_Success != error)
+            {
+                /* the rest of the data is received and dropped */
+                mscHandle->writeFailed = 1U;
+            }
+        }
+        mscHandle->lba++;
+        return USB_DeviceMscWriteNext(mscHandle);
+    }
+    return kStatus_USB_Success;
+}
+
+/*!
+ * @brief Initializes the endpoints of the MSC interface.
+ *
+ * @param mscHandle The MSC device handle.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+static usb_status_t USB_DeviceMscEndpointsInit(usb_device_msc_struct_t *mscHandle)
+{
+    usb_device_interface_list_t *interfaceList;
+    usb_device_interface_struct_t *interface = NULL;
+    usb_status_t error                       = kStatus_USB_Error;
+
+    /* return error when configuration is invalid (0 or more than the configuration number) */
+    if ((mscHandle->configuration == 0U) ||
+        (mscHandle->configuration > mscHandle->configStruct->classInfomation->configurations))
+    {
+        return error;
+    }
+
+    interfaceList = &mscHandle->configStruct->classInfomation->interfaceList[mscHandle->configuration - 1];
+
+    for (uint32_t count = 0; count < interfaceList->count; count++)
+    {
+        if (USB_DEVICE_CONFIG_MSC_CLASS_CODE == interfaceList->interfaces[count].classCode)
+        {
+            for (uint32_t index = 0; index < interfaceList->interfaces[count].count; index++)
+            {
+                if (interfaceList->interfaces[count].interface[index].alternateSetting == mscHandle->alternate)
+                {
+                    interface = &interfaceList->interfaces[count].interface[index];
+                    break;
+                }
+            }
+            mscHandle->interfaceNumber = interfaceList->interfaces[count].interfaceNumber;
+            break;
+        }
+    }
+    if (!interface)
+    {
+        return error;
+    }
+    mscHandle->interfaceHandle = interface;
+
+    for (uint32_t count = 0; count < interface->endpointList.count; count++)
+    {
+        usb_device_endpoint_init_struct_t epInitStruct;
+        usb_device_endpoint_callback_struct_t epCallback;
+        epInitStruct.zlt             = 0;
+        epInitStruct.interval        = interface->endpointList.endpoint[count].interval;
+        epInitStruct.endpointAddress = interface->endpointList.endpoint[count].endpointAddress;
+        epInitStruct.maxPacketSize   = interface->endpointList.endpoint[count].maxPacketSize;
+        epInitStruct.transferType    = interface->endpointList.endpoint[count].transferType;
+
+        if (USB_IN == ((epInitStruct.endpointAddress & USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_MASK) >>
+                       USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_SHIFT))
+        {
+            mscHandle->bulkInEndpoint = (epInitStruct.endpointAddress & USB_DESCRIPTOR_ENDPOINT_ADDRESS_NUMBER_MASK);
+            epCallback.callbackFn     = USB_DeviceMscBulkIn;
+        }
+        else
+        {
+            mscHandle->bulkOutEndpoint = (epInitStruct.endpointAddress & USB_DESCRIPTOR_ENDPOINT_ADDRESS_NUMBER_MASK);
+            epCallback.callbackFn      = USB_DeviceMscBulkOut;
+        }
+        epCallback.callbackParam = mscHandle;
+
+        error = USB_DeviceInitEndpoint(mscHandle->handle, &epInitStruct, &epCallback);
+    }
+
+    mscHandle->inStall      = 0U;
+    mscHandle->outStall     = 0U;
+    mscHandle->cswPending   = 0U;
+    mscHandle->resetPending = 0U;
+    mscHandle->senseKey     = USB_DEVICE_MSC_SENSE_NO_SENSE;
+    mscHandle->asc          = 0U;
+    USB_DeviceMscGetCapacity(mscHandle);
+    if (kStatus_USB_Success == error)
+    {
+        error = USB_DeviceMscPrimeCbw(mscHandle);
+    }
+    return error;
+}
+
+/*!
+ * @brief De-initializes the endpoints of the MSC interface.
+ *
+ * @param mscHandle The MSC device handle.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+static usb_status_t USB_DeviceMscEndpointsDeinit(usb_device_msc_struct_t *mscHandle)
+{
+    usb_status_t error = kStatus_USB_Error;
+
+    mscHandle->state = kUSB_DeviceMscStateIdle;
+    if (!mscHandle->interfaceHandle)
+    {
+        return error;
+    }
+    for (uint32_t count = 0; count < mscHandle->interfaceHandle->endpointList.count; count++)
+    {
+        error = USB_DeviceDeinitEndpoint(mscHandle->handle,
+                                         mscHandle->interfaceHandle->endpointList.endpoint[count].endpointAddress);
+    }
+    mscHandle->interfaceHandle = NULL;
+
+    return error;
+}
+
+/*!
+ * @brief Checks if the endpoint belongs to the MSC interface.
+ *
+ * @param mscHandle The MSC device handle.
+ * @param endpointAddress The endpoint address with the direction bit.
+ * @return 1 if the endpoint is the bulk IN or OUT endpoint of the interface.
+ */
+static uint8_t USB_DeviceMscIsEndpoint(usb_device_msc_struct_t *mscHandle, uint8_t endpointAddress)
+{
+    if (!mscHandle->interfaceHandle)
+    {
+        return 0U;
+    }
+    for (uint32_t count = 0; count < mscHandle->interfaceHandle->endpointList.count; count++)
+    {
+        if (endpointAddress == mscHandle->interfaceHandle->endpointList.endpoint[count].endpointAddress)
+        {
+            return 1U;
+        }
+    }
+    return 0U;
+}
+
+/*!
+ * @brief Handles the MSC class event.
+ *
+ * This function responses to the common device events and the Bulk-Only Transport class requests.
+ *
+ * @param handle The class handle of the MSC class.
+ * @param event The event type.
+ * @param param The parameter of the event.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+usb_status_t USB_DeviceMscEvent(void *handle, uint32_t event, void *param)
+{
+    usb_device_msc_struct_t *mscHandle;
+    usb_status_t error = kStatus_USB_Error;
+    uint16_t interfaceAlternate;
+    uint8_t *temp8;
+    uint8_t alternate;
+    static uint8_t maxLun = 0U;
+
+    if ((!param) || (!handle))
+    {
+        return kStatus_USB_InvalidHandle;
+    }
+
+    mscHandle = (usb_device_msc_struct_t *)handle;
+
+    switch (event)
+    {
+        case kUSB_DeviceClassEventDeviceReset:
+            /* Bus reset, clear the configuration. */
+            mscHandle->configuration = 0;
+            mscHandle->state         = kUSB_DeviceMscStateIdle;
+            break;
+        case kUSB_DeviceClassEventSetConfiguration:
+            temp8 = ((uint8_t *)param);
+            if (!mscHandle->configStruct)
+            {
+                break;
+            }
+            if (*temp8 == mscHandle->configuration)
+            {
+                break;
+            }
+            error                    = USB_DeviceMscEndpointsDeinit(mscHandle);
+            mscHandle->configuration = *temp8;
+            mscHandle->alternate     = 0;
+            error                    = USB_DeviceMscEndpointsInit(mscHandle);
+            break;
+        case kUSB_DeviceClassEventSetInterface:
+            if (!mscHandle->configStruct)
+            {
+                break;
+            }
+            interfaceAlternate = *((uint16_t *)param);
+            alternate          = (uint8_t)(interfaceAlternate & 0xFFU);
+
+            if (mscHandle->interfaceNumber != ((uint8_t)(interfaceAlternate >> 8U)))
+            {
+                break;
+            }
+            if (alternate == mscHandle->alternate)
+            {
+                break;
+            }
+            error                = USB_DeviceMscEndpointsDeinit(mscHandle);
+            mscHandle->alternate = alternate;
+            error                = USB_DeviceMscEndpointsInit(mscHandle);
+            break;
+        case kUSB_DeviceClassEventSetEndpointHalt:
+            temp8 = ((uint8_t *)param);
+            if ((!mscHandle->configStruct) || (!USB_DeviceMscIsEndpoint(mscHandle, *temp8)))
+            {
+                break;
+            }
+            if (USB_IN == (((*temp8) & USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_MASK) >>
+                           USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_SHIFT))
+            {
+                mscHandle->inStall = 1U;
+            }
+            else
+            {
+                mscHandle->outStall = 1U;
+            }
+            error = USB_DeviceStallEndpoint(mscHandle->handle, *temp8);
+            break;
+        case kUSB_DeviceClassEventClearEndpointHalt:
+            temp8 = ((uint8_t *)param);
+            if ((!mscHandle->configStruct) || (!USB_DeviceMscIsEndpoint(mscHandle, *temp8)))
+            {
+                break;
+            }
+            if (mscHandle->resetPending)
+            {
+                /* the endpoints stay stalled until the Bulk-Only Mass Storage Reset */
+                error = kStatus_USB_Success;
+                break;
+            }
+            error = USB_DeviceUnstallEndpoint(mscHandle->handle, *temp8);
+            if (USB_IN == (((*temp8) & USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_MASK) >>
+                           USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_SHIFT))
+            {
+                mscHandle->inStall = 0U;
+                if (mscHandle->cswPending)
+                {
+                    error = USB_DeviceMscSendCsw(mscHandle);
+                }
+            }
+            else
+            {
+                mscHandle->outStall = 0U;
+                if (kUSB_DeviceMscStateCbw == mscHandle->state)
+                {
+                    error = USB_DeviceMscPrimeCbw(mscHandle);
+                }
+            }
+            break;
+        case kUSB_DeviceClassEventClassRequest:
+            if (param)
+            {
+                usb_device_control_request_struct_t *controlRequest = (usb_device_control_request_struct_t *)param;
+
+                if ((!mscHandle->interfaceHandle) ||
+                    ((controlRequest->setup->wIndex & 0xFFU) != mscHandle->interfaceNumber))
+                {
+                    break;
+                }
+                switch (controlRequest->setup->bRequest)
+                {
+                    case USB_DEVICE_MSC_GET_MAX_LUN:
+                        if ((0U != controlRequest->setup->wValue) || (1U != controlRequest->setup->wLength) ||
+                            (USB_REQUEST_TYPE_DIR_IN != (controlRequest->setup->bmRequestType & USB_REQUEST_TYPE_DIR_MASK)))
+                        {
+                            error = kStatus_USB_InvalidRequest;
+                            break;
+                        }
+                        /* one logical unit */
+                        controlRequest->buffer = &maxLun;
+                        controlRequest->length = 1U;
+                        error                  = kStatus_USB_Success;
+                        break;
+                    case USB_DEVICE_MSC_BULK_ONLY_MASS_STORAGE_RESET:
+                        if ((0U != controlRequest->setup->wValue) || (0U != controlRequest->setup->wLength) ||
+                            (USB_REQUEST_TYPE_DIR_OUT != (controlRequest->setup->bmRequestType & USB_REQUEST_TYPE_DIR_MASK)))
+                        {
+                            error = kStatus_USB_InvalidRequest;
+                            break;
+                        }
+                        /* the host clears the halts next, the CBW is received when the OUT endpoint is not stalled */
+                        mscHandle->state        = kUSB_DeviceMscStateIdle;
+                        mscHandle->resetPending = 0U;
+                        mscHandle->cswPending   = 0U;
+                        USB_DeviceCancel(mscHandle->handle, mscHandle->bulkInEndpoint | (USB_IN << 7U));
+                        USB_DeviceCancel(mscHandle->handle, mscHandle->bulkOutEndpoint | (USB_OUT << 7U));
+                        error = USB_DeviceMscPrimeCbw(mscHandle);
+                        break;
+                    default:
+                        error = kStatus_USB_InvalidRequest;
+                        break;
+                }
+            }
+            break;
+        default:
+            break;
+    }
+    return error;
+}
+
+/*!
+ * @brief Initializes the USB MSC class.
+ *
+ * This function obtains a usb device handle according to the controller id and initializes the MSC class
+ * with the class configure parameters.
+ *
+ * @param controllerId The id of the controller.
+ * @param config The class configuration structure.
+ * @param handle It is out parameter. The class handle of the MSC class.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+usb_status_t USB_DeviceMscInit(uint8_t controllerId, usb_device_class_config_struct_t *config, class_handle_t *handle)
+{
+    usb_device_msc_struct_t *mscHandle;
+    usb_status_t error = kStatus_USB_Error;
+
+    error = USB_DeviceMscAllocateHandle(&mscHandle);
+
+    if (kStatus_USB_Success != error)
+    {
+        return error;
+    }
+
+    error = USB_DeviceClassGetDeviceHandle(controllerId, &mscHandle->handle);
+
+    if (kStatus_USB_Success != error)
+    {
+        return error;
+    }
+
+    if (!mscHandle->handle)
+    {
+        return kStatus_USB_InvalidHandle;
+    }
+    mscHandle->configStruct    = config;
+    mscHandle->configuration   = 0;
+    mscHandle->alternate       = 0xFF;
+    mscHandle->interfaceHandle = NULL;
+    mscHandle->state           = kUSB_DeviceMscStateIdle;
+    mscHandle->mediumChanged   = 0U;
+
+    *handle = (class_handle_t)mscHandle;
+    return error;
+}
+
+/*!
+ * @brief De-initializes the USB MSC class.
+ *
+ * @param handle The class handle of the MSC class.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+usb_status_t USB_DeviceMscDeinit(class_handle_t handle)
+{
+    usb_device_msc_struct_t *mscHandle;
+    usb_status_t error = kStatus_USB_Error;
+
+    mscHandle = (usb_device_msc_struct_t *)handle;
+
+    if (!mscHandle)
+    {
+        return kStatus_USB_InvalidHandle;
+    }
+    error = USB_DeviceMscEndpointsDeinit(mscHandle);
+    USB_DeviceMscFreeHandle(mscHandle);
+    return error;
+}
+
+/*!
+ * @brief Continues the data phase held by the application.
+ *
+ * @param handle The class handle of the MSC class.
+ * @param status kStatus_USB_Success if the block was written.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+usb_status_t USB_DeviceMscWriteDone(class_handle_t handle, usb_status_t status)
+{
+    usb_device_msc_struct_t *mscHandle = (usb_device_msc_struct_t *)handle;
+    usb_status_t error                 = kStatus_USB_Error;
+
+    if (!mscHandle)
+    {
+        return kStatus_USB_InvalidHandle;
+    }
+
+    USB_DEVICE_MSC_ENTER_CRITICAL();
+    /* the state is changed by the bus reset or the BOT reset while the block was held */
+    if (kUSB_DeviceMscStateWriteWait == mscHandle->state)
+    {
+        if (kStatus_USB_Success != status)
+        {
+            mscHandle->writeFailed = 1U;
+        }
+        mscHandle->lba++;
+        error = USB_DeviceMscWriteNext(mscHandle);
+    }
+    USB_DEVICE_MSC_EXIT_CRITICAL();
+    return error;
+}
+
+/*!
+ * @brief Sends the block read by the application.
+ *
+ * @param handle The class handle of the MSC class.
+ * @param status kStatus_USB_Success if the block was read into the buffer.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+usb_status_t USB_DeviceMscReadDone(class_handle_t handle, usb_status_t status)
+{
+    usb_device_msc_struct_t *mscHandle = (usb_device_msc_struct_t *)handle;
+    usb_status_t error                 = kStatus_USB_Error;
+
+    if (!mscHandle)
+    {
+        return kStatus_USB_InvalidHandle;
+    }
+
+    USB_DEVICE_MSC_ENTER_CRITICAL();
+    /* the state is changed by the bus reset or the BOT reset while the block was read */
+    if (kUSB_DeviceMscStateReadWait == mscHandle->state)
+    {
+        error = USB_DeviceMscSendBlock(mscHandle, status);
+    }
+    USB_DEVICE_MSC_EXIT_CRITICAL();
+    return error;
+}
+
+/*!
+ * @brief Reports the medium change.
+ *
+ * @param handle The class handle of the MSC class.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+usb_status_t USB_DeviceMscMediumChanged(class_handle_t handle)
+{
+    usb_device_msc_struct_t *mscHandle = (usb_device_msc_struct_t *)handle;
+
+    if (!mscHandle)
+    {
+        return kStatus_USB_InvalidHandle;
+    }
+    mscHandle->mediumChanged = 1U;
+    return kStatus_USB_Success;
+}
+
+#endif /* USB_DEVICE_CONFIG_MSC */
@@ -0,0 +1,275 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Part of the iMX RT MicroPython port
+ * iMX RT CDC ACM Bootloader with OTA support
+ *
+ * Code inspired by CDC Arduino bootloader for SeeedStudio's ArchMix board
+ * https://github.com/Seeed-Studio/ArduinoCore-imxrt/tree/master/bootloaders
+ * 
+ * Author: LoBo (loboris@gmail.com)
+ * 
+ * Copyright (C) 2021  LoBo
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _USB_DEVICE_MSC_H_
+#define _USB_DEVICE_MSC_H_ 1
+
+/*!
+ * @addtogroup msc
+ * @{
+ */
+
+/*******************************************************************************
+* Definitions
+******************************************************************************/
+#define USB_DEVICE_CONFIG_MSC_CLASS_CODE (0x08)   /*!< The mass storage class code. */
+#define USB_DEVICE_MSC_SUBCLASS_SCSI (0x06)       /*!< SCSI transparent command set. */
+#define USB_DEVICE_MSC_PROTOCOL_BULK_ONLY (0x50)  /*!< Bulk-Only Transport. */
+
+#define USB_DEVICE_MSC_GET_MAX_LUN (0xFE)                  /*!< The class request code for GET_MAX_LUN. */
+#define USB_DEVICE_MSC_BULK_ONLY_MASS_STORAGE_RESET (0xFF) /*!< The class request code for the BOT reset. */
+
+/*! @brief Logical block size, READ(10)/WRITE(10) data is transferred block by block. */
+#define USB_DEVICE_MSC_BLOCK_SIZE (512U)
+
+#define USB_DEVICE_MSC_CBW_SIGNATURE (0x43425355U) /*!< "USBC" */
+#define USB_DEVICE_MSC_CSW_SIGNATURE (0x53425355U) /*!< "USBS" */
+#define USB_DEVICE_MSC_CBW_LENGTH (31U)
+#define USB_DEVICE_MSC_CSW_LENGTH (13U)
+#define USB_DEVICE_MSC_CBW_DIRECTION_IN (0x80U)    /*!< bmCBWFlags, data from device to host. */
+
+/* CSW status */
+#define USB_DEVICE_MSC_COMMAND_PASSED (0x00U)
+#define USB_DEVICE_MSC_COMMAND_FAILED (0x01U)
+#define USB_DEVICE_MSC_PHASE_ERROR (0x02U)
+
+/* SCSI operation codes */
+#define USB_DEVICE_MSC_TEST_UNIT_READY (0x00U)
+#define USB_DEVICE_MSC_REQUEST_SENSE (0x03U)
+#define USB_DEVICE_MSC_INQUIRY (0x12U)
+#define USB_DEVICE_MSC_MODE_SENSE_6 (0x1AU)
+#define USB_DEVICE_MSC_START_STOP_UNIT (0x1BU)
+#define USB_DEVICE_MSC_PREVENT_ALLOW_REMOVAL (0x1EU)
+#define USB_DEVICE_MSC_READ_FORMAT_CAPACITIES (0x23U)
+#define USB_DEVICE_MSC_READ_CAPACITY_10 (0x25U)
+#define USB_DEVICE_MSC_READ_10 (0x28U)
+#define USB_DEVICE_MSC_WRITE_10 (0x2AU)
+#define USB_DEVICE_MSC_VERIFY_10 (0x2FU)
+#define USB_DEVICE_MSC_SYNCHRONIZE_CACHE_10 (0x35U)
+#define USB_DEVICE_MSC_MODE_SENSE_10 (0x5AU)
+
+/* Sense keys and additional sense codes */
+#define USB_DEVICE_MSC_SENSE_NO_SENSE (0x00U)
+#define USB_DEVICE_MSC_SENSE_MEDIUM_ERROR (0x03U)
+#define USB_DEVICE_MSC_SENSE_ILLEGAL_REQUEST (0x05U)
+#define USB_DEVICE_MSC_SENSE_UNIT_ATTENTION (0x06U)
+#define USB_DEVICE_MSC_ASC_WRITE_ERROR (0x0CU)
+#define USB_DEVICE_MSC_ASC_READ_ERROR (0x11U)
+#define USB_DEVICE_MSC_ASC_INVALID_COMMAND (0x20U)
+#define USB_DEVICE_MSC_ASC_LBA_OUT_OF_RANGE (0x21U)
+#define USB_DEVICE_MSC_ASC_INVALID_FIELD_IN_CDB (0x24U)
+#define USB_DEVICE_MSC_ASC_MEDIUM_CHANGED (0x28U)
+
+/* INQUIRY identification, space padded */
+#ifndef USB_DEVICE_MSC_INQUIRY_VENDOR
+#define USB_DEVICE_MSC_INQUIRY_VENDOR "iMXRT   "
+#endif
+#ifndef USB_DEVICE_MSC_INQUIRY_PRODUCT
+#define USB_DEVICE_MSC_INQUIRY_PRODUCT "UF2 Bootloader  "
+#endif
+#ifndef USB_DEVICE_MSC_INQUIRY_REVISION
+#define USB_DEVICE_MSC_INQUIRY_REVISION "1.2 "
+#endif
+
+/*! @brief Available MSC class events. */
+typedef enum _usb_device_msc_event
+{
+    kUSB_DeviceMscEventGetLbaInformation = 0x01U, /*!< Get the number of logical blocks. */
+    kUSB_DeviceMscEventReadRequest,               /*!< Fill the buffer with the logical block. */
+    kUSB_DeviceMscEventWriteResponse,             /*!< The logical block was received into the buffer. */
+    kUSB_DeviceMscEventStopEjectMedia,            /*!< The host ejected the medium. */
+} usb_device_msc_event_t;
+
+/*! @brief Logical unit information, kUSB_DeviceMscEventGetLbaInformation parameter. */
+typedef struct _usb_device_lba_information_struct
+{
+    uint32_t totalLbaNumberSupports; /*!< Number of logical blocks of USB_DEVICE_MSC_BLOCK_SIZE. */
+} usb_device_lba_information_struct_t;
+
+/*! @brief Block transfer, kUSB_DeviceMscEventReadRequest and kUSB_DeviceMscEventWriteResponse parameter. */
+typedef struct _usb_device_lba_app_struct
+{
+    uint32_t offset; /*!< Logical block address. */
+    uint8_t *buffer; /*!< Block data, USB_DEVICE_MSC_BLOCK_SIZE bytes. */
+} usb_device_lba_app_struct_t;
+
+/*! @brief Command block wrapper, USB_DEVICE_MSC_CBW_LENGTH bytes are received. */
+typedef struct _usb_device_msc_cbw
+{
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t dataTransferLength;
+    uint8_t flags;
+    uint8_t logicalUnitNumber;
+    uint8_t cbLength;
+    uint8_t cbwcb[16];
+} usb_device_msc_cbw_t;
+
+/*! @brief Command status wrapper, USB_DEVICE_MSC_CSW_LENGTH bytes are sent. */
+typedef struct _usb_device_msc_csw
+{
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t dataResidue;
+    uint8_t status;
+} usb_device_msc_csw_t;
+
+/*! @brief Bulk-Only Transport state. */
+typedef enum _usb_device_msc_state
+{
+    kUSB_DeviceMscStateIdle = 0U,  /*!< Not configured, or stalled until the BOT reset. */
+    kUSB_DeviceMscStateCbw,        /*!< Waiting for the command block wrapper. */
+    kUSB_DeviceMscStateDataIn,     /*!< Sending the data. */
+    kUSB_DeviceMscStateDataOut,    /*!< Receiving the data. */
+    kUSB_DeviceMscStateWriteWait,  /*!< The application holds the received block. */
+    kUSB_DeviceMscStateReadWait,   /*!< The application reads the block to send. */
+    kUSB_DeviceMscStateCsw,        /*!< Sending the command status wrapper. */
+} usb_device_msc_state_t;
+
+/*! @brief The MSC device structure. */
+typedef struct _usb_device_msc_struct
+{
+    usb_device_handle handle;                       /*!< The handle of the USB device. */
+    usb_device_class_config_struct_t *configStruct; /*!< The class configure structure. */
+    usb_device_interface_struct_t *interfaceHandle; /*!< The current interface handle. */
+    usb_device_msc_cbw_t *cbw;                      /*!< Command block wrapper buffer. */
+    usb_device_msc_csw_t *csw;                      /*!< Command status wrapper buffer. */
+    uint8_t *buffer;                                /*!< Data buffer, one logical block. */
+    uint32_t totalBlocks;                           /*!< Number of logical blocks. */
+    uint32_t lba;                                   /*!< Block transferred by the data phase. */
+    uint32_t blocks;                                /*!< Blocks left in the data phase. */
+    uint32_t residue;                               /*!< Data expected by the host and not yet transferred. */
+    volatile uint8_t state;                         /*!< usb_device_msc_state_t. */
+    uint8_t bulkInEndpoint;                         /*!< Bulk IN endpoint number. */
+    uint8_t bulkOutEndpoint;                        /*!< Bulk OUT endpoint number. */
+    uint8_t configuration;                          /*!< The current configuration value. */
+    uint8_t interfaceNumber;                        /*!< The current interface number. */
+    uint8_t alternate;                              /*!< The alternate setting value of the interface. */
+    uint8_t cswStatus;                              /*!< Status of the command. */
+    uint8_t senseKey;                               /*!< Sense data of the last failed command. */
+    uint8_t asc;                                    /*!< Additional sense code. */
+    uint8_t inStall;                                /*!< The bulk IN endpoint is stalled. */
+    uint8_t outStall;                               /*!< The bulk OUT endpoint is stalled. */
+    uint8_t cswPending;                             /*!< The CSW is sent when the bulk IN halt is cleared. */
+    uint8_t resetPending;                           /*!< Invalid CBW, the endpoints stay stalled until the BOT reset. */
+    uint8_t writeFailed;                            /*!< A block of the data phase was not written. */
+    uint8_t mediumChanged;                          /*!< Report the unit attention on the next command. */
+} usb_device_msc_struct_t;
+
+/*******************************************************************************
+* API
+******************************************************************************/
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*!
+ * @name USB MSC Class Driver
+ * @{
+ */
+
+/*!
+ * @brief Initializes the USB MSC class.
+ *
+ * @param controllerId The id of the controller.
+ * @param config The class configuration structure.
+ * @param handle It is out parameter. The class handle of the MSC class.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+extern usb_status_t USB_DeviceMscInit(uint8_t controllerId,
+                                      usb_device_class_config_struct_t *config,
+                                      class_handle_t *handle);
+
+/*!
+ * @brief De-initializes the USB MSC class.
+ *
+ * @param handle The class handle of the MSC class.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+extern usb_status_t USB_DeviceMscDeinit(class_handle_t handle);
+
+/*!
+ * @brief Handles the event passed to the MSC class.
+ *
+ * @param handle The class handle of the MSC class.
+ * @param event The event type.
+ * @param param The parameter of the event.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+extern usb_status_t USB_DeviceMscEvent(void *handle, uint32_t event, void *param);
+
+/*!
+ * @brief Continues the data phase held by the application.
+ *
+ * The kUSB_DeviceMscEventWriteResponse callback returning kStatus_USB_Busy keeps the received block
+ * in the buffer, no more data is received until this function is called. The block can be written
+ * outside of the USB interrupt context.
+ *
+ * @param handle The class handle of the MSC class.
+ * @param status kStatus_USB_Success if the block was written.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+extern usb_status_t USB_DeviceMscWriteDone(class_handle_t handle, usb_status_t status);
+
+/*!
+ * @brief Sends the block read by the application.
+ *
+ * The kUSB_DeviceMscEventReadRequest callback returning kStatus_USB_Busy leaves the buffer to the
+ * application, nothing is sent until this function is called. The block can be read outside of
+ * the USB interrupt context.
+ *
+ * @param handle The class handle of the MSC class.
+ * @param status kStatus_USB_Success if the block was read into the buffer.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+extern usb_status_t USB_DeviceMscReadDone(class_handle_t handle, usb_status_t status);
+
+/*!
+ * @brief Reports the medium change.
+ *
+ * The next command fails with UNIT ATTENTION, the host reads the volume again.
+ *
+ * @param handle The class handle of the MSC class.
+ * @return A USB error code or kStatus_USB_Success.
+ */
+extern usb_status_t USB_DeviceMscMediumChanged(class_handle_t handle);
+
+/*! @}*/
+
+#if defined(__cplusplus)
+}
+#endif
+
+/*! @}*/
+
+#endif /* _USB_DEVICE_MSC_H_ */
@@ -59,20 +59,68 @@ void USB_DeviceTaskFn(void *deviceHandle);
 void BOARD_DbgConsole_Deinit(void);
 void BOARD_DbgConsole_Init(void);
 usb_status_t USB_DeviceCdcVcomCallback(class_handle_t handle, uint32_t event, void *param);
+#if ((defined(USB_DEVICE_CONFIG_MSC)) && (USB_DEVICE_CONFIG_MSC > 0U))
+usb_status_t USB_DeviceMscDiskCallback(class_handle_t handle, uint32_t event, void *param);
+#endif
+#if ((defined(USB_DEVICE_CONFIG_DFU)) && (USB_DEVICE_CONFIG_DFU > 0U))
+usb_status_t USB_DeviceDfuCallback(class_handle_t handle, uint32_t event, void *param);
+#endif
 usb_status_t USB_DeviceCallback(usb_device_handle handle, uint32_t event, void *param);
+static void VCOM_RxProduce(void);
+static void VCOM_RxSchedule(void);
+static void VCOM_RxComplete(uint32_t length);
+static void VCOM_TxComplete(void);
+static void VCOM_LinkReset(void);
+static usb_status_t VCOM_VendorEndpointsInit(usb_device_handle handle);
+static void VCOM_VendorEndpointsDeinit(usb_device_handle handle);
+static usb_status_t VCOM_VendorRequest(usb_device_handle handle, usb_device_control_request_struct_t *request);
 
 /*******************************************************************************
 * Variables
 ******************************************************************************/
 extern usb_device_endpoint_struct_t g_UsbDeviceCdcVcomDicEndpoints[];
+extern usb_device_endpoint_struct_t g_UsbDeviceVendorEndpoints[];
 extern usb_device_class_struct_t g_UsbDeviceCdcVcomConfig;
+#if ((defined(USB_DEVICE_CONFIG_MSC)) && (USB_DEVICE_CONFIG_MSC > 0U))
+extern usb_device_class_struct_t g_UsbDeviceMscConfig;
+#endif
+#if ((defined(USB_DEVICE_CONFIG_DFU)) && (USB_DEVICE_CONFIG_DFU > 0U))
+extern usb_device_class_struct_t g_UsbDeviceDfuConfig;
+#endif
 /* Data structure of virtual com device */
 usb_cdc_vcom_struct_t s_cdcVcom;
 
-/* Data buffer for receiving and sending*/
-USB_DMA_NONINIT_DATA_ALIGN(USB_DATA_ALIGN_SIZE) static uint8_t s_currRecvBuf[DATA_BUFF_SIZE];
-volatile static uint32_t s_recvSize = 0;
-volatile static uint32_t s_waitForDataSend = 0;
+/* Data link used for input and output, the CDC data interface or the vendor specific interface.
+ * The completions of the other link's endpoints are ignored. */
+volatile static uint8_t s_vcomLink = VCOM_LINK_CDC;
+static usb_device_endpoint_struct_t *s_bulkIn = &g_UsbDeviceCdcVcomDicEndpoints[0];
+static usb_device_endpoint_struct_t *s_bulkOut = &g_UsbDeviceCdcVcomDicEndpoints[1];
+
+/* Data buffers for receiving, all free ones are kept scheduled in the controller's queue.
+ * In completion order from s_recvFirst: s_recvHeld buffers received but not yet moved
+ * to the ring buffer, then s_recvQueued buffers scheduled for receive. */
+USB_DMA_NONINIT_DATA_ALIGN(USB_DATA_ALIGN_SIZE) static uint8_t s_currRecvBuf[VCOM_RX_BUF_COUNT][DATA_BUFF_SIZE];
+static uint32_t s_recvSize[VCOM_RX_BUF_COUNT];  /* received length of the held buffers */
+volatile static uint32_t s_recvFirst = 0;
+volatile static uint32_t s_recvHeld = 0;
+volatile static uint32_t s_recvQueued = 0;
+volatile static uint8_t s_recvDirect = 0;       /* direct receive: 0 off, 1 requested, 2 transfer pending */
+volatile static uint32_t s_recvDirectSize = 0;  /* length received by the direct transfer */
+
+/* Transmit queue, the transfers are scheduled in the controller's queue when added and
+ * completed in order from the kUSB_DeviceCdcEventSendResponse callback.
+ * Free running indexes, the writer adds at the head, the callback completes at the tail.
+ * Short transfers are copied into the slot's buffer, the caller's buffer can be reused at once. */
+USB_DMA_NONINIT_DATA_ALIGN(USB_DATA_ALIGN_SIZE) static uint8_t s_txCopyBuf[VCOM_TX_QUEUE_SIZE][VCOM_TX_COPY_SIZE];
+volatile static uint32_t s_txHead = 0;
+volatile static uint32_t s_txTail = 0;
+
+/* Input ring buffer, single producer (USB callback, or the reader with USB interrupt masked) /
+ * single consumer (vcom_read_buf).
+ * Free running indexes, only the producer writes the head and only the consumer writes the tail */
+static uint8_t s_rxRing[VCOM_RX_RING_SIZE];
+volatile static uint32_t s_rxHead = 0;
+volatile static uint32_t s_rxTail = 0;
 
 /* Line coding of cdc device */
 USB_DMA_INIT_DATA_ALIGN(USB_DATA_ALIGN_SIZE) static uint8_t s_lineCoding[LINE_CODING_SIZE] = {
@@ -97,14 +145,26 @@ USB_DMA_INIT_DATA_ALIGN(USB_DATA_ALIGN_SIZE) static uint8_t s_countryCode[COMM_F
 USB_DMA_NONINIT_DATA_ALIGN(USB_DATA_ALIGN_SIZE) static usb_cdc_acm_info_t s_usbCdcAcmInfo;
 
 
-/* USB device class information */
-static usb_device_class_config_struct_t s_cdcAcmConfig[1] = {{
-    USB_DeviceCdcVcomCallback, 0, &g_UsbDeviceCdcVcomConfig,
-}};
+/* USB device class information, the CDC ACM class must be the first */
+static usb_device_class_config_struct_t s_cdcAcmConfig[] = {
+    {
+        USB_DeviceCdcVcomCallback, 0, &g_UsbDeviceCdcVcomConfig,
+    },
+#if ((defined(USB_DEVICE_CONFIG_MSC)) && (USB_DEVICE_CONFIG_MSC > 0U))
+    {
+        USB_DeviceMscDiskCallback, 0, &g_UsbDeviceMscConfig,
+    },
+#endif
+#if ((defined(USB_DEVICE_CONFIG_DFU)) && (USB_DEVICE_CONFIG_DFU > 0U))
+    {
+        USB_DeviceDfuCallback, 0, &g_UsbDeviceDfuConfig,
+    },
+#endif
+};
 
 /* USB device class configuration information */
 static usb_device_class_config_list_struct_t s_cdcAcmConfigList = {
-    s_cdcAcmConfig, USB_DeviceCallback, 1,
+    s_cdcAcmConfig, USB_DeviceCallback, sizeof(s_cdcAcmConfig) / sizeof(usb_device_class_config_struct_t),
 };
 
 #if defined(FSL_FEATURE_USB_KHCI_KEEP_ALIVE_ENABLED) && (FSL_FEATURE_USB_KHCI_KEEP_ALIVE_ENABLED > 0U) && \
@@ -163,6 +223,170 @@ void USB_DeviceTaskFn(void *deviceHandle)
     USB_DeviceEhciTaskFunction(deviceHandle);
 }
 #endif
+
+/* Receive transfer of the selected link is complete (or canceled) */
+static void VCOM_RxComplete(uint32_t length)
+{
+    if (2 == s_recvDirect)
+    {
+        /* Direct receive into the caller's buffer is complete */
+        s_recvDirectSize = length;
+        s_recvDirect = 1;
+    }
+    else if (s_recvQueued)
+    {
+        /* The transfers complete in the order they were scheduled */
+        s_recvSize[(s_recvFirst + s_recvHeld) % VCOM_RX_BUF_COUNT] = (USB_UNINITIALIZED_VAL_32 == length) ? 0 : length;
+        s_recvQueued--;
+        s_recvHeld++;
+        if ((1 == s_cdcVcom.attach) && (1 == s_cdcVcom.startTransactions))
+        {
+            /* Move the data into the ring and schedule buffer for next receive event,
+             * if the ring is full it is done when the data is read */
+            VCOM_RxProduce();
+            VCOM_RxSchedule();
+        }
+    }
+}
+
+/* The oldest queued transmit transfer of the selected link is complete (or canceled) */
+static void VCOM_TxComplete(void)
+{
+    if (s_txTail != s_txHead)
+    {
+        s_txTail++;
+    }
+}
+
+/* Bulk IN endpoint callback of the vendor interface */
+static usb_status_t VCOM_VendorBulkIn(usb_device_handle handle,
+                                      usb_device_endpoint_callback_message_struct_t *message,
+                                      void *callbackParam)
+{
+    if (VCOM_LINK_VENDOR == s_vcomLink)
+    {
+        VCOM_TxComplete();
+    }
+    return kStatus_USB_Success;
+}
+
+/* Bulk OUT endpoint callback of the vendor interface */
+static usb_status_t VCOM_VendorBulkOut(usb_device_handle handle,
+                                       usb_device_endpoint_callback_message_struct_t *message,
+                                       void *callbackParam)
+{
+    if (VCOM_LINK_VENDOR == s_vcomLink)
+    {
+        VCOM_RxComplete(message->length);
+    }
+    return kStatus_USB_Success;
+}
+
+/* Initialize the endpoints of the vendor interface, it has no class driver */
+static usb_status_t VCOM_VendorEndpointsInit(usb_device_handle handle)
+{
+    usb_device_endpoint_init_struct_t epInitStruct;
+    usb_device_endpoint_callback_struct_t epCallback;
+    usb_status_t error = kStatus_USB_Success;
+
+    for (uint32_t count = 0; count < USB_VENDOR_ENDPOINT_COUNT; count++)
+    {
+        epInitStruct.zlt = 0;
+        epInitStruct.interval = g_UsbDeviceVendorEndpoints[count].interval;
+        epInitStruct.endpointAddress = g_UsbDeviceVendorEndpoints[count].endpointAddress;
+        epInitStruct.maxPacketSize = g_UsbDeviceVendorEndpoints[count].maxPacketSize;
+        epInitStruct.transferType = g_UsbDeviceVendorEndpoints[count].transferType;
+        epCallback.callbackFn = (epInitStruct.endpointAddress & USB_DESCRIPTOR_ENDPOINT_ADDRESS_DIRECTION_MASK) ?
+                                    VCOM_VendorBulkIn : VCOM_VendorBulkOut;
+        epCallback.callbackParam = NULL;
+        if (kStatus_USB_Success != USB_DeviceInitEndpoint(handle, &epInitStruct, &epCallback))
+        {
+            error = kStatus_USB_Error;
+        }
+    }
+    return error;
+}
+
+/* Deinitialize the endpoints of the vendor interface, the pending transfers are canceled */
+static void VCOM_VendorEndpointsDeinit(usb_device_handle handle)
+{
+    for (uint32_t count = 0; count < USB_VENDOR_ENDPOINT_COUNT; count++)
+    {
+        USB_DeviceDeinitEndpoint(handle, g_UsbDeviceVendorEndpoints[count].endpointAddress);
+    }
+}
+
+/* Select the CDC data interface for input and output, without canceling the transfers.
+ * Used on bus reset and configuration change, when the endpoints are reinitialized. */
+static void VCOM_LinkReset(void)
+{
+    if (VCOM_LINK_CDC != s_vcomLink)
+    {
+        s_vcomLink = VCOM_LINK_CDC;
+        s_cdcVcom.startTransactions = (s_usbCdcAcmInfo.dtePresent) ? 1 : 0;
+    }
+    s_bulkIn = &g_UsbDeviceCdcVcomDicEndpoints[0];
+    s_bulkOut = &g_UsbDeviceCdcVcomDicEndpoints[1];
+}
+
+/* Move input and output to the selected link, requested by the host.
+ * The transfers of the previous link are canceled and the receive buffers scheduled on the new one,
+ * the data already in the input ring buffer is kept. */
+static void VCOM_LinkSelect(uint8_t link)
+{
+    usb_device_endpoint_struct_t *bulkIn = s_bulkIn;
+    usb_device_endpoint_struct_t *bulkOut = s_bulkOut;
+
+    if (link == s_vcomLink)
+    {
+        return;
+    }
+    /* The completions of the previous link's transfers are ignored from now */
+    s_vcomLink = link;
+    USB_DeviceCancel(s_cdcVcom.deviceHandle, bulkOut->endpointAddress);
+    USB_DeviceCancel(s_cdcVcom.deviceHandle, bulkIn->endpointAddress);
+    if (VCOM_LINK_VENDOR == link)
+    {
+        s_bulkIn = &g_UsbDeviceVendorEndpoints[0];
+        s_bulkOut = &g_UsbDeviceVendorEndpoints[1];
+        s_cdcVcom.startTransactions = 1;
+    }
+    else
+    {
+        s_bulkIn = &g_UsbDeviceCdcVcomDicEndpoints[0];
+        s_bulkOut = &g_UsbDeviceCdcVcomDicEndpoints[1];
+        s_cdcVcom.startTransactions = (s_usbCdcAcmInfo.dtePresent) ? 1 : 0;
+    }
+    s_txTail = s_txHead;
+    if (2 == s_recvDirect)
+    {
+        /* The direct receive is reported as canceled */
+        s_recvDirectSize = USB_UNINITIALIZED_VAL_32;
+        s_recvDirect = 1;
+    }
+    s_recvFirst = 0;
+    s_recvHeld = 0;
+    s_recvQueued = 0;
+    VCOM_RxSchedule();
+}
+
+/* Vendor requests: the data link selection and the Microsoft OS descriptors */
+static usb_status_t VCOM_VendorRequest(usb_device_handle handle, usb_device_control_request_struct_t *request)
+{
+    if (USB_MS_OS_VENDOR_CODE == request->setup->bRequest)
+    {
+        return USB_DeviceGetMsOsDescriptor(handle, request);
+    }
+    if ((VCOM_VENDOR_REQUEST_LINK == request->setup->bRequest) && (request->isSetup) &&
+        (0U == request->setup->wLength) && (USB_VENDOR_INTERFACE_INDEX == (request->setup->wIndex & 0xFFU)) &&
+        (1 == s_cdcVcom.attach))
+    {
+        VCOM_LinkSelect((request->setup->wValue) ? VCOM_LINK_VENDOR : VCOM_LINK_CDC);
+        return kStatus_USB_Success;
+    }
+    return kStatus_USB_InvalidRequest;
+}
+
 /*!
  * @brief CDC class specific callback function.
  *
@@ -188,29 +412,18 @@ usb_status_t USB_DeviceCdcVcomCallback(class_handle_t handle, uint32_t event, vo
     {
         case kUSB_DeviceCdcEventSendResponse:
         {
-            if ((epCbParam->length != 0) && (!(epCbParam->length % g_UsbDeviceCdcVcomDicEndpoints[0].maxPacketSize)))
+            if (VCOM_LINK_CDC == s_vcomLink)
             {
-                /* If the last packet is the size of endpoint, then send also zero-ended packet,
-                 ** meaning that we want to inform the host that we do not have any additional
-                 ** data, so it can flush the output.
-                 */
-                error = USB_DeviceCdcAcmSend(handle, USB_CDC_VCOM_BULK_IN_ENDPOINT, NULL, 0);
-            } 
-					 s_waitForDataSend = 1;
+                VCOM_TxComplete();
+            }
+            error = kStatus_USB_Success;
         }
         break;
         case kUSB_DeviceCdcEventRecvResponse:
         {
-            if ((1 == s_cdcVcom.attach) && (1 == s_cdcVcom.startTransactions))
+            if (VCOM_LINK_CDC == s_vcomLink)
             {
-                s_recvSize = epCbParam->length;
-
-                 if (!s_recvSize)
-                {
-                    /* Schedule buffer for next receive event */
-                    error = USB_DeviceCdcAcmRecv(handle, USB_CDC_VCOM_BULK_OUT_ENDPOINT, s_currRecvBuf,
-                                                 g_UsbDeviceCdcVcomDicEndpoints[0].maxPacketSize);
-								}
+                VCOM_RxComplete(epCbParam->length);
             }
         }
         break;
@@ -355,7 +568,11 @@ usb_status_t USB_DeviceCdcVcomCallback(class_handle_t handle, uint32_t event, vo
             {
                 /* To do: CARRIER_DEACTIVATED */
             }
-            if (acmInfo->dteStatus & USB_DEVICE_CDC_CONTROL_SIG_BITMAP_DTE_PRESENCE)
+            if (VCOM_LINK_CDC != s_vcomLink)
+            {
+                /* The vendor interface is used for data, the state is applied when the CDC link is selected again */
+            }
+            else if (acmInfo->dteStatus & USB_DEVICE_CDC_CONTROL_SIG_BITMAP_DTE_PRESENCE)
             {
                 /* DTE_ACTIVATED */
                 if (1 == s_cdcVcom.attach)
@@ -404,6 +621,7 @@ usb_status_t USB_DeviceCallback(usb_device_handle handle, uint32_t event, void *
         {
             s_cdcVcom.attach = 0;
             s_cdcVcom.currentConfiguration = 0U;
+            VCOM_LinkReset();
 #if (defined(USB_DEVICE_CONFIG_EHCI) && (USB_DEVICE_CONFIG_EHCI > 0U)) || \
     (defined(USB_DEVICE_CONFIG_LPCIP3511HS) && (USB_DEVICE_CONFIG_LPCIP3511HS > 0U))
             /* Get USB speed to configure the device, including max packet size and interval of the endpoints. */
@@ -419,14 +637,23 @@ usb_status_t USB_DeviceCallback(usb_device_handle handle, uint32_t event, void *
             {
                 s_cdcVcom.attach = 0;
                 s_cdcVcom.currentConfiguration = 0U;
+                VCOM_LinkReset();
+                VCOM_VendorEndpointsDeinit(handle);
             }
             else if (USB_CDC_VCOM_CONFIGURE_INDEX == (*temp8))
             {
                 s_cdcVcom.attach = 1;
                 s_cdcVcom.currentConfiguration = *temp8;
-                /* Schedule buffer for receive */
-                USB_DeviceCdcAcmRecv(s_cdcVcom.cdcAcmHandle, USB_CDC_VCOM_BULK_OUT_ENDPOINT, s_currRecvBuf,
-                                     g_UsbDeviceCdcVcomDicEndpoints[0].maxPacketSize);
+                VCOM_LinkReset();
+                VCOM_VendorEndpointsDeinit(handle);
+                VCOM_VendorEndpointsInit(handle);
+                s_txTail = s_txHead;
+                /* Schedule buffers for receive */
+                s_recvDirect = 0;
+                s_recvFirst = 0;
+                s_recvHeld = 0;
+                s_recvQueued = 0;
+                VCOM_RxSchedule();
             }
             else
             {
@@ -468,6 +695,12 @@ usb_status_t USB_DeviceCallback(usb_device_handle handle, uint32_t event, void *
                 error = USB_DeviceGetStringDescriptor(handle, (usb_device_get_string_descriptor_struct_t *)param);
             }
             break;
+        case kUSB_DeviceEventVendorRequest:
+            if (param)
+            {
+                error = VCOM_VendorRequest(handle, (usb_device_control_request_struct_t *)param);
+            }
+            break;
         default:
             break;
     }
@@ -510,43 +743,254 @@ void vcom_cdc_init(void)
 }
 
 
+/* Move the held receive buffers to the ring buffer while there is room for them.
+ * Called from the USB callback, or with the USB interrupt masked. */
+static void VCOM_RxProduce(void)
+{
+    uint32_t head = s_rxHead;
+    uint32_t idx, size, n;
+
+    while (s_recvHeld)
+    {
+        size = s_recvSize[s_recvFirst];
+        if ((VCOM_RX_RING_SIZE - (head - s_rxTail)) < size)
+        {
+            break;
+        }
+        idx = head & (VCOM_RX_RING_SIZE - 1U);
+        n = VCOM_RX_RING_SIZE - idx;
+        if (n > size)
+        {
+            n = size;
+        }
+        memcpy(&s_rxRing[idx], s_currRecvBuf[s_recvFirst], n);
+        memcpy(&s_rxRing[0], &s_currRecvBuf[s_recvFirst][n], size - n);
+        head += size;
+        s_recvFirst = (s_recvFirst + 1U) % VCOM_RX_BUF_COUNT;
+        s_recvHeld--;
+    }
+    /* the data must be written before the consumer can see it */
+    __DMB();
+    s_rxHead = head;
+}
+
+/* Schedule all free receive buffers, the controller queues them.
+ * Called from the USB callback, or with the USB interrupt masked. */
+static void VCOM_RxSchedule(void)
+{
+    uint32_t idx;
+
+    while ((1 == s_cdcVcom.attach) && (!s_recvDirect) && ((s_recvHeld + s_recvQueued) < VCOM_RX_BUF_COUNT))
+    {
+        idx = (s_recvFirst + s_recvHeld + s_recvQueued) % VCOM_RX_BUF_COUNT;
+        s_recvQueued++;
+        if (kStatus_USB_Success != USB_DeviceRecvRequest(s_cdcVcom.deviceHandle,
+                                                         s_bulkOut->endpointAddress & USB_ENDPOINT_NUMBER_MASK,
+                                                         s_currRecvBuf[idx], DATA_BUFF_SIZE))
+        {
+            s_recvQueued--;
+            break;
+        }
+    }
+}
+
+/* Read up to 'length' bytes from the input ring buffer, does not wait
+ * Returns the number of bytes read */
 uint32_t vcom_read_buf(void* data, uint32_t length)
+{
+	uint32_t tail = s_rxTail;
+	uint32_t size = s_rxHead - tail;
+	uint32_t idx = tail & (VCOM_RX_RING_SIZE - 1U);
+	uint32_t n;
+
+	if (size > length) size = length;
+	if (size != 0) {
+		n = VCOM_RX_RING_SIZE - idx;
+		if (n > size) n = size;
+		memcpy(data, &s_rxRing[idx], n);
+		memcpy((uint8_t *)data + n, &s_rxRing[0], size - n);
+		/* the data must be read before the producer can overwrite it */
+		__DMB();
+		s_rxTail = tail + size;
+	}
+
+	if ((1 == s_cdcVcom.attach) && (1 == s_cdcVcom.startTransactions) && (!s_recvDirect) &&
+	    ((s_recvHeld + s_recvQueued) < VCOM_RX_BUF_COUNT))
+	{
+		/* Move the data held while the ring was full and schedule the free buffers again */
+		USB_OSA_SR_ALLOC();
+		USB_OSA_ENTER_CRITICAL();
+		VCOM_RxProduce();
+		VCOM_RxSchedule();
+		USB_OSA_EXIT_CRITICAL();
+	}
+	return size;
+}
+
+/* Number of bytes in the input ring buffer */
+uint32_t vcom_read_avail(void)
+{
+	return s_rxHead - s_rxTail;
+}
+
+/* Discard the input, returns the number of discarded bytes */
+uint32_t vcom_read_flush(void)
+{
+	USB_OSA_SR_ALLOC();
+	uint32_t size;
+
+	USB_OSA_ENTER_CRITICAL();
+	size = s_rxHead - s_rxTail;
+	s_rxTail += size;
+	while (s_recvHeld)
+	{
+		size += s_recvSize[s_recvFirst];
+		s_recvFirst = (s_recvFirst + 1U) % VCOM_RX_BUF_COUNT;
+		s_recvHeld--;
+	}
+	VCOM_RxSchedule();
+	USB_OSA_EXIT_CRITICAL();
+	return size;
+}
+
+/* Start receiving up to 'length' bytes directly into 'data' buffer, returns without waiting.
+ * No receive buffer is scheduled again until vcom_recv_stop() is called.
+ * The scheduled receive buffers are retired: the empty ones are canceled, the packets already
+ * received into them go to the ring buffer and kStatus_USB_Busy is returned until it is read */
+usb_status_t vcom_recv_start(void* data, uint32_t length)
 {
 	usb_status_t error = kStatus_USB_Error;
-	
-  if ((1 == s_cdcVcom.attach) && (1 == s_cdcVcom.startTransactions))
-  {
-   /* Schedule buffer for next receive event */
-    error = USB_DeviceCdcAcmRecv(s_cdcVcom.cdcAcmHandle, USB_CDC_VCOM_BULK_OUT_ENDPOINT, s_currRecvBuf, length);
-		if( kStatus_USB_Success != error){
-			return 0;
+
+	if((1 == s_cdcVcom.attach) && (1 == s_cdcVcom.startTransactions)){
+		if (2 == s_recvDirect) return kStatus_USB_Busy;
+		s_recvDirect = 1;
+		if (s_recvQueued) {
+			/* the buffers complete with the received length or as canceled (empty) */
+			USB_DeviceCancel(s_cdcVcom.deviceHandle, s_bulkOut->endpointAddress);
+		}
+		if ((s_recvQueued) || (s_recvHeld) || (s_rxHead != s_rxTail)) return kStatus_USB_Busy;
+		s_recvDirect = 2;
+		error = USB_DeviceRecvRequest(s_cdcVcom.deviceHandle, s_bulkOut->endpointAddress & USB_ENDPOINT_NUMBER_MASK,
+		                              (uint8_t *)data, length);
+		if (kStatus_USB_Success != error) {
+			s_recvDirect = 1;
 		}
-	}		
-	
-	if(s_recvSize != 0){
-		uint8_t * ptr = data;
-		
-		for(uint32_t i = 0; i < s_recvSize; i++){
-		   *(ptr++) = s_currRecvBuf[i];
 	}
+	return error;
+}
+
+/* Returns the length received by the transfer started with vcom_recv_start(),
+ * VCOM_RECV_PENDING if it is not complete */
+uint32_t vcom_recv_done(void)
+{
+	return (2 == s_recvDirect) ? VCOM_RECV_PENDING : s_recvDirectSize;
+}
+
+/* Max packet size of the selected link's bulk OUT endpoint */
+uint32_t vcom_rx_packet_size(void)
+{
+	return s_bulkOut->maxPacketSize;
+}
+
+/* Cancel the pending direct receive, the input is received into the ring buffer again */
+void vcom_recv_stop(void)
+{
+	if (2 == s_recvDirect) {
+		USB_DeviceCancel(s_cdcVcom.deviceHandle, s_bulkOut->endpointAddress);
 	}
-	length = s_recvSize;
-	s_recvSize = 0;
-	return length;
+	USB_OSA_SR_ALLOC();
+	USB_OSA_ENTER_CRITICAL();
+	s_recvDirect = 0;
+	VCOM_RxSchedule();
+	USB_OSA_EXIT_CRITICAL();
 }
 
-status_t vcom_write_buf(void* data, uint32_t length)
+/* Add the buffer to the transmit queue, returns without waiting for the transfer to complete.
+ * Buffers longer than VCOM_TX_COPY_SIZE are sent from the caller's buffer, it must not be
+ * changed until vcom_write_done(). If the length is a multiple of the packet size a zero
+ * length packet is queued after it, so the host does not wait for more data.
+ * Returns kStatus_USB_Busy if the queue is full. */
+usb_status_t vcom_write_queue(const void* data, uint32_t length)
 {
-	if((1 == s_cdcVcom.attach) && (1 == s_cdcVcom.startTransactions)){
-		  s_waitForDataSend = 0;
-			if( kStatus_USB_Success ==  USB_DeviceCdcAcmSend(s_cdcVcom.cdcAcmHandle, USB_CDC_VCOM_BULK_IN_ENDPOINT, (uint8_t *)data, length))
-			{
-				while(!s_waitForDataSend){
-				}
-				return 1;
+	usb_status_t error;
+	uint32_t head = s_txHead;
+	uint32_t zlp = ((length != 0) && (0 == (length % s_bulkIn->maxPacketSize))) ? 1 : 0;
+	uint8_t *buf = (uint8_t *)data;
+
+	if ((1 != s_cdcVcom.attach) || (1 != s_cdcVcom.startTransactions)) return kStatus_USB_Error;
+	if ((VCOM_TX_QUEUE_SIZE - (head - s_txTail)) < (1 + zlp)) return kStatus_USB_Busy;
+
+	if (length <= VCOM_TX_COPY_SIZE) {
+		buf = s_txCopyBuf[head & (VCOM_TX_QUEUE_SIZE - 1U)];
+		memcpy(buf, data, length);
+	}
+	/* the slot is taken before the transfer can complete */
+	s_txHead = head + 1;
+	error = USB_DeviceSendRequest(s_cdcVcom.deviceHandle, s_bulkIn->endpointAddress & USB_ENDPOINT_NUMBER_MASK, buf, length);
+	if (kStatus_USB_Success != error) {
+		s_txHead = head;
+		return error;
+	}
+	if (zlp) {
+		s_txHead = head + 2;
+		if (kStatus_USB_Success != USB_DeviceSendRequest(s_cdcVcom.deviceHandle,
+		                                                 s_bulkIn->endpointAddress & USB_ENDPOINT_NUMBER_MASK, NULL, 0)) {
+			s_txHead = head + 1;
+		}
+	}
+	return kStatus_USB_Success;
+}
+
+/* Send the buffer, waits until it can be reused.
+ * Waits max 'timeout' ms, the queued transfers are canceled on timeout or detach.
+ * Returns 0 if the buffer was not sent */
+status_t vcom_write_buf(void* data, uint32_t length, uint32_t timeout)
+{
+	usb_status_t error;
+	uint32_t tmo = timeout * (CLOCK_GetFreq(kCLOCK_CpuClk) / 1000U);
+
+	DWT->CYCCNT = 0;
+	while ((error = vcom_write_queue(data, length)) == kStatus_USB_Busy) {
+		if ((DWT->CYCCNT > tmo) || (1 != s_cdcVcom.attach)) {
+			vcom_write_cancel();
+			return 0;
+		}
+	}
+	if (kStatus_USB_Success != error) return 0;
+	if (length > VCOM_TX_COPY_SIZE) {
+		while (!vcom_write_done()) {
+			if ((DWT->CYCCNT > tmo) || (1 != s_cdcVcom.attach)) {
+				vcom_write_cancel();
+				return 0;
 			}
-  }		
-	return 0;
+		}
+	}
+	return 1;
+}
+
+/* Data link used for input and output, VCOM_LINK_CDC or VCOM_LINK_VENDOR */
+uint8_t vcom_link(void)
+{
+	return s_vcomLink;
+}
+
+/* Check if all queued transfers are complete */
+bool vcom_write_done(void)
+{
+	return (s_txHead == s_txTail);
+}
+
+/* Number of transmit queue entries not yet complete */
+uint32_t vcom_write_pending(void)
+{
+	return s_txHead - s_txTail;
+}
+
+/* Cancel all queued bulk IN transfers */
+void vcom_write_cancel(void)
+{
+	USB_DeviceCancel(s_cdcVcom.deviceHandle, s_bulkIn->endpointAddress);
+	s_txTail = s_txHead;
 }
 
 void APPTask()
@@ -554,14 +998,13 @@ void APPTask()
 	
 	uint8_t buff[512];
 
-	vcom_read_buf(buff, 512);
+	uint32_t size = vcom_read_buf(buff, 512);
 	
-	if(s_recvSize != 0)
+	if(size != 0)
 	{
-		vcom_write_buf(buff, s_recvSize);
+		vcom_write_buf(buff, size, VCOM_WRITE_TIMEOUT);
 
-			PRINTF("s_recving:%d\r\n", s_recvSize);
-			s_recvSize = 0;
+			PRINTF("s_recving:%d\r\n", size);
 	}
 	
 }
@@ -93,6 +93,27 @@
 #define UART_BITMAP_SIZE (0x02)
 #define NOTIF_REQUEST_TYPE (0xA1)
 
+/* Input ring buffer size, must be power of two */
+#define VCOM_RX_RING_SIZE (4096U)
+/* Number of receive buffers kept scheduled, each takes one dTD (USB_DEVICE_CONFIG_EHCI_MAX_DTD) */
+#define VCOM_RX_BUF_COUNT (8U)
+/* Transmit queue size, must be power of two, a transfer may take two entries (zero length packet) */
+#define VCOM_TX_QUEUE_SIZE (4U)
+/* Transfers up to this size are copied into the transmit queue */
+#define VCOM_TX_COPY_SIZE (64U)
+/* Default vcom_write_buf() timeout in ms */
+#define VCOM_WRITE_TIMEOUT (2000U)
+
+/* Direct receive transfer not complete */
+#define VCOM_RECV_PENDING (0xFFFFFFFEU)
+
+/* Data link used for input and output */
+#define VCOM_LINK_CDC (0U)    /* CDC data interface */
+#define VCOM_LINK_VENDOR (1U) /* vendor specific bulk interface */
+/* Vendor request to the vendor interface selecting the data link, wValue 1 selects the vendor interface,
+ * 0 the CDC data interface. The CDC interface is selected again on bus reset or configuration change. */
+#define VCOM_VENDOR_REQUEST_LINK (0x01U)
+
 /* Define the types for application */
 typedef struct _usb_cdc_vcom_struct
 {
@@ -123,7 +144,18 @@ void vcom_cdc_init(void);
 
 
 uint32_t vcom_read_buf(void* data, uint32_t length);
-status_t vcom_write_buf(void* data, uint32_t length);
+uint32_t vcom_read_avail(void);
+uint32_t vcom_read_flush(void);
+usb_status_t vcom_recv_start(void* data, uint32_t length);
+uint32_t vcom_recv_done(void);
+uint32_t vcom_rx_packet_size(void);
+void vcom_recv_stop(void);
+status_t vcom_write_buf(void* data, uint32_t length, uint32_t timeout);
+usb_status_t vcom_write_queue(const void* data, uint32_t length);
+bool vcom_write_done(void);
+uint32_t vcom_write_pending(void);
+void vcom_write_cancel(void);
+uint8_t vcom_link(void);
 
 void APPTask(void);
 
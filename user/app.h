@@ -43,6 +43,12 @@
 
 #define APP_FLAG_ACTIVE								0x01000000
 #define SHA_HASH_SIZE									32
+#define SHA256_CHUNK_SIZE							0x10000		// flash hashed with one DCP call between progress reports
+
+// Chunked SHA-256 result
+#define SHA256_OK											0
+#define SHA256_ERROR									1
+#define SHA256_CANCELED								2
 
 #define BOOTLOADER_FLEXSPI FLEXSPI
 #define BOOTLOADER_FLEXSPI_AMBA_BASE FlexSPI_AMBA_BASE
@@ -51,6 +57,9 @@
 #define FLASH_SIZE (8*1024u)
 #define FLASH_PAGE_SIZE 256
 #define SECTOR_SIZE 0x1000
+#define FLASH_BLOCK32_SIZE 0x8000
+#define FLASH_BLOCK64_SIZE 0x10000
+#define FLASH_ERASE_SIZES							(SECTOR_SIZE | FLASH_BLOCK32_SIZE | FLASH_BLOCK64_SIZE)	// supported erase sizes, OR-ed
 
 #define BOOTLOADER_FLEXSPI_CLOCK kCLOCK_FlexSpi
 
@@ -77,6 +86,7 @@
 #define FLASH_PAGE_SIZE 512
 #define BOOTLOADER_DATA_AREA 1
 #define SECTOR_SIZE 0x40000
+#define FLASH_ERASE_SIZES							(SECTOR_SIZE)		// supported erase sizes, OR-ed
 
 #define BOOTLOADER_FLEXSPI_CLOCK kCLOCK_FlexSpi
 
@@ -92,11 +102,24 @@
 #define BOOT_STATUS_MAGIC							(0x424F4F54)
 #endif
 
+#define FLASH_END_ADDRESS							(BOOTLOADER_FLEXSPI_AMBA_BASE + FLASH_SIZE*1024u)
+
+// write session journal in the last flash sector, above the bootloader and the applications
+// it is erased only by flash_erase_journal(), the commands can not write it
+#define SESSION_JOURNAL_ADDRESS				(FLASH_END_ADDRESS - SECTOR_SIZE)
+#define SESSION_JOURNAL_ID						"i.MXRT10XX_jrnl"
+
 
 // extern functions
 extern int flexspi_nor_flash_init(FLEXSPI_Type *base);
 extern status_t flexspi_nor_enable_quad_mode(FLEXSPI_Type *base);
 extern status_t flexspi_nor_flash_erase_sector(FLEXSPI_Type *base, uint32_t address);
+extern status_t flexspi_nor_flash_erase(FLEXSPI_Type *base, uint32_t address, uint32_t size);
+extern status_t flexspi_nor_flash_erase_start(FLEXSPI_Type *base, uint32_t address, uint32_t size);
+extern status_t flexspi_nor_erase_suspend(FLEXSPI_Type *base);
+extern status_t flexspi_nor_erase_resume(FLEXSPI_Type *base);
+extern status_t flexspi_nor_read_busy(FLEXSPI_Type *base, bool *isBusy);
+extern status_t flexspi_nor_wait_bus_busy(FLEXSPI_Type *base);
 extern status_t flexspi_nor_flash_page_program(FLEXSPI_Type *base, uint32_t address, const uint32_t *src);
 extern status_t flexspi_nor_flash_buffer_program(FLEXSPI_Type *base, uint32_t address, const uint32_t *src, uint32_t length);
 extern status_t flexspi_nor_hyperflash_cfi(FLEXSPI_Type *base);
@@ -124,7 +147,15 @@ extern unsigned char *sha256_hash;
 extern volatile boot_rec_t boot_rec;
 extern app_rec_t app_record;
 
+// Chunked SHA-256 progress callback, returning false cancels the calculation
+typedef bool (*sha256_progress_t)(uint32_t done, uint32_t length);
+
 bool app_sha256(uint32_t address, uint32_t length);
+int app_sha256_chunked(uint32_t address, uint32_t length, sha256_progress_t progress);
+void app_sha256_begin(uint32_t address, uint32_t length);
+void app_sha256_update(uint32_t address, const uint8_t *data, uint32_t length);
+void app_sha256_invalidate(uint32_t address, uint32_t length);
+void app_sha256_end(uint32_t address, uint32_t length);
 bool writeBootRecord(bool main);
 int checkBootRecord(bool main);
 void delay_ms(uint32_t ms);
@@ -52,6 +52,27 @@ AT_NONCACHEABLE_SECTION(static unsigned char outputSha256[SHA_HASH_SIZE]);
 unsigned char *sha256_hash = outputSha256;
 app_rec_t app_record;
 
+// Running SHA-256 of the range being written, updated with the programmed data
+#define RUN_SHA256_NONE			0
+#define RUN_SHA256_ACTIVE		1		// the data is hashed up to 'next'
+#define RUN_SHA256_DONE			2		// finished, the hash is in 'runSha256'
+
+typedef struct _run_sha256_t_ {
+	uint32_t start;
+	uint32_t end;
+	uint32_t next;
+	uint32_t state;
+}	run_sha256_t;
+
+static run_sha256_t run_sha = {0};
+static dcp_handle_t run_sha_handle;
+AT_NONCACHEABLE_SECTION(static dcp_hash_ctx_t run_sha_ctx);
+AT_NONCACHEABLE_SECTION(static unsigned char runSha256[SHA_HASH_SIZE]);
+
+// Context of the chunked SHA-256 calculation
+static dcp_handle_t sha_handle;
+AT_NONCACHEABLE_SECTION(static dcp_hash_ctx_t sha_ctx);
+
 
 //------------------------------------------------------------
 void call_application(uint32_t address, uint32_t reset_handle)
@@ -114,25 +135,128 @@ static void LED_blink(uint32_t n, uint32_t dur)
 	}
 }
 
-//------------------------------------------------
-bool app_sha256(uint32_t address, uint32_t length)
+// Start the running SHA-256 of the range which is going to be written
+//----------------------------------------------------------
+void app_sha256_begin(uint32_t address, uint32_t length)
+{
+	run_sha256_t *rs = &run_sha;
+
+	run_sha_handle.channel    = kDCP_Channel0;
+	run_sha_handle.keySlot    = kDCP_KeySlot0;
+	run_sha_handle.swapConfig = kDCP_NoSwap;
+
+	rs->state = RUN_SHA256_NONE;
+	if (DCP_HASH_Init(DCP, &run_sha_handle, &run_sha_ctx, kDCP_Sha256) != kStatus_Success) return;
+	rs->start = address;
+	rs->end = address + length;
+	rs->next = address;
+	rs->state = RUN_SHA256_ACTIVE;
+}
+
+// Update the running SHA-256 with the data programmed and verified at 'address'
+// The data in order is hashed from RAM, the data ahead is hashed from flash when finished,
+// rewriting the already hashed data drops the running hash.
+//------------------------------------------------------------------------------
+void app_sha256_update(uint32_t address, const uint8_t *data, uint32_t length)
+{
+	run_sha256_t *rs = &run_sha;
+
+	if (rs->state == RUN_SHA256_NONE) return;
+	if ((rs->state == RUN_SHA256_ACTIVE) && (address == rs->next) && ((address + length) <= rs->end)) {
+		if (DCP_HASH_Update(DCP, &run_sha_ctx, data, length) == kStatus_Success) rs->next += length;
+		else rs->state = RUN_SHA256_NONE;
+	}
+	else app_sha256_invalidate(address, length);
+}
+
+// Flash range was changed, drop the running SHA-256 if it includes the hashed data
+//-----------------------------------------------------------
+void app_sha256_invalidate(uint32_t address, uint32_t length)
+{
+	run_sha256_t *rs = &run_sha;
+	uint32_t hashed_end = (rs->state == RUN_SHA256_DONE) ? rs->end : rs->next;
+
+	if ((address < hashed_end) && ((address + length) > rs->start)) rs->state = RUN_SHA256_NONE;
+}
+
+// The image of unknown size (DFU download) hashed into the range of the max size is complete,
+// end the running SHA-256 range at the image end
+//----------------------------------------------------
+void app_sha256_end(uint32_t address, uint32_t length)
+{
+	run_sha256_t *rs = &run_sha;
+
+	if ((rs->state == RUN_SHA256_ACTIVE) && (address == rs->start) &&
+			(rs->next <= (address + length)) && (length <= (rs->end - rs->start))) rs->end = address + length;
+}
+
+// Finish the running SHA-256 if its range is exactly the range, the rest of it is hashed from flash
+//------------------------------------------------------------------
+static bool app_sha256_finish(uint32_t address, uint32_t length)
 {
-	dcp_handle_t m_handle;
+	run_sha256_t *rs = &run_sha;
+	size_t outLength = SHA_HASH_SIZE;
 
-	m_handle.channel    = kDCP_Channel0;
-	m_handle.keySlot    = kDCP_KeySlot0;
-	m_handle.swapConfig = kDCP_NoSwap;
+	if ((rs->state == RUN_SHA256_NONE) || (address != rs->start)) return false;
+	if (length != (rs->end - rs->start)) return false;
+	if (rs->state == RUN_SHA256_ACTIVE) {
+		rs->state = RUN_SHA256_NONE;
+		if (rs->next < rs->end) {
+			DCACHE_CleanInvalidateByRange(rs->next, rs->end - rs->next);
+			if (DCP_HASH_Update(DCP, &run_sha_ctx, (const uint8_t *)rs->next, rs->end - rs->next) != kStatus_Success) return false;
+		}
+		if (DCP_HASH_Finish(DCP, &run_sha_ctx, runSha256, &outLength) != kStatus_Success) return false;
+		if (outLength != SHA_HASH_SIZE) return false;
+		rs->state = RUN_SHA256_DONE;
+	}
+	memcpy(sha256_hash, runSha256, SHA_HASH_SIZE);
+	return true;
+}
 
+// Calculate SHA-256 of the flash range into 'sha256_hash' in SHA256_CHUNK_SIZE chunks
+// 'progress' (if not NULL) is called after each chunk, returning false cancels the calculation
+// The running SHA-256 of the just written range is used if it covers the range
+// Returns SHA256_OK, SHA256_ERROR or SHA256_CANCELED
+//------------------------------------------------------------------------------------
+int app_sha256_chunked(uint32_t address, uint32_t length, sha256_progress_t progress)
+{
+	uint32_t done = 0;
+	uint32_t len;
 	size_t outLength = SHA_HASH_SIZE;
-	memset(sha256_hash, 0, outLength);
 
-	const uint8_t *message = (const uint8_t *)address;
+	// the range must not be in a suspended background erase
+	flash_erase_finish(address, length);
+
+	if (app_sha256_finish(address, length)) {
+		if (progress) progress(length, length);
+		return SHA256_OK;
+	}
+
+	sha_handle.channel    = kDCP_Channel0;
+	sha_handle.keySlot    = kDCP_KeySlot0;
+	sha_handle.swapConfig = kDCP_NoSwap;
+
+	memset(sha256_hash, 0, outLength);
+	if (DCP_HASH_Init(DCP, &sha_handle, &sha_ctx, kDCP_Sha256) != kStatus_Success) return SHA256_ERROR;
 
 	// Calulate SHA-256
 	DCACHE_CleanInvalidateByRange(address, length);
-	status_t status = DCP_HASH(DCP, &m_handle, kDCP_Sha256, message, length, outputSha256, &outLength);
+	while (done < length) {
+		len = ((length - done) > SHA256_CHUNK_SIZE) ? SHA256_CHUNK_SIZE : (length - done);
+		if (DCP_HASH_Update(DCP, &sha_ctx, (const uint8_t *)(address + done), len) != kStatus_Success) return SHA256_ERROR;
+		done += len;
+		if ((progress) && (!progress(done, length))) return SHA256_CANCELED;
+	}
+	if (DCP_HASH_Finish(DCP, &sha_ctx, outputSha256, &outLength) != kStatus_Success) return SHA256_ERROR;
 
-	return ((kStatus_Success != status) || (outLength != 32u));
+	return (outLength == SHA_HASH_SIZE) ? SHA256_OK : SHA256_ERROR;
+}
+
+// Calculate SHA-256 of the flash range into 'sha256_hash', returns true on error
+//------------------------------------------------
+bool app_sha256(uint32_t address, uint32_t length)
+{
+	return (app_sha256_chunked(address, length, NULL) != SHA256_OK);
 }
 
 // Read boot record from main or backup sector
@@ -56,11 +56,13 @@
 #define NOR_CMD_LUT_SEQ_IDX_PAGEPROGRAM_QUAD 7
 #define NOR_CMD_LUT_SEQ_IDX_READID 8
 #define NOR_CMD_LUT_SEQ_IDX_WRITESTATUSREG 9
-#define NOR_CMD_LUT_SEQ_IDX_ENTERQPI 10
-#define NOR_CMD_LUT_SEQ_IDX_EXITQPI 11
+#define NOR_CMD_LUT_SEQ_IDX_ERASESUSPEND 10
+#define NOR_CMD_LUT_SEQ_IDX_ERASERESUME 11
 #define NOR_CMD_LUT_SEQ_IDX_READSTATUSREG 12
 #define NOR_CMD_LUT_SEQ_IDX_ERASECHIP 13
-#define CUSTOM_LUT_LENGTH 60
+#define NOR_CMD_LUT_SEQ_IDX_ERASEBLOCK32K 14
+#define NOR_CMD_LUT_SEQ_IDX_ERASEBLOCK64K 15
+#define CUSTOM_LUT_LENGTH 64
 #define FLASH_BUSY_STATUS_POL 1
 #define FLASH_BUSY_STATUS_OFFSET 0
 
@@ -139,13 +141,13 @@ static uint32_t customLUT[CUSTOM_LUT_LENGTH] =
     [4 * NOR_CMD_LUT_SEQ_IDX_WRITESTATUSREG] =
     FLEXSPI_LUT_SEQ(kFLEXSPI_Command_SDR, kFLEXSPI_1PAD, 0x01, kFLEXSPI_Command_WRITE_SDR, kFLEXSPI_1PAD, 0x04),
 
-    // Enter QPI mode
-    [4 * NOR_CMD_LUT_SEQ_IDX_ENTERQPI] =
-    FLEXSPI_LUT_SEQ(kFLEXSPI_Command_SDR, kFLEXSPI_1PAD, 0x38, kFLEXSPI_Command_STOP, kFLEXSPI_1PAD, 0),
+    // Erase suspend (QPI mode is not used, its LUT entries are used for erase suspend/resume)
+    [4 * NOR_CMD_LUT_SEQ_IDX_ERASESUSPEND] =
+    FLEXSPI_LUT_SEQ(kFLEXSPI_Command_SDR, kFLEXSPI_1PAD, 0x75, kFLEXSPI_Command_STOP, kFLEXSPI_1PAD, 0),
 
-    // Exit QPI mode
-    [4 * NOR_CMD_LUT_SEQ_IDX_EXITQPI] =
-    FLEXSPI_LUT_SEQ(kFLEXSPI_Command_SDR, kFLEXSPI_4PAD, 0xFF, kFLEXSPI_Command_STOP, kFLEXSPI_1PAD, 0),
+    // Erase resume
+    [4 * NOR_CMD_LUT_SEQ_IDX_ERASERESUME] =
+    FLEXSPI_LUT_SEQ(kFLEXSPI_Command_SDR, kFLEXSPI_1PAD, 0x7A, kFLEXSPI_Command_STOP, kFLEXSPI_1PAD, 0),
 
     // Read status register
     [4 * NOR_CMD_LUT_SEQ_IDX_READSTATUSREG] =
@@ -154,6 +156,14 @@ static uint32_t customLUT[CUSTOM_LUT_LENGTH] =
     // Erase Chip
     [4 * NOR_CMD_LUT_SEQ_IDX_ERASECHIP] =
     FLEXSPI_LUT_SEQ(kFLEXSPI_Command_SDR, kFLEXSPI_1PAD, 0xC7, kFLEXSPI_Command_STOP, kFLEXSPI_1PAD, 0),
+
+    // Erase Block 32KB
+    [4 * NOR_CMD_LUT_SEQ_IDX_ERASEBLOCK32K] =
+    FLEXSPI_LUT_SEQ(kFLEXSPI_Command_SDR, kFLEXSPI_1PAD, 0x52, kFLEXSPI_Command_RADDR_SDR, kFLEXSPI_1PAD, 0x18),
+
+    // Erase Block 64KB
+    [4 * NOR_CMD_LUT_SEQ_IDX_ERASEBLOCK64K] =
+    FLEXSPI_LUT_SEQ(kFLEXSPI_Command_SDR, kFLEXSPI_1PAD, 0xD8, kFLEXSPI_Command_RADDR_SDR, kFLEXSPI_1PAD, 0x18),
 };
 
 /*******************************************************************************
@@ -194,11 +204,10 @@ static inline void flexspi_clock_init(void)
 }
 #endif
 
-//----------------------------------------------------
-status_t flexspi_nor_wait_bus_busy(FLEXSPI_Type *base)
+// Read the flash status once, 'isBusy' is set if the program or erase operation is in progress
+//-----------------------------------------------------------------
+status_t flexspi_nor_read_busy(FLEXSPI_Type *base, bool *isBusy)
 {
-	// Wait status ready.
-	bool isBusy;
 	uint32_t readValue;
 	status_t status;
 	flexspi_transfer_t flashXfer;
@@ -211,17 +220,29 @@ status_t flexspi_nor_wait_bus_busy(FLEXSPI_Type *base)
 	flashXfer.data = &readValue;
 	flashXfer.dataSize = 1;
 
+	status = FLEXSPI_TransferBlocking(base, &flashXfer);
+	if (status != kStatus_Success) return status;
+	if (FLASH_BUSY_STATUS_POL) {
+		if (readValue & (1U << FLASH_BUSY_STATUS_OFFSET)) *isBusy = true;
+		else *isBusy = false;
+	}
+	else {
+		if (readValue & (1U << FLASH_BUSY_STATUS_OFFSET)) *isBusy = false;
+		else *isBusy = true;
+	}
+	return status;
+}
+
+//----------------------------------------------------
+status_t flexspi_nor_wait_bus_busy(FLEXSPI_Type *base)
+{
+	// Wait status ready.
+	bool isBusy;
+	status_t status;
+
 	do {
-		status = FLEXSPI_TransferBlocking(base, &flashXfer);
+		status = flexspi_nor_read_busy(base, &isBusy);
 		if (status != kStatus_Success) return status;
-		if (FLASH_BUSY_STATUS_POL) {
-			if (readValue & (1U << FLASH_BUSY_STATUS_OFFSET)) isBusy = true;
-			else isBusy = false;
-		}
-		else {
-			if (readValue & (1U << FLASH_BUSY_STATUS_OFFSET)) isBusy = false;
-			else isBusy = true;
-		}
 	}	while (isBusy);
 
 	return status;
@@ -254,28 +275,94 @@ status_t flexspi_nor_enable_quad_mode(FLEXSPI_Type *base)
 	return status;
 }
 
-//---------------------------------------------------------------------------
-status_t flexspi_nor_flash_erase_sector(FLEXSPI_Type *base, uint32_t address)
+// Start erasing the sector or block of 'size' bytes (one of FLASH_ERASE_SIZES) at 'address'
+// Does not wait, the interrupts must be disabled until the erase is finished or suspended
+//-----------------------------------------------------------------------------------------
+status_t flexspi_nor_flash_erase_start(FLEXSPI_Type *base, uint32_t address, uint32_t size)
 {
 	status_t status;
 	flexspi_transfer_t flashXfer;
+	uint8_t seqIndex;
+
+	if (size == SECTOR_SIZE) seqIndex = NOR_CMD_LUT_SEQ_IDX_ERASESECTOR;
+	else if (size == FLASH_BLOCK32_SIZE) seqIndex = NOR_CMD_LUT_SEQ_IDX_ERASEBLOCK32K;
+	else if (size == FLASH_BLOCK64_SIZE) seqIndex = NOR_CMD_LUT_SEQ_IDX_ERASEBLOCK64K;
+	else return kStatus_InvalidArgument;
+	if (address % size) return kStatus_InvalidArgument;
 
 	// Write enable
 	status = flexspi_nor_write_enable(base, address);
-	if (status != kStatus_Success) return status;
+	if (status == kStatus_Success) {
+		flashXfer.deviceAddress = address;
+		flashXfer.port = kFLEXSPI_PortA1;
+		flashXfer.cmdType = kFLEXSPI_Command;
+		flashXfer.SeqNumber = 1;
+		flashXfer.seqIndex = seqIndex;
+		status = FLEXSPI_TransferBlocking(base, &flashXfer);
+	}
+	return status;
+}
+
+// Erase the sector or block of 'size' bytes (one of FLASH_ERASE_SIZES) at 'address'
+//-----------------------------------------------------------------------------------
+status_t flexspi_nor_flash_erase(FLEXSPI_Type *base, uint32_t address, uint32_t size)
+{
+	status_t status;
+
+	// No code may be fetched from flash (USB interrupt) while the flash is busy
+	uint32_t primask = DisableGlobalIRQ();
+
+	status = flexspi_nor_flash_erase_start(base, address, size);
+	if (status == kStatus_Success) {
+		status = flexspi_nor_wait_bus_busy(base);
+		FLEXSPI_SoftwareReset(base);
+	}
+
+	EnableGlobalIRQ(primask);
+	return status;
+}
+
+// Suspend the erase in progress, the flash can be read when it returns
+// Must be called with the interrupts disabled
+//-----------------------------------------------------
+status_t flexspi_nor_erase_suspend(FLEXSPI_Type *base)
+{
+	status_t status;
+	flexspi_transfer_t flashXfer;
 
-	flashXfer.deviceAddress = address;
+	flashXfer.deviceAddress = 0;
 	flashXfer.port = kFLEXSPI_PortA1;
 	flashXfer.cmdType = kFLEXSPI_Command;
 	flashXfer.SeqNumber = 1;
-	flashXfer.seqIndex = NOR_CMD_LUT_SEQ_IDX_ERASESECTOR;
+	flashXfer.seqIndex = NOR_CMD_LUT_SEQ_IDX_ERASESUSPEND;
 	status = FLEXSPI_TransferBlocking(base, &flashXfer);
+	if (status == kStatus_Success) {
+		// busy until suspended
+		status = flexspi_nor_wait_bus_busy(base);
+		FLEXSPI_SoftwareReset(base);
+	}
+	return status;
+}
 
-	if (status != kStatus_Success) return status;
+// Resume the suspended erase, no code may be fetched from flash until it is finished
+// Must be called with the interrupts disabled
+//----------------------------------------------------
+status_t flexspi_nor_erase_resume(FLEXSPI_Type *base)
+{
+	flexspi_transfer_t flashXfer;
 
-	status = flexspi_nor_wait_bus_busy(base);
-	FLEXSPI_SoftwareReset(base);
-	return status;
+	flashXfer.deviceAddress = 0;
+	flashXfer.port = kFLEXSPI_PortA1;
+	flashXfer.cmdType = kFLEXSPI_Command;
+	flashXfer.SeqNumber = 1;
+	flashXfer.seqIndex = NOR_CMD_LUT_SEQ_IDX_ERASERESUME;
+	return FLEXSPI_TransferBlocking(base, &flashXfer);
+}
+
+//---------------------------------------------------------------------------
+status_t flexspi_nor_flash_erase_sector(FLEXSPI_Type *base, uint32_t address)
+{
+	return flexspi_nor_flash_erase(base, address, SECTOR_SIZE);
 }
 
 //-------------------------------------------------------------------------------------------------------------------
@@ -284,29 +371,34 @@ status_t flexspi_nor_flash_buffer_program(FLEXSPI_Type *base, uint32_t address,
 	status_t status;
 	flexspi_transfer_t flashXfer;
 
+	// No code may be fetched from flash (USB interrupt) while the flash is busy
+	uint32_t primask = DisableGlobalIRQ();
+
 	// To make sure external flash be in idle status, added wait for busy before program data
 	// for an external flash without RWW(read while write) attribute.
 	status = flexspi_nor_wait_bus_busy(base);
-	if (kStatus_Success != status) return status;
-
-	// Write enable
-	status = flexspi_nor_write_enable(base, address);
-	if (status != kStatus_Success) return status;
-
-	// Prepare page program command
-	flashXfer.deviceAddress = address;
-	flashXfer.port = kFLEXSPI_PortA1;
-	flashXfer.cmdType = kFLEXSPI_Write;
-	flashXfer.SeqNumber = 1;
-	flashXfer.seqIndex = NOR_CMD_LUT_SEQ_IDX_PAGEPROGRAM_QUAD;
-	flashXfer.data = (uint32_t *)src;
-	flashXfer.dataSize = length;
+	if (kStatus_Success == status) {
+		// Write enable
+		status = flexspi_nor_write_enable(base, address);
+	}
+	if (kStatus_Success == status) {
+		// Prepare page program command
+		flashXfer.deviceAddress = address;
+		flashXfer.port = kFLEXSPI_PortA1;
+		flashXfer.cmdType = kFLEXSPI_Write;
+		flashXfer.SeqNumber = 1;
+		flashXfer.seqIndex = NOR_CMD_LUT_SEQ_IDX_PAGEPROGRAM_QUAD;
+		flashXfer.data = (uint32_t *)src;
+		flashXfer.dataSize = length;
 
-	status = FLEXSPI_TransferBlocking(base, &flashXfer);
-	if (status != kStatus_Success) return status;
+		status = FLEXSPI_TransferBlocking(base, &flashXfer);
+		if (kStatus_Success == status) {
+			status = flexspi_nor_wait_bus_busy(base);
+			FLEXSPI_SoftwareReset(base);
+		}
+	}
 
-	status = flexspi_nor_wait_bus_busy(base);
-	FLEXSPI_SoftwareReset(base);
+	EnableGlobalIRQ(primask);
 	return status;
 }
 
@@ -32,48 +32,70 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 #include "imxrt_ba_cdc.h"
 
 static char print_buf[256] = {0};
-volatile static uint8_t cdc_rx_buff[1024];
-volatile static uint32_t cdc_rx_buff_idx = 0;
+static char out_buf[CDC_OUT_BUF_SIZE];	// terminal output buffer
+static uint32_t out_len = 0;
+static bool cdc_rx_direct = false;	// direct receive transfer is pending
 char log_data[2048] = {0};
 uint32_t log_data_ptr = 0;
 
-//------------------------------
-static void cdc_process_rx(void)
+// send the buffered terminal output
+//--------------------
+void cdc_flush(void)
 {
-	if (cdc_is_rx_ready()) {
-		uint32_t readed = vcom_read_buf((void *)(cdc_rx_buff+cdc_rx_buff_idx), 512);	
-		if (readed) {
-			cdc_rx_buff_idx += readed;
-		}
+	if (out_len == 0) return;
+	if (cdc_is_rx_ready()) vcom_write_buf(out_buf, out_len, CDC_WRITE_TIMEOUT);
+	out_len = 0;
+}
+
+// add to the terminal output buffer, it is sent when full
+//-------------------------------------------------------------
+static void cdc_out_put(const char *data, uint32_t length)
+{
+	uint32_t n;
+	while (length > 0) {
+		n = sizeof(out_buf) - out_len;
+		if (n > length) n = length;
+		memcpy(out_buf + out_len, data, n);
+		out_len += n;
+		data += n;
+		length -= n;
+		if (out_len == sizeof(out_buf)) cdc_flush();
 	}
 }
 
+// add to the terminal output buffer, the output is sent at the end of line
+//---------------------------------------------------------------
+static void cdc_out_write(const char *data, uint32_t length)
+{
+	if (!cdc_is_rx_ready()) return;
+
+	cdc_out_put(data, length);
+	if (memchr(data, '\n', length) != NULL) cdc_flush();
+}
+
 //---------------------
 int cdc_putc(int value)
 {
 	if (!cdc_is_rx_ready())	return 0;
+	char c = (char)value;
 
-  return vcom_write_buf(&value, 1);
+	cdc_out_write(&c, 1);
+  return 1;
 }
 
 //----------------
 int cdc_getc(void)
 {
 	if (!cdc_is_rx_ready()) return 0;
-	uint8_t rx_char;
-
-	cdc_process_rx();
-	if (cdc_rx_buff_idx > 0) {
-		rx_char = cdc_rx_buff[0];
-		cdc_rx_buff_idx -= 1;
-		if (cdc_rx_buff_idx > 0) {
-			memmove((void *)cdc_rx_buff, (void *)(cdc_rx_buff+1), cdc_rx_buff_idx);
-		}
-	}
-		
+	uint8_t rx_char = 0;
+
+	cdc_flush();
+
+	vcom_read_buf(&rx_char, 1);
   return (int)rx_char;
 }
 
@@ -84,62 +106,166 @@ bool cdc_is_rx_ready(void)
 	else return false;
 }
 
+// negotiated USB speed
+//-------------------------
+uint32_t cdc_get_speed(void)
+{
+	return s_cdcVcom.speed;
+}
+
 //-------------------------------------------------------
 uint32_t cdc_write_buf(void const* data, uint32_t length)
 {
 	if (!cdc_is_rx_ready()) return 0;
 	
-	vcom_write_buf((void *)data, length);
+	cdc_flush();
+	if (!vcom_write_buf((void *)data, length, CDC_WRITE_TIMEOUT)) return 0;
   return length;
 }
 
+// add 'length' bytes from 'data' buffer to the transmit queue, don't wait for the transfer to finish
+// the buffer must not be changed until cdc_write_wait() returns, short buffers are copied
+//--------------------------------------------------------------------------
+bool cdc_write_start(void const* data, uint32_t length, uint32_t timeout)
+{
+	if (!cdc_is_rx_ready()) return false;
+
+	cdc_flush();
+	usb_status_t error;
+	uint32_t tmo = timeout * CPUFreq;
+	DWT->CYCCNT = 0;
+	// wait for room in the transmit queue, give up on timeout or when the host is gone
+	while ((error = vcom_write_queue(data, length)) == kStatus_USB_Busy) {
+		if ((DWT->CYCCNT > tmo) || (!cdc_is_rx_ready())) break;
+	}
+	return (error == kStatus_USB_Success);
+}
+
+// wait until no more than 'pending' transmit queue entries are left
+// the queued transfers are canceled on timeout
+//----------------------------------------------------
+bool cdc_write_sync(uint32_t pending, uint32_t timeout)
+{
+	uint32_t tmo = timeout * CPUFreq;
+	DWT->CYCCNT = 0;
+	while (vcom_write_pending() > pending) {
+		if ((DWT->CYCCNT > tmo) || (!cdc_is_rx_ready())) {
+			vcom_write_cancel();
+			return false;
+		}
+	}
+	return true;
+}
+
+// wait for all transfers started with cdc_write_start() to finish
+// the transfers are canceled on timeout
+//------------------------------------
+bool cdc_write_wait(uint32_t timeout)
+{
+	return cdc_write_sync(0, timeout);
+}
+
+// number of transmit queue entries not yet sent
+//------------------------------
+uint32_t cdc_write_pending(void)
+{
+	return vcom_write_pending();
+}
+
 // read 'length' bytes from CDC input into 'data' buffer
 //------------------------------------------------------------------
 uint32_t cdc_read_buf(void* data, uint32_t length, uint32_t timeout)
 {
 	if (!cdc_is_rx_ready()) return 0;
 
-  int32_t remaining = length;
-	uint32_t readed = 0;
 	uint32_t received = 0;
   char *dst = (char *)data;
 
+	// the terminal output must be sent before waiting for input
+	cdc_flush();
+
 	uint32_t tmo = timeout * CPUFreq;
 	DWT->CYCCNT = 0;
-  while (remaining > 0)
+  while (received < length)
   {
 		if (DWT->CYCCNT >tmo) break;
 		// get new data from cdc input
-		cdc_process_rx();
-		if (cdc_rx_buff_idx > 0) {
-			readed = 0;
-			while (remaining > 0) {
-				*dst = cdc_rx_buff[readed];
-				dst++;
-				remaining--;
-				readed++;
-				received++;
-				if (readed >= cdc_rx_buff_idx) break;
-			}
-			cdc_rx_buff_idx -= readed;
-			if (cdc_rx_buff_idx > 0) {
-				memmove((void *)cdc_rx_buff, (void *)(cdc_rx_buff+readed), cdc_rx_buff_idx);
-			}
-		}
+		received += vcom_read_buf(dst + received, length - received);
   }
 
   return received;
 }
 
+// number of bytes received on CDC input and not yet read
+//---------------------------
+uint32_t cdc_rx_count(void)
+{
+	if (!cdc_is_rx_ready()) return 0;
+
+	return vcom_read_avail();
+}
+
+// read up to 'length' bytes already received on CDC input, does not wait
+//-----------------------------------------------------
+uint32_t cdc_read_avail(void* data, uint32_t length)
+{
+	if (!cdc_is_rx_ready()) return 0;
+
+	return vcom_read_buf(data, length);
+}
+
+// receive up to 'length' bytes into 'data' buffer, does not wait
+// the bytes already in the CDC input buffer are copied, when it is empty the USB transfer
+// is started directly into 'data' and the received length is returned when it completes
+//------------------------------------------------------
+uint32_t cdc_read_direct(void* data, uint32_t length)
+{
+	if (!cdc_is_rx_ready()) return 0;
+
+	uint32_t readed;
+	// whole packets are received, the transfer ends with the host's short packet or at 'size'
+	uint32_t size = vcom_rx_packet_size();
+	size = ((length + size - 1) / size) * size;
+	if (cdc_rx_direct) {
+		readed = vcom_recv_done();
+		if (readed == VCOM_RECV_PENDING) return 0;
+		cdc_rx_direct = false;
+		// canceled transfer reports invalid length
+		return (readed <= size) ? readed : 0;
+	}
+	if (vcom_recv_start(data, size) == kStatus_USB_Success) {
+		cdc_rx_direct = true;
+		return 0;
+	}
+	// the data already received or of the already scheduled transfer goes through the ring buffer
+	return vcom_read_buf(data, length);
+}
+
+// cancel the direct receive, CDC input is received into the CDC input buffer again
+//-------------------------
+void cdc_read_stop(void)
+{
+	vcom_recv_stop();
+	cdc_rx_direct = false;
+}
+
 //----------------------
 void cdc_rx_ignore(void)
 {
-  while (1)
-  {
-		cdc_process_rx();
-		if (cdc_rx_buff_idx == 0) break;
-		cdc_rx_buff_idx = 0;
-  }
+	cdc_read_stop();
+	vcom_read_flush();
+}
+
+// discard CDC input until no data is received for 'idle' mili seconds
+//---------------------------------
+void cdc_rx_drain(uint32_t idle)
+{
+	uint32_t tmo = idle * CPUFreq;
+	cdc_read_stop();
+	DWT->CYCCNT = 0;
+	while (DWT->CYCCNT < tmo) {
+		if (vcom_read_flush() > 0) DWT->CYCCNT = 0;
+	}
 }
 
 //---------------------------------------
@@ -156,26 +282,30 @@ void byte_to_hex(uint8_t c, char *hexBuf)
 	hexBuf[0] = temp;
 }
 
+// the whole dump is buffered and sent when done
 //----------------------------------------------------------
 void print_hex(const char* buf, uint32_t length, bool split)
 {
+	if (!cdc_is_rx_ready()) return;
+
 	char chex[4];
 	uint32_t hlen = 2;
 	if (split) {
 		hlen = 3;
-		cdc_write_buf("\r\n", 2);
+		cdc_out_put("\r\n", 2);
 	}
 	for (int i=0; i<length; i++) {
 		byte_to_hex(buf[i], chex);
 		chex[2] = ' ';
-		cdc_write_buf(chex, hlen);
+		cdc_out_put(chex, hlen);
 		if ((split) && (i > 0) && ((i % 32) == 0)) {
-			cdc_write_buf("\r\n", 2);
+			cdc_out_put("\r\n", 2);
 		}
 	}
 	if (split) {
-		cdc_write_buf("\r\n", 2);
+		cdc_out_put("\r\n", 2);
 	}
+	cdc_flush();
 }
 
 //----------------------------------
@@ -183,21 +313,29 @@ void print(const char* format, ...)
 {
   va_list va;
   va_start(va, format);
-  int ret = vsprintf(print_buf, format, va);
+  int ret = vsnprintf(print_buf, sizeof(print_buf), format, va);
   va_end(va);
 	if (ret > 0) {
-			cdc_write_buf(print_buf, ret);
+			if (ret >= sizeof(print_buf)) ret = sizeof(print_buf)-1;
+			cdc_out_write(print_buf, ret);
 	}
 }
 
+// print the string of any length, used for the log dump
+//--------------------------------
+void print_str(const char* str)
+{
+	cdc_out_write(str, strlen(str));
+}
+
 //-------------------------------------
 void log_print(const char* format, ...)
 {
   va_list va;
   va_start(va, format);
-  int ret = vsprintf(print_buf, format, va);
+  int ret = vsnprintf(print_buf, sizeof(print_buf), format, va);
   va_end(va);
-	if ((ret > 0) && ((log_data_ptr+ret) < (sizeof(log_data)-4))) {
+	if ((ret > 0) && (ret < sizeof(print_buf)) && ((log_data_ptr+ret) < (sizeof(log_data)-4))) {
 		memcpy(log_data+log_data_ptr, print_buf, ret);
 		log_data_ptr += ret;
 		sprintf(log_data+log_data_ptr, "\r\n");
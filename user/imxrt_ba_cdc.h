@@ -38,6 +38,9 @@
 #include "virtual_com.h"
 
 #define CDC_READBUF_TIMEOUT 	250
+#define CDC_WRITE_TIMEOUT 		2000
+#define CDC_RX_PACKET_SIZE		512		// max USB packet size, direct receive is rounded up to it
+#define CDC_OUT_BUF_SIZE			512		// terminal output buffer size
 
 extern usb_cdc_vcom_struct_t s_cdcVcom;	
 extern uint32_t CPUFreq;
@@ -52,6 +55,14 @@ extern uint32_t log_data_ptr;
  */
 int cdc_putc(int value);
 
+/**
+ * \brief Sends the buffered terminal output
+ *
+ * The output of print(), print_hex() and cdc_putc() is buffered and sent at the
+ * end of line, when the buffer is full or before waiting for input.
+ */
+void cdc_flush(void);
+
 /**
  * \brief Reads a single byte through USB CDC
  *
@@ -66,6 +77,13 @@ int cdc_getc(void);
  */
 bool cdc_is_rx_ready(void);
 
+/**
+ * \brief Returns the negotiated USB speed
+ *
+ * \return USB_SPEED_FULL or USB_SPEED_HIGH
+ */
+uint32_t cdc_get_speed(void);
+
 /**
  * \brief Sends buffer on USB CDC
  *
@@ -75,6 +93,41 @@ bool cdc_is_rx_ready(void);
  */
 uint32_t cdc_write_buf(void const* data, uint32_t length);
 
+/**
+ * \brief Adds buffer to the USB CDC transmit queue, does not wait for the transfer to finish
+ *
+ * \param data pointer, must be valid until cdc_write_wait() returns
+ *        if longer than VCOM_TX_COPY_SIZE, shorter buffers are copied
+ * \param number of data to send
+ * \param timeout in mili seconds to wait for room in the queue
+ * \return true if the transfer was queued
+ */
+bool cdc_write_start(void const* data, uint32_t length, uint32_t timeout);
+
+/**
+ * \brief Waits until no more than the given number of transmit queue entries are left
+ *
+ * \param number of entries allowed to stay in the queue
+ * \param timeout in mili seconds, the queued transfers are canceled on timeout
+ * \return true if the entries were sent
+ */
+bool cdc_write_sync(uint32_t pending, uint32_t timeout);
+
+/**
+ * \brief Waits for all transfers started by cdc_write_start() to finish
+ *
+ * \param timeout in mili seconds, the transfers are canceled on timeout
+ * \return true if the transfers finished
+ */
+bool cdc_write_wait(uint32_t timeout);
+
+/**
+ * \brief Returns the number of transmit queue entries not yet sent
+ *
+ * \return number of entries, a transfer followed by zero length packet takes two
+ */
+uint32_t cdc_write_pending(void);
+
 /**
  * \brief Gets specified number of bytes on USB CDC
  *
@@ -85,9 +138,46 @@ uint32_t cdc_write_buf(void const* data, uint32_t length);
  */
 uint32_t cdc_read_buf(void* data, uint32_t length, uint32_t timeout);
 
+/**
+ * \brief Gets the bytes already received on USB CDC, does not wait
+ *
+ * \param data pointer
+ * \param max number of data to read
+ * \return number of data read
+ */
+uint32_t cdc_read_avail(void* data, uint32_t length);
+
+/**
+ * \brief Returns the number of bytes received on USB CDC and not yet read
+ *
+ * \return number of bytes in the CDC input buffer
+ */
+uint32_t cdc_rx_count(void);
+
+/**
+ * \brief Receives directly into the buffer by USB DMA, does not wait
+ *
+ * The bytes already in the CDC input buffer are copied first. Otherwise the
+ * transfer is started into the buffer and its length is returned on completion,
+ * the buffer must stay valid until then or until cdc_read_stop() is called.
+ * Other CDC input functions must not be used before cdc_read_stop().
+ *
+ * \param data pointer, DMA capable, with room for 'length' rounded up to CDC_RX_PACKET_SIZE
+ * \param number of data expected
+ * \return number of data received, can be more than expected if the host sent more
+ */
+uint32_t cdc_read_direct(void* data, uint32_t length);
+
+/**
+ * \brief Cancels the direct receive started by cdc_read_direct()
+ */
+void cdc_read_stop(void);
+
 void print(const char* format, ...);
 void print_hex(const char* buf, uint32_t length, bool split);
+void print_str(const char* str);
 void cdc_rx_ignore(void);
+void cdc_rx_drain(uint32_t idle);
 void log_print(const char* format, ...);
 void byte_to_hex(uint8_t c, char *hexBuf);
 
@@ -0,0 +1,117 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Part of the iMX RT MicroPython port
+ * iMX RT CDC ACM Bootloader with OTA support
+ *
+ * Code inspired by CDC Arduino bootloader for SeeedStudio's ArchMix board
+ * https://github.com/Seeed-Studio/ArduinoCore-imxrt/tree/master/bootloaders
+ * 
+ * Author: LoBo (loboris@gmail.com)
+ * 
+ * Copyright (C) 2021  LoBo
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "fsl_common.h"
+#include "fsl_dcp.h"
+#include "imxrt_ba_crc.h"
+
+// Slicing-by-8 tables, built on first use, no flash space is used for them
+static uint32_t crc32Table[8][256];
+static bool crc32_ready = false;
+
+//--------------------------
+static void crc32_init(void)
+{
+	uint32_t crc;
+
+	for (uint32_t i=0; i<256; i++) {
+		crc = i;
+		for (int n=0; n<8; n++) {
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32_POLY : 0);
+		}
+		crc32Table[0][i] = crc;
+	}
+	// table 'n' holds the crc of the byte followed by 'n' zero bytes
+	for (uint32_t i=0; i<256; i++) {
+		crc = crc32Table[0][i];
+		for (int n=1; n<8; n++) {
+			crc = (crc >> 8) ^ crc32Table[0][crc & 0xFF];
+			crc32Table[n][i] = crc;
+		}
+	}
+	crc32_ready = true;
+}
+
+// Standard (reflected) CRC32, as used by zlib and Python's binascii.crc32
+// Slicing-by-8, 8 bytes are processed per iteration
+//---------------------------------------------------------------------
+uint32_t crc32(const void* data, size_t length, uint32_t previousCrc32)
+{
+	uint32_t crc = ~previousCrc32;
+	const uint8_t *pbuf = (const uint8_t *)data;
+	const uint32_t *pword;
+	uint32_t one, two;
+
+	if (!crc32_ready) crc32_init();
+
+	// byte by byte up to the word aligned address
+	while ((length > 0) && ((uint32_t)pbuf & 3)) {
+		crc = (crc >> 8) ^ crc32Table[0][(crc ^ *pbuf++) & 0xFF];
+		length--;
+	}
+
+	pword = (const uint32_t *)pbuf;
+	while (length >= 8) {
+		one = *pword++ ^ crc;
+		two = *pword++;
+		crc = crc32Table[7][one & 0xFF] ^ crc32Table[6][(one >> 8) & 0xFF] ^
+					crc32Table[5][(one >> 16) & 0xFF] ^ crc32Table[4][one >> 24] ^
+					crc32Table[3][two & 0xFF] ^ crc32Table[2][(two >> 8) & 0xFF] ^
+					crc32Table[1][(two >> 16) & 0xFF] ^ crc32Table[0][two >> 24];
+		length -= 8;
+	}
+
+	pbuf = (const uint8_t *)pword;
+	while (length-- > 0) {
+		crc = (crc >> 8) ^ crc32Table[0][(crc ^ *pbuf++) & 0xFF];
+	}
+
+	return ~crc;
+}
+
+// CRC32 calculated by DCP engine
+// DCP calculates CRC-32/MPEG-2 (not reflected, no final xor), the result is NOT
+// the same as crc32() result and can not be used in the binary protocol
+//-------------------------------------------------------------
+bool crc32_dcp(const void* data, size_t length, uint32_t *crc)
+{
+	dcp_handle_t m_handle;
+
+	m_handle.channel    = kDCP_Channel0;
+	m_handle.keySlot    = kDCP_KeySlot0;
+	m_handle.swapConfig = kDCP_NoSwap;
+
+	size_t outLength = sizeof(uint32_t);
+	status_t status = DCP_HASH(DCP, &m_handle, kDCP_Crc32, (const uint8_t *)data, length, (uint8_t *)crc, &outLength);
+
+	return ((kStatus_Success == status) && (outLength == sizeof(uint32_t)));
+}
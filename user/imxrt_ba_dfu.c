@@ -0,0 +1,321 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Part of the iMX RT MicroPython port
+ * iMX RT CDC ACM Bootloader with OTA support
+ *
+ * Code inspired by CDC Arduino bootloader for SeeedStudio's ArchMix board
+ * https://github.com/Seeed-Studio/ArduinoCore-imxrt/tree/master/bootloaders
+ * 
+ * Author: LoBo (loboris@gmail.com)
+ * 
+ * Copyright (C) 2021  LoBo
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "imxrt_ba_dfu.h"
+
+#if ((defined(USB_DEVICE_CONFIG_DFU)) && (USB_DEVICE_CONFIG_DFU > 0U))
+
+#include "virtual_com.h"
+#include "usb_device_dfu.h"
+#include "imxrt_ba_monitor.h"
+#include "imxrt_ba_flash.h"
+#include "board_drive_led.h"
+#include "app.h"
+
+#define DFU_IVT_HEADER				0x412000D1
+#define DFU_IVT_OFFSET				0x1000
+#define DFU_POLL_TIMEOUT			20				// ms, the host waits before the next DFU_GETSTATUS if busy
+
+// Download buffer state
+#define DFU_BUF_FREE					0
+#define DFU_BUF_RX						1					// receiving the block
+#define DFU_BUF_FULL					2					// waiting for dfu_poll()
+
+// Download buffer, the next block is received while the previous one is flashed
+//----------------------------
+typedef struct _dfu_buffer_t_ {
+	volatile uint8_t state;
+	uint32_t gen;									// download the block belongs to
+	uint32_t offset;
+	uint32_t length;
+}	dfu_buffer_t;
+
+// Image being flashed
+//----------------------------
+typedef struct _dfu_session_t_ {
+	bool     active;
+	uint32_t gen;
+	uint32_t address;							// image start, from the image IVT
+	uint32_t size;								// bytes flashed
+}	dfu_session_t;
+
+USB_DMA_NONINIT_DATA_ALIGN(USB_DATA_ALIGN_SIZE) static uint8_t dfu_data[2][USB_DEVICE_DFU_TRANSFER_SIZE];
+static dfu_buffer_t dfu_buf[2];
+static dfu_session_t dfu;
+
+// Set by the USB interrupt, a new download or abort drops the blocks of the previous one
+static volatile uint32_t dfu_gen = 0;
+static volatile bool dfu_manifest = false;
+static volatile uint32_t dfu_manifest_size = 0;
+// Set by dfu_poll(), reported by the next DFU_GETSTATUS
+static volatile uint8_t dfu_status = kUSB_DeviceDfuStatusOk;
+
+// Application read by DFU upload in the USB interrupt
+static volatile uint32_t dfu_app_address = 0;
+static volatile uint32_t dfu_app_size = 0;
+static volatile bool dfu_upload_wait = false;		// upload stalled by the background erase
+static uint32_t dfu_app_crc = 0;
+static bool dfu_app_valid = false;
+
+// Take the snapshot of the active application, or the first configured one
+//----------------------------
+static void dfu_app_snapshot()
+{
+	uint32_t address = 0, size = 0;
+	int idx = app_boot_slot();
+
+	if (idx >= 0) {
+		address = boot_rec.apps[idx].address;
+		size = boot_rec.apps[idx].size & 0x00FFFFFF;
+	}
+
+	uint32_t primask = DisableGlobalIRQ();
+	dfu_app_address = address;
+	dfu_app_size = size;
+	EnableGlobalIRQ(primask);
+
+	dfu_app_crc = boot_rec.crc;
+	dfu_app_valid = true;
+}
+
+// Drop the download in progress, called from the USB interrupt
+//----------------------------
+static void dfu_download_reset()
+{
+	dfu_gen++;
+	dfu_manifest = false;
+	dfu_status = kUSB_DeviceDfuStatusOk;
+}
+
+// Flash the download block, the first block must contain the image IVT
+// Returns the DFU status code
+//----------------------------------------------------------------------------------------
+static uint8_t dfu_write_block(uint32_t gen, uint32_t offset, uint8_t *data, uint32_t length)
+{
+	if (offset == 0) {
+		// new image, the flash address is taken from the IVT as the loader program does
+		dfu.active = false;
+		if ((length < (DFU_IVT_OFFSET + 8)) || (*(uint32_t *)data != FCFB_BLOCK_ID) ||
+				(*(uint32_t *)(data + DFU_IVT_OFFSET) != DFU_IVT_HEADER)) return kUSB_DeviceDfuStatusErrFile;
+		uint32_t address = *(uint32_t *)(data + DFU_IVT_OFFSET + 4) & 0xFFFF0000;
+		if ((address < APP_START_ADDRESS) || (address >= SESSION_JOURNAL_ADDRESS)) return kUSB_DeviceDfuStatusErrAddress;
+		dfu.active = true;
+		dfu.gen = gen;
+		dfu.address = address;
+		dfu.size = 0;
+		// the image size is not known yet, the hash is finished at the image end
+		uint32_t max_size = SESSION_JOURNAL_ADDRESS - address;
+		app_sha256_begin(address, (max_size > MAX_APP_SIZE) ? MAX_APP_SIZE : max_size);
+	}
+	else if ((!dfu.active) || (dfu.gen != gen) || (dfu.size != offset)) return kUSB_DeviceDfuStatusErrNotDone;
+
+	// only the last block can be shorter than a page
+	if ((offset % FLASH_PAGE_SIZE) || (offset > MAX_APP_SIZE) || (length > (MAX_APP_SIZE - offset)) ||
+			(length > (SESSION_JOURNAL_ADDRESS - dfu.address - offset))) return kUSB_DeviceDfuStatusErrAddress;
+
+	uint32_t address = dfu.address + offset;
+	while (length > 0) {
+		// program sector by sector, the sector is erased when its first page is written
+		uint32_t len = SECTOR_SIZE - (address % SECTOR_SIZE);
+		if (len > length) len = length;
+		status_t status = flash_program_buffer(address, data, len);
+		if (status != FERR_OK) {
+			app_sha256_invalidate(address, len);
+			return (status == FERR_ERASE) ? kUSB_DeviceDfuStatusErrErase : kUSB_DeviceDfuStatusErrProg;
+		}
+		if ((uint32_t)_check_flash_data(address, data, len) != len) {
+			app_sha256_invalidate(address, len);
+			return kUSB_DeviceDfuStatusErrVerify;
+		}
+		app_sha256_update(address, data, len);
+		address += len;
+		data += len;
+		length -= len;
+		dfu.size += len;
+	}
+	return kUSB_DeviceDfuStatusOk;
+}
+
+// Download is complete, set the image as the active application
+// Returns the DFU status code
+//----------------------------
+static uint8_t dfu_app_install(uint32_t gen)
+{
+	app_rec_t rec;
+
+	if ((!dfu.active) || (dfu.gen != gen) || (dfu.size != dfu_manifest_size)) return kUSB_DeviceDfuStatusErrNotDone;
+	dfu.active = false;
+	if (dfu.size < MIN_APP_SIZE) return kUSB_DeviceDfuStatusErrFile;
+	// the image size is known now, the running hash is finished at the image end
+	app_sha256_end(dfu.address, dfu.size);
+	if (app_sha256(dfu.address, dfu.size)) return kUSB_DeviceDfuStatusErrVerify;
+
+	memset(&rec, 0, sizeof(app_rec_t));
+	strcpy(rec.name, "DFU");
+	rec.address = dfu.address;
+	rec.size = dfu.size | APP_FLAG_ACTIVE;
+	memcpy(rec.sha256, sha256_hash, SHA_HASH_SIZE);
+
+	if (app_record_install(&rec, app_install_slot(dfu.address)) != CMD_ERR_OK) return kUSB_DeviceDfuStatusErrWrite;
+
+	dfu_app_snapshot();
+	return kUSB_DeviceDfuStatusOk;
+}
+
+// DFU class callback, called from the USB interrupt
+// The download blocks are held in the buffers until flashed by dfu_poll()
+//------------------------------------------------------------------------------------
+usb_status_t USB_DeviceDfuCallback(class_handle_t handle, uint32_t event, void *param)
+{
+	usb_device_dfu_block_struct_t *block;
+	usb_device_dfu_status_struct_t *status;
+	int i;
+
+	switch (event) {
+		case kUSB_DeviceDfuEventDownloadBuffer:
+			block = (usb_device_dfu_block_struct_t *)param;
+			if (block->offset == 0) dfu_download_reset();
+			for (i=0; i<2; i++) {
+				if (dfu_buf[i].state == DFU_BUF_FREE) break;
+			}
+			// the host does not send the next block while the status is busy
+			if (i == 2) return kStatus_USB_Busy;
+			dfu_buf[i].state = DFU_BUF_RX;
+			dfu_buf[i].gen = dfu_gen;
+			dfu_buf[i].offset = block->offset;
+			block->buffer = dfu_data[i];
+			break;
+		case kUSB_DeviceDfuEventDownload:
+			block = (usb_device_dfu_block_struct_t *)param;
+			for (i=0; i<2; i++) {
+				if ((dfu_buf[i].state == DFU_BUF_RX) && (block->buffer == dfu_data[i])) {
+					dfu_buf[i].length = block->length;
+					dfu_buf[i].state = DFU_BUF_FULL;
+				}
+			}
+			break;
+		case kUSB_DeviceDfuEventManifest:
+			block = (usb_device_dfu_block_struct_t *)param;
+			dfu_manifest_size = block->offset;
+			dfu_manifest = true;
+			break;
+		case kUSB_DeviceDfuEventGetStatus:
+			status = (usb_device_dfu_status_struct_t *)param;
+			if (dfu_status != kUSB_DeviceDfuStatusOk) {
+				// the download failed, the blocks still waiting are dropped
+				status->status = dfu_status;
+				dfu_download_reset();
+				break;
+			}
+			status->busy = (dfu_manifest) || ((dfu_buf[0].state != DFU_BUF_FREE) && (dfu_buf[1].state != DFU_BUF_FREE));
+			status->pollTimeout = DFU_POLL_TIMEOUT;
+			break;
+		case kUSB_DeviceDfuEventUpload:
+			block = (usb_device_dfu_block_struct_t *)param;
+			// read directly from flash, the block shorter than requested ends the upload
+			if (block->offset >= dfu_app_size) block->length = 0;
+			else if ((block->offset + block->length) > dfu_app_size) block->length = dfu_app_size - block->offset;
+			block->buffer = (uint8_t *)(dfu_app_address + block->offset);
+			if (flash_erase_overlaps((uint32_t)block->buffer, block->length)) {
+				// the request is stalled, dfu_poll() finishes the erase before the host retries
+				dfu_upload_wait = true;
+				return kStatus_USB_Error;
+			}
+			break;
+		case kUSB_DeviceDfuEventAbort:
+			dfu_download_reset();
+			for (i=0; i<2; i++) {
+				if (dfu_buf[i].state == DFU_BUF_RX) dfu_buf[i].state = DFU_BUF_FREE;
+			}
+			break;
+		default:
+			break;
+	}
+	return kStatus_USB_Success;
+}
+
+//------------------
+bool dfu_busy(void)
+{
+	return (dfu_buf[0].state == DFU_BUF_FULL) || (dfu_buf[1].state == DFU_BUF_FULL) || (dfu_manifest) || (dfu_upload_wait);
+}
+
+//------------------
+void dfu_poll(void)
+{
+	if ((!dfu_app_valid) || (boot_rec.crc != dfu_app_crc)) dfu_app_snapshot();
+
+	if (dfu_upload_wait) {
+		// the upload was stalled by the background erase, finish it outside of the USB interrupt
+		flash_erase_finish(dfu_app_address, dfu_app_size);
+		dfu_upload_wait = false;
+	}
+
+	// the received block with the lowest offset is flashed first, the blocks of the dropped download are freed
+	int idx = -1;
+	uint32_t primask = DisableGlobalIRQ();
+	uint32_t gen = dfu_gen;
+	for (int i=0; i<2; i++) {
+		if (dfu_buf[i].state != DFU_BUF_FULL) continue;
+		if (dfu_buf[i].gen != gen) dfu_buf[i].state = DFU_BUF_FREE;
+		else if ((idx < 0) || (dfu_buf[i].offset < dfu_buf[idx].offset)) idx = i;
+	}
+	EnableGlobalIRQ(primask);
+
+	if (idx >= 0) {
+		LED_toggle();
+		uint8_t res = dfu_write_block(gen, dfu_buf[idx].offset, dfu_data[idx], dfu_buf[idx].length);
+		primask = DisableGlobalIRQ();
+		// the first error of the download is reported
+		if ((res != kUSB_DeviceDfuStatusOk) && (gen == dfu_gen) && (dfu_status == kUSB_DeviceDfuStatusOk)) {
+			dfu.active = false;
+			dfu_status = res;
+		}
+		dfu_buf[idx].state = DFU_BUF_FREE;
+		EnableGlobalIRQ(primask);
+		return;
+	}
+
+	if (dfu_manifest) {
+		LED_toggle();
+		uint8_t res = dfu_app_install(gen);
+		primask = DisableGlobalIRQ();
+		if (gen == dfu_gen) {
+			dfu_status = res;
+			dfu_manifest = false;
+		}
+		EnableGlobalIRQ(primask);
+	}
+}
+
+#endif
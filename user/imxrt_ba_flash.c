@@ -34,17 +34,105 @@
 #include "imxrt_ba_flash.h"
 #include "fsl_debug_console.h"
 
+// Function called between flash operations while the flash is idle
+static flash_yield_t flash_yield = NULL;
+
+flash_stats_t flash_stats = {0};
+
+// Background erase of the queued range
+//--------------------------------------
+typedef struct _bg_erase_t_ {
+	uint32_t addr;		// start of the erase operation in progress or of the next one
+	uint32_t end;			// end of the queued range
+	uint32_t size;		// size of the erase operation in progress, 0 if none
+	bool suspended;		// the erase operation in progress is suspended
+}	bg_erase_t;
+
+static bg_erase_t bg_erase = {0};
+
+static void _bg_erase_sync(uint32_t address);
+
+// Set the function to be called between flash operations, NULL to disable
+//------------------------------------------
+void flash_set_yield(flash_yield_t yield)
+{
+	flash_yield = yield;
+}
+
+// Number of leading 0xFF bytes in 'data', 'length' if all bytes are 0xFF
+// Word aligned data is checked 32 bytes per loop (LDRD/LDM loads),
+// the exact index is then found byte by byte in the failing group
+//------------------------------------------------------------
+uint32_t flash_blank_len(const void *data, uint32_t length)
+{
+	const uint8_t *pdata = (const uint8_t *)data;
+	uint32_t i = 0;
+
+	if (((uint32_t)pdata & 3) == 0) {
+		const uint32_t *pw = (const uint32_t *)pdata;
+		for (; (i+32) <= length; i+=32, pw+=8) {
+			if ((pw[0] & pw[1] & pw[2] & pw[3] & pw[4] & pw[5] & pw[6] & pw[7]) != 0xFFFFFFFF) break;
+		}
+	}
+	for (; i<length; i++) {
+		if (pdata[i] != 0xFF) break;
+	}
+	return i;
+}
+
+// Number of leading bytes equal in 'data1' and 'data2', 'length' if all are equal
+// Word aligned buffers are compared 32 bytes per loop, as in flash_blank_len()
+//------------------------------------------------------------------------------
+uint32_t flash_cmp_len(const void *data1, const void *data2, uint32_t length)
+{
+	const uint8_t *pdata1 = (const uint8_t *)data1;
+	const uint8_t *pdata2 = (const uint8_t *)data2;
+	uint32_t i = 0;
+
+	if ((((uint32_t)pdata1 | (uint32_t)pdata2) & 3) == 0) {
+		const uint32_t *pw1 = (const uint32_t *)pdata1;
+		const uint32_t *pw2 = (const uint32_t *)pdata2;
+		for (; (i+32) <= length; i+=32, pw1+=8, pw2+=8) {
+			if (((pw1[0] ^ pw2[0]) | (pw1[1] ^ pw2[1]) | (pw1[2] ^ pw2[2]) | (pw1[3] ^ pw2[3]) |
+					 (pw1[4] ^ pw2[4]) | (pw1[5] ^ pw2[5]) | (pw1[6] ^ pw2[6]) | (pw1[7] ^ pw2[7])) != 0) break;
+		}
+	}
+	for (; i<length; i++) {
+		if (pdata1[i] != pdata2[i]) break;
+	}
+	return i;
+}
+
+// Number of leading bytes of 'data' which can be programmed over the 'flash' content
+// without erase, 'data' must not have any bit set which is cleared in 'flash'
+// Word aligned buffers are checked 32 bytes per loop, as in flash_blank_len()
+//-------------------------------------------------------------------------------
+uint32_t flash_subset_len(const void *flash, const void *data, uint32_t length)
+{
+	const uint8_t *pflash = (const uint8_t *)flash;
+	const uint8_t *pdata = (const uint8_t *)data;
+	uint32_t i = 0;
+
+	if ((((uint32_t)pflash | (uint32_t)pdata) & 3) == 0) {
+		const uint32_t *pwf = (const uint32_t *)pflash;
+		const uint32_t *pwd = (const uint32_t *)pdata;
+		for (; (i+32) <= length; i+=32, pwf+=8, pwd+=8) {
+			if (((pwd[0] & ~pwf[0]) | (pwd[1] & ~pwf[1]) | (pwd[2] & ~pwf[2]) | (pwd[3] & ~pwf[3]) |
+					 (pwd[4] & ~pwf[4]) | (pwd[5] & ~pwf[5]) | (pwd[6] & ~pwf[6]) | (pwd[7] & ~pwf[7])) != 0) break;
+		}
+	}
+	for (; i<length; i++) {
+		if (pdata[i] & ~pflash[i]) break;
+	}
+	return i;
+}
+
 // Check if sector is already erased
 //----------------------------------
 int _sector_erased(uint32_t address)
 {
 	DCACHE_CleanInvalidateByRange(address, SECTOR_SIZE);
-	uint8_t *psect = (uint8_t *)address;
-	int i = 0;
-	for (i=0; i<SECTOR_SIZE; i++) {
-		if (psect[i] != 0xFF) break;
-	}
-	return i;
+	return flash_blank_len((const void *)address, SECTOR_SIZE);
 }
  
 // Check if flash data are already equal to provided buffer data (to be programmed)
@@ -52,43 +140,265 @@ int _sector_erased(uint32_t address)
 int _check_flash_data(uint32_t address, uint8_t * data, uint32_t length)
 {
 	DCACHE_CleanInvalidateByRange(address, length);
-	uint8_t *pflash = (uint8_t *)address;
+	return flash_cmp_len((const void *)address, data, length);
+}
+ 
+// Number of sectors in the range which are not erased
+//-----------------------------------------------------------
+static uint32_t _sectors_to_erase(uint32_t address, uint32_t length)
+{
+	uint32_t count = 0;
+	for (uint32_t offset=0; offset<length; offset+=SECTOR_SIZE) {
+		if (_sector_erased(address+offset) < SECTOR_SIZE) count++;
+	}
+	return count;
+}
 
-	int i = 0;
-	for (i=0; i<length; i++) {
-		if (pflash[i] != data[i]) break;
+// Largest supported erase size aligned at 'address' and not crossing 'end'
+//-----------------------------------------------------------------
+static uint32_t _erase_op_size(uint32_t address, uint32_t end)
+{
+	uint32_t size = SECTOR_SIZE;
+	for (uint32_t op_size=SECTOR_SIZE<<1; (op_size != 0) && (op_size <= FLASH_ERASE_SIZES); op_size<<=1) {
+		if ((FLASH_ERASE_SIZES & op_size) && ((address % op_size) == 0) && ((end - address) >= op_size)) size = op_size;
 	}
-	return i;
+	return size;
 }
- 
-// Erase flash sectors (4096 bytes) at 'address'
+
+// Size of the next erase operation at 'address' not crossing 'end'
+// Returns the number of sectors to erase in it, 0 if already erased
+// and the already erased sectors are skipped together
+//-------------------------------------------------------------------------
+static uint32_t _erase_plan(uint32_t address, uint32_t end, uint32_t *size)
+{
+	uint32_t count = 0;
+	uint32_t first;
+
+	*size = _erase_op_size(address, end);
+	first = *size;
+	for (uint32_t offset=0; offset<*size; offset+=SECTOR_SIZE) {
+		if (_sector_erased(address+offset) < SECTOR_SIZE) {
+			if (count == 0) first = offset;
+			count++;
+		}
+	}
+	if ((*size > SECTOR_SIZE) && (count <= FLASH_ERASE_SECTORS_MAX)) {
+		// cheaper to erase the few sectors, the erased sectors before the first one are skipped
+		if (first > 0) {
+			*size = first;
+			return 0;
+		}
+		*size = SECTOR_SIZE;
+		return 1;
+	}
+	return count;
+}
+
+// Erase flash range at 'address', 'length' is rounded up to the sector size (4096 bytes)
+// The range is covered with the largest block erases fitting into it,
+// the blocks already erased are skipped, the blocks with only a few sectors
+// to erase are erased sector by sector
+//-----------------------------------------------------------
+static status_t _flash_erase(uint32_t address, uint32_t length)
+{
+	status_t status = kStatus_Success;
+	uint32_t end, size, count;
+
+	// sector aligned end of the range
+	end = address + length;
+	if  (0 != (length % (uint32_t)SECTOR_SIZE)) end += SECTOR_SIZE - (length % (uint32_t)SECTOR_SIZE);
+
+	// no other erase may be in progress
+	_bg_erase_sync(0);
+
+	while (address < end) {
+		count = _erase_plan(address, end, &size);
+		if (count > 0) {
+			status = flexspi_nor_flash_erase(BOOTLOADER_FLEXSPI, address-BOOTLOADER_FLEXSPI_AMBA_BASE, size);
+			if (kStatus_Success != status) return FERR_ERASE;
+			flash_stats.erases++;
+			if (_sectors_to_erase(address, size) > 0) return FERR_ERASE;
+		}
+		address += size;
+		if (flash_yield) flash_yield();
+	}
+
+	return FERR_OK;
+}
+
+// Erase flash range at 'address' between the boot records and the session journal
 //-----------------------------------------------------
 status_t flash_erase(uint32_t address, uint32_t length)
 {
-	status_t status = kStatus_Success;
+	// Check if the parameters are valid, the journal sector is erased only by flash_erase_journal()
+	if (0 != (address % (uint32_t)SECTOR_SIZE)) return FERR_ADDRESS_ALIGN;
+	if (address < BOOT_BACKUP_RECORD_ADDRESS) return FERR_ADDRESS_MIN;
+	if ((address > SESSION_JOURNAL_ADDRESS) || (length > (SESSION_JOURNAL_ADDRESS - address))) return FERR_ADDRESS_MAX;
 
-	// sectors to earse
-	uint32_t sectors = 0;
+	return _flash_erase(address, length);
+}
+
+// Erase the write session journal sector
+//-------------------------------
+status_t flash_erase_journal(void)
+{
+	return _flash_erase(SESSION_JOURNAL_ADDRESS, SECTOR_SIZE);
+}
 
-	// Check if the parameters are valid
+// The background erase operation in progress has finished, check the result
+//-----------------------------------
+static void _bg_erase_done(void)
+{
+	uint32_t address = bg_erase.addr;
+	uint32_t size = bg_erase.size;
+
+	bg_erase.size = 0;
+	bg_erase.suspended = false;
+	bg_erase.addr += size;
+	if (_sectors_to_erase(address, size) > 0) {
+		// failed, erase in foreground, the rest of the queue is dropped on error
+		if (flash_erase(address, size) != FERR_OK) bg_erase.end = bg_erase.addr;
+	}
+}
+
+// Wait for the background erase operation in progress to finish, resume it if suspended
+// The result is checked by the caller or by the next flash_erase_poll()
+//-----------------------------------
+static void _bg_erase_complete(void)
+{
+	uint32_t primask = DisableGlobalIRQ();
+	if (bg_erase.size != 0) {
+		if (bg_erase.suspended) flexspi_nor_erase_resume(BOOTLOADER_FLEXSPI);
+		flexspi_nor_wait_bus_busy(BOOTLOADER_FLEXSPI);
+		FLEXSPI_SoftwareReset(BOOTLOADER_FLEXSPI);
+		bg_erase.suspended = false;
+	}
+	EnableGlobalIRQ(primask);
+}
+
+// Finish the background erase operation in progress and erase the queued range below 'address'
+// Called before programming, so the programmed sectors are never erased by the background erase
+//------------------------------------------
+static void _bg_erase_sync(uint32_t address)
+{
+	uint32_t start, end;
+
+	if (bg_erase.size != 0) {
+		_bg_erase_complete();
+		_bg_erase_done();
+	}
+	if ((bg_erase.addr < address) && (bg_erase.addr < bg_erase.end)) {
+		// the data came before the background erase, erase in foreground up to the data's sector end
+		start = bg_erase.addr;
+		end = address + SECTOR_SIZE - 1;
+		end -= end % SECTOR_SIZE;
+		if (end > bg_erase.end) end = bg_erase.end;
+		bg_erase.addr = end;
+		if (flash_erase(start, end - start) != FERR_OK) bg_erase.end = bg_erase.addr;
+	}
+}
+
+// Queue the range for background erase, 'length' is rounded up to the sector size
+// The range is erased by flash_erase_poll() or before its sectors are programmed
+//---------------------------------------------------------
+status_t flash_erase_queue(uint32_t address, uint32_t length)
+{
 	if (0 != (address % (uint32_t)SECTOR_SIZE)) return FERR_ADDRESS_ALIGN;
 	if (address < BOOT_BACKUP_RECORD_ADDRESS) return FERR_ADDRESS_MIN;
-	if ((address+length - BOOTLOADER_FLEXSPI_AMBA_BASE) > FLASH_MAX_LENGTH) return FERR_ADDRESS_MAX;
+	if ((address > SESSION_JOURNAL_ADDRESS) || (length > (SESSION_JOURNAL_ADDRESS - address))) return FERR_ADDRESS_MAX;
+
+	_bg_erase_sync(0);
+	bg_erase.addr = address;
+	bg_erase.end = address + length;
+	if  (0 != (length % (uint32_t)SECTOR_SIZE)) bg_erase.end += SECTOR_SIZE - (length % (uint32_t)SECTOR_SIZE);
+	return FERR_OK;
+}
+
+// Check if the background erase operation in progress overlaps 'length' bytes at 'address'
+// Does not wait, the USB interrupt uses it to defer the flash read to the main loop
+//-----------------------------------------------------------
+bool flash_erase_overlaps(uint32_t address, uint32_t length)
+{
+	uint32_t start = bg_erase.addr;
+	uint32_t size = bg_erase.size;
+	return ((size != 0) && (((address - start) < size) || ((start - address) < length)));
+}
 
-	// calulate the number of sectors to erase
-	sectors = length / (uint32_t)SECTOR_SIZE;
-	if  (0 != (length % (uint32_t)SECTOR_SIZE)) sectors += 1;
+// Finish the background erase operation in progress if it overlaps 'length' bytes at 'address'
+// The sectors of a suspended erase read undefined data, called before reading the flash;
+// the queued sectors not started yet still hold the old data.
+// It can wait for the whole erase operation, not called from the USB interrupt.
+//---------------------------------------------------------
+void flash_erase_finish(uint32_t address, uint32_t length)
+{
+	uint32_t primask = DisableGlobalIRQ();
+	if (flash_erase_overlaps(address, length)) _bg_erase_complete();
+	EnableGlobalIRQ(primask);
+}
 
-	for (uint32_t i = 0; i < sectors; i++) {
-		if (_sector_erased(address) < SECTOR_SIZE) {
-			status = flexspi_nor_flash_erase_sector(BOOTLOADER_FLEXSPI, address-BOOTLOADER_FLEXSPI_AMBA_BASE);
-			if (kStatus_Success != status) return FERR_ERASE;
-			if (_sector_erased(address) < SECTOR_SIZE) return FERR_ERASE;
-			address += SECTOR_SIZE;
+// Check if the background erase has something left to do
+//-----------------------------
+bool flash_erase_pending(void)
+{
+	return ((bg_erase.size != 0) || (bg_erase.addr < bg_erase.end));
+}
+
+// Run the background erase for max FLASH_BG_ERASE_SLICE_MAX us
+// The interrupts are disabled while the flash is busy. The erase is suspended before
+// returning, or after FLASH_BG_ERASE_SLICE_MIN us if an interrupt is pending, so the
+// interrupts (USB receive) are serviced and the caller runs from flash between the polls.
+//---------------------------
+void flash_erase_poll(void)
+{
+	uint32_t size = 0, start, elapsed, primask;
+	uint32_t slice_min = FLASH_BG_ERASE_SLICE_MIN * (SystemCoreClock / 1000000);
+	uint32_t slice_max = FLASH_BG_ERASE_SLICE_MAX * (SystemCoreClock / 1000000);
+	bool busy = false;
+
+	if (bg_erase.size == 0) {
+		// plan the next operation, the already erased parts are skipped
+		while ((bg_erase.addr < bg_erase.end) && (_erase_plan(bg_erase.addr, bg_erase.end, &size) == 0)) {
+			bg_erase.addr += size;
 		}
+		if (bg_erase.addr >= bg_erase.end) return;
 	}
 
-	return FERR_OK;
+	primask = DisableGlobalIRQ();
+	if (bg_erase.size == 0) {
+		if (flexspi_nor_flash_erase_start(BOOTLOADER_FLEXSPI, bg_erase.addr-BOOTLOADER_FLEXSPI_AMBA_BASE, size) != kStatus_Success) {
+			// the sectors are erased in foreground before programming, which reports the error
+			bg_erase.end = bg_erase.addr;
+			FLEXSPI_SoftwareReset(BOOTLOADER_FLEXSPI);
+			EnableGlobalIRQ(primask);
+			return;
+		}
+		bg_erase.size = size;
+		flash_stats.erases++;
+	}
+	else if (bg_erase.suspended) {
+		flexspi_nor_erase_resume(BOOTLOADER_FLEXSPI);
+		bg_erase.suspended = false;
+	}
+
+	start = DWT->CYCCNT;
+	while (1) {
+		if (flexspi_nor_read_busy(BOOTLOADER_FLEXSPI, &busy) != kStatus_Success) {
+			flexspi_nor_wait_bus_busy(BOOTLOADER_FLEXSPI);
+			busy = false;
+		}
+		if (!busy) break;
+		elapsed = DWT->CYCCNT - start;
+		if ((elapsed > slice_max) || ((elapsed > slice_min) && (SCB->ICSR & SCB_ICSR_ISRPENDING_Msk))) {
+			// an erase which has just finished ignores the suspend, it is detected on resume
+			flexspi_nor_erase_suspend(BOOTLOADER_FLEXSPI);
+			bg_erase.suspended = true;
+			break;
+		}
+	}
+	if (!busy) FLEXSPI_SoftwareReset(BOOTLOADER_FLEXSPI);
+	EnableGlobalIRQ(primask);
+
+	if (!busy) _bg_erase_done();
 }
 
 // Program flash page (256 bytes) at 'address' from buffer 'data'
@@ -98,6 +408,8 @@ status_t flash_program_page(uint32_t address, void * data)
 {
 	status_t status;
 
+	_bg_erase_sync(address + FLASH_PAGE_SIZE);
+
 	if (_check_flash_data(address, (uint8_t *)data, FLASH_PAGE_SIZE) < FLASH_PAGE_SIZE) {
 		status = flexspi_nor_flash_page_program(BOOTLOADER_FLEXSPI, address-BOOTLOADER_FLEXSPI_AMBA_BASE, (void *)data);
 		if (kStatus_Success != status) return FERR_PROGRAM_PAGE;
@@ -116,23 +428,43 @@ status_t flash_program_buffer(uint32_t address, uint8_t *data, uint32_t length)
 	if ((sect_addr+length) > SECTOR_SIZE) return FERR_LENGTH;
 	if ((address % (uint32_t)FLASH_PAGE_SIZE)) return FERR_ADDRESS_ALIGN;
 
+	// the background erase must be ahead of the data
+	_bg_erase_sync(address + length);
+
 	// check if the same data is already programmed
-	if (_check_flash_data(address, data, length) == length) return FERR_OK;
+	if (_check_flash_data(address, data, length) == length) {
+		flash_stats.writes_skipped++;
+		return FERR_OK;
+	}
 
 	if (sect_addr == 0) {
 		// program at beginning of the sector, erase first
-		status = flash_erase(address, SECTOR_SIZE);
-		if (kStatus_Success != status) return FERR_ERASE;
+		// no erase is needed if the data only clears bits and the rest of the sector is erased
+		// the whole sector is compared, it is read from flash, not from the cache
+		if (FLASH_PROGRAM_NO_ERASE) DCACHE_CleanInvalidateByRange(address, SECTOR_SIZE);
+		if ((FLASH_PROGRAM_NO_ERASE) && (flash_subset_len((const void *)address, data, length) == length) &&
+				(flash_blank_len((const void *)(address+length), SECTOR_SIZE-length) == (SECTOR_SIZE-length))) {
+			// an erased sector would not be erased anyway
+			if (_sector_erased(address) < SECTOR_SIZE) flash_stats.erases_skipped++;
+		}
+		else {
+			status = flash_erase(address, SECTOR_SIZE);
+			if (kStatus_Success != status) return FERR_ERASE;
+		}
 	}
 
-	// Program page by page
+	// Program page by page, the pages already equal to the data are skipped
 	while (length > 0) {
 		uint32_t prog_len = (length > FLASH_PAGE_SIZE) ? FLASH_PAGE_SIZE : length;
-		status = flexspi_nor_flash_buffer_program(BOOTLOADER_FLEXSPI, address-BOOTLOADER_FLEXSPI_AMBA_BASE, (const uint32_t *)data, prog_len);
-		if (kStatus_Success != status)	return FERR_PROGRAM_BUFFER;
+		if (_check_flash_data(address, data, prog_len) < prog_len) {
+			status = flexspi_nor_flash_buffer_program(BOOTLOADER_FLEXSPI, address-BOOTLOADER_FLEXSPI_AMBA_BASE, (const uint32_t *)data, prog_len);
+			if (kStatus_Success != status)	return FERR_PROGRAM_BUFFER;
+			flash_stats.pages++;
+		}
 		length -= prog_len;
 		address += FLASH_PAGE_SIZE;
 		data += FLASH_PAGE_SIZE;
+		if (flash_yield) flash_yield();
 	}
 
 	return FERR_OK;
@@ -44,10 +44,45 @@
 #define FERR_PROGRAM_BUFFER	94
 #define FERR_LENGTH					93
 
+// Block erase is replaced by sector erases if no more sectors in the block need erasing
+#define FLASH_ERASE_SECTORS_MAX		2
+
+// Program the sector without erase if the new data only clears bits of the flash content
+// Set to 0 for flash devices which do not allow programming a page twice (internal ECC)
+#define FLASH_PROGRAM_NO_ERASE		1
+
+// Background erase time slice (us), the erase is suspended after the max time,
+// or after the min time if an interrupt is pending
+#define FLASH_BG_ERASE_SLICE_MIN	500
+#define FLASH_BG_ERASE_SLICE_MAX	2000
+
+// Flash operations counters
+//---------------------------
+typedef struct _flash_stats_t_ {
+	uint32_t erases;					// sector and block erase operations
+	uint32_t erases_skipped;	// sector erases skipped, the data was programmed without erase
+	uint32_t pages;						// pages programmed
+	uint32_t writes_skipped;	// buffer writes skipped, the data was already in flash
+}	flash_stats_t;
+
+extern flash_stats_t flash_stats;
+
+typedef void (*flash_yield_t)(void);
+
+void flash_set_yield(flash_yield_t yield);
 status_t flash_erase(uint32_t address, uint32_t length);
+status_t flash_erase_journal(void);
+status_t flash_erase_queue(uint32_t address, uint32_t length);
+bool flash_erase_overlaps(uint32_t address, uint32_t length);
+void flash_erase_finish(uint32_t address, uint32_t length);
+bool flash_erase_pending(void);
+void flash_erase_poll(void);
 status_t flash_program_page(uint32_t address, void * data);
 status_t flash_program_buffer(uint32_t address, uint8_t *data, uint32_t length);
 void flash_read(uint32_t address, void * data,const uint32_t length);
+uint32_t flash_blank_len(const void *data, uint32_t length);
+uint32_t flash_cmp_len(const void *data1, const void *data2, uint32_t length);
+uint32_t flash_subset_len(const void *flash, const void *data, uint32_t length);
 int _sector_erased(uint32_t address);
 int _check_flash_data(uint32_t address, uint8_t * data, uint32_t length);
 
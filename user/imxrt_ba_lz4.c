@@ -0,0 +1,93 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Part of the iMX RT MicroPython port
+ * iMX RT CDC ACM Bootloader with OTA support
+ *
+ * Code inspired by CDC Arduino bootloader for SeeedStudio's ArchMix board
+ * https://github.com/Seeed-Studio/ArduinoCore-imxrt/tree/master/bootloaders
+ * 
+ * Author: LoBo (loboris@gmail.com)
+ * 
+ * Copyright (C) 2021  LoBo
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <stdbool.h>
+#include "imxrt_ba_lz4.h"
+
+// Read the LZ4 length extension bytes and add them to 'len'
+// Returns false if the input ends before the last extension byte
+//--------------------------------------------------------------------------------
+static inline bool lz4_ext_length(const uint8_t **ip, const uint8_t *iend, uint32_t *len)
+{
+	uint32_t b;
+	do {
+		if (*ip >= iend) return false;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return true;
+}
+
+// Decode one LZ4 block (raw block format, no frame header)
+// The block must be self-contained, matches may only refer to the data decoded
+// from the same block, so the window is bounded by 'dst_size' and no heap is used.
+// Returns the decoded length or LZ4_ERR_xxx if the block is malformed
+//-------------------------------------------------------------------------------------
+int lz4_decode_block(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_size)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = src + src_len;
+	const uint8_t *match;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + dst_size;
+	uint32_t token, len, offset;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		// literals
+		len = token >> 4;
+		if ((len == 15) && (!lz4_ext_length(&ip, iend, &len))) return LZ4_ERR_INPUT;
+		if (len > (uint32_t)(iend - ip)) return LZ4_ERR_INPUT;
+		if (len > (uint32_t)(oend - op)) return LZ4_ERR_OUTPUT;
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+		// the last sequence has literals only
+		if (ip >= iend) break;
+
+		// match
+		if ((iend - ip) < 2) return LZ4_ERR_INPUT;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if ((offset == 0) || (offset > (uint32_t)(op - dst))) return LZ4_ERR_OFFSET;
+		len = token & 0x0F;
+		if ((len == 15) && (!lz4_ext_length(&ip, iend, &len))) return LZ4_ERR_INPUT;
+		len += 4;
+		if (len > (uint32_t)(oend - op)) return LZ4_ERR_OUTPUT;
+		// byte copy, the match may overlap the output
+		match = op - offset;
+		while (len--) *op++ = *match++;
+	}
+	return (int)(op - dst);
+}
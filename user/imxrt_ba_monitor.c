@@ -35,6 +35,9 @@
 #include "imxrt_ba_monitor.h"
 #include "imxrt_ba_cdc.h"
 #include "imxrt_ba_flash.h"
+#include "imxrt_ba_lz4.h"
+#include "imxrt_ba_uf2.h"
+#include "imxrt_ba_dfu.h"
 #include "board_drive_led.h"
 #include "app.h"
 #include <stdlib.h>
@@ -42,9 +45,56 @@
 const char RomBOOT_InfoString[] = "[MicroPython Bootloader v.1.2]";
 
 AT_NONCACHEABLE_SECTION(volatile static command_t cmd);
+AT_NONCACHEABLE_SECTION(volatile static command_t cmd_alt);	// 2nd frame buffer
 static unsigned char *termcmd = (unsigned char *)&cmd.cmd;
 static bool termMode = false;
 
+// Windowed write session state
+typedef struct _write_session_t_ {
+	uint32_t start;				// session start address
+	uint32_t end;					// session end address
+	uint32_t window;			// accepted number of blocks in flight
+	uint32_t base;				// lowest sequence number not yet committed
+	uint32_t committed;		// committed blocks bitmap, bit 0 is 'base'
+}	write_session_t;
+
+static write_session_t session;
+
+// Block frame receiver state
+typedef struct _frame_rx_t_ {
+	volatile command_t *frame;	// frame buffer
+	uint32_t count;							// number of received bytes
+	uint32_t size;							// expected frame size, header + data
+	bool header;								// header checked
+	uint8_t *spill;							// received bytes following the frame
+	uint32_t spill_len;
+	uint8_t *buf;								// receive buffer, v2 header is placed right before 'cmd_data'
+	uint32_t hdr_size;					// block header size
+	bool v2;										// v2 block frames are received
+}	frame_rx_t;
+
+static frame_rx_t frx;
+AT_NONCACHEABLE_SECTION(volatile static command_hdr_t ack_hdr);
+AT_NONCACHEABLE_SECTION(volatile static block_ack_v2_t ack_v2);
+AT_NONCACHEABLE_SECTION_ALIGN(static uint8_t lz4_buf[DATA_BLOCK_SIZE], 4);	// decompressed block
+
+// Delta update state
+typedef struct _patch_t_ {
+	uint32_t src;					// base image address
+	uint32_t src_size;		// base image size
+	uint32_t opos;				// current offset in the base image
+	uint32_t dst;					// target address of the output block
+	uint32_t dst_end;			// target image end address
+	uint32_t state;				// PATCH_CTRL, PATCH_DIFF or PATCH_EXTRA
+	uint32_t count;				// bytes left in the current state
+	uint32_t ctrl[3];			// control record: diff length, extra length, base offset adjustment
+	uint32_t ctrl_len;		// received control record bytes
+	uint8_t *out;					// output block buffer
+	uint32_t out_len;			// bytes in the output block
+}	patch_t;
+
+static patch_t patch;
+
 /*
 // CRC16 implementation, not used
 static const uint16_t crc16Table[256]=
@@ -96,57 +146,6 @@ uint16_t crc16(const void* data, size_t length, uint16_t previousCrc16)
 }
 */
 
-static const uint32_t crc32Table[256] =
-{
-    // note: the first number of every second row corresponds to the half-byte look-up table !
-    0x00000000,0x77073096,0xEE0E612C,0x990951BA,0x076DC419,0x706AF48F,0xE963A535,0x9E6495A3,
-    0x0EDB8832,0x79DCB8A4,0xE0D5E91E,0x97D2D988,0x09B64C2B,0x7EB17CBD,0xE7B82D07,0x90BF1D91,
-    0x1DB71064,0x6AB020F2,0xF3B97148,0x84BE41DE,0x1ADAD47D,0x6DDDE4EB,0xF4D4B551,0x83D385C7,
-    0x136C9856,0x646BA8C0,0xFD62F97A,0x8A65C9EC,0x14015C4F,0x63066CD9,0xFA0F3D63,0x8D080DF5,
-    0x3B6E20C8,0x4C69105E,0xD56041E4,0xA2677172,0x3C03E4D1,0x4B04D447,0xD20D85FD,0xA50AB56B,
-    0x35B5A8FA,0x42B2986C,0xDBBBC9D6,0xACBCF940,0x32D86CE3,0x45DF5C75,0xDCD60DCF,0xABD13D59,
-    0x26D930AC,0x51DE003A,0xC8D75180,0xBFD06116,0x21B4F4B5,0x56B3C423,0xCFBA9599,0xB8BDA50F,
-    0x2802B89E,0x5F058808,0xC60CD9B2,0xB10BE924,0x2F6F7C87,0x58684C11,0xC1611DAB,0xB6662D3D,
-    0x76DC4190,0x01DB7106,0x98D220BC,0xEFD5102A,0x71B18589,0x06B6B51F,0x9FBFE4A5,0xE8B8D433,
-    0x7807C9A2,0x0F00F934,0x9609A88E,0xE10E9818,0x7F6A0DBB,0x086D3D2D,0x91646C97,0xE6635C01,
-    0x6B6B51F4,0x1C6C6162,0x856530D8,0xF262004E,0x6C0695ED,0x1B01A57B,0x8208F4C1,0xF50FC457,
-    0x65B0D9C6,0x12B7E950,0x8BBEB8EA,0xFCB9887C,0x62DD1DDF,0x15DA2D49,0x8CD37CF3,0xFBD44C65,
-    0x4DB26158,0x3AB551CE,0xA3BC0074,0xD4BB30E2,0x4ADFA541,0x3DD895D7,0xA4D1C46D,0xD3D6F4FB,
-    0x4369E96A,0x346ED9FC,0xAD678846,0xDA60B8D0,0x44042D73,0x33031DE5,0xAA0A4C5F,0xDD0D7CC9,
-    0x5005713C,0x270241AA,0xBE0B1010,0xC90C2086,0x5768B525,0x206F85B3,0xB966D409,0xCE61E49F,
-    0x5EDEF90E,0x29D9C998,0xB0D09822,0xC7D7A8B4,0x59B33D17,0x2EB40D81,0xB7BD5C3B,0xC0BA6CAD,
-    0xEDB88320,0x9ABFB3B6,0x03B6E20C,0x74B1D29A,0xEAD54739,0x9DD277AF,0x04DB2615,0x73DC1683,
-    0xE3630B12,0x94643B84,0x0D6D6A3E,0x7A6A5AA8,0xE40ECF0B,0x9309FF9D,0x0A00AE27,0x7D079EB1,
-    0xF00F9344,0x8708A3D2,0x1E01F268,0x6906C2FE,0xF762575D,0x806567CB,0x196C3671,0x6E6B06E7,
-    0xFED41B76,0x89D32BE0,0x10DA7A5A,0x67DD4ACC,0xF9B9DF6F,0x8EBEEFF9,0x17B7BE43,0x60B08ED5,
-    0xD6D6A3E8,0xA1D1937E,0x38D8C2C4,0x4FDFF252,0xD1BB67F1,0xA6BC5767,0x3FB506DD,0x48B2364B,
-    0xD80D2BDA,0xAF0A1B4C,0x36034AF6,0x41047A60,0xDF60EFC3,0xA867DF55,0x316E8EEF,0x4669BE79,
-    0xCB61B38C,0xBC66831A,0x256FD2A0,0x5268E236,0xCC0C7795,0xBB0B4703,0x220216B9,0x5505262F,
-    0xC5BA3BBE,0xB2BD0B28,0x2BB45A92,0x5CB36A04,0xC2D7FFA7,0xB5D0CF31,0x2CD99E8B,0x5BDEAE1D,
-    0x9B64C2B0,0xEC63F226,0x756AA39C,0x026D930A,0x9C0906A9,0xEB0E363F,0x72076785,0x05005713,
-    0x95BF4A82,0xE2B87A14,0x7BB12BAE,0x0CB61B38,0x92D28E9B,0xE5D5BE0D,0x7CDCEFB7,0x0BDBDF21,
-    0x86D3D2D4,0xF1D4E242,0x68DDB3F8,0x1FDA836E,0x81BE16CD,0xF6B9265B,0x6FB077E1,0x18B74777,
-    0x88085AE6,0xFF0F6A70,0x66063BCA,0x11010B5C,0x8F659EFF,0xF862AE69,0x616BFFD3,0x166CCF45,
-    0xA00AE278,0xD70DD2EE,0x4E048354,0x3903B3C2,0xA7672661,0xD06016F7,0x4969474D,0x3E6E77DB,
-    0xAED16A4A,0xD9D65ADC,0x40DF0B66,0x37D83BF0,0xA9BCAE53,0xDEBB9EC5,0x47B2CF7F,0x30B5FFE9,
-    0xBDBDF21C,0xCABAC28A,0x53B39330,0x24B4A3A6,0xBAD03605,0xCDD70693,0x54DE5729,0x23D967BF,
-    0xB3667A2E,0xC4614AB8,0x5D681B02,0x2A6F2B94,0xB40BBE37,0xC30C8EA1,0x5A05DF1B,0x2D02EF8D,
-};
-
-// Compute the CRC32 over given buffer
-//---------------------------------------------------------------------
-uint32_t crc32(const void* data, size_t length, uint32_t previousCrc32)
-{
-  uint32_t crc = ~previousCrc32; // same as previousCrc32 ^ 0xFFFFFFFF
-  const uint8_t* current = (const uint8_t*) data;
-
-  while (length-- != 0) {
-    crc = (crc >> 8) ^ crc32Table[(crc & 0xFF) ^ *current++];
-  }
-
-  return ~crc; // same as crc ^ 0xFFFFFFFF
-}
-
 //----------------------
 static bool wait_ready()
 {
@@ -157,6 +156,11 @@ static bool wait_ready()
 	DWT->CYCCNT = 0;
 	while (DWT->CYCCNT < tmo) {
 		if (cdc_is_rx_ready()) break;
+		// the block written to the UF2 volume or received by DFU is flashed first
+		if ((uf2_busy()) || (dfu_busy())) {
+			LED_off();
+			return false;
+		}
 		if (DWT->CYCCNT < ledtmo) LED_on();
 		else LED_off();
 	}
@@ -165,22 +169,797 @@ static bool wait_ready()
 	return cdc_is_rx_ready();
 }
 
+// Wait up to 'timeout' ms for the start of the next command
+// Returns false on timeout or when a block written to the UF2 volume or received by DFU waits to be flashed
+//-----------------------------------
+static bool cmd_wait(uint32_t timeout)
+{
+	if (!cdc_is_rx_ready()) return false;
+	// the terminal output must be sent before waiting for input
+	cdc_flush();
+
+	uint32_t tmo = timeout * CPUFreq;
+	DWT->CYCCNT = 0;
+	while (cdc_rx_count() == 0) {
+		if ((DWT->CYCCNT > tmo) || (uf2_busy()) || (dfu_busy())) return false;
+	}
+	return true;
+}
+
+// Prepare the response header in 'frame'
+//------------------------------------------------------------------------------
+static void set_response(volatile command_t *frame, uint32_t stat, uint32_t dlen)
+{
+	frame->cmd = stat;
+	if (dlen) {
+		frame->data_crc = crc32((const void *)frame->cmd_data, dlen, 0);
+		frame->data_len = dlen;
+	}
+	else {
+		frame->data_len = 0;
+	}
+	frame->crc = crc32((const void *)frame, CMD_SIZE_BASE, 0);
+}
+
+// Check if 'length' bytes at 'address' are inside the flash from 'start' to 'end'
+// The writes end at SESSION_JOURNAL_ADDRESS, the reads at FLASH_END_ADDRESS
+// The range end is not calculated, the address plus a large length could wrap around
+//-----------------------------------------------------------------------------
+static bool flash_range_valid(uint32_t address, uint32_t length, uint32_t start, uint32_t end)
+{
+	return ((address >= start) && (address <= end) && (length <= (end - address)));
+}
+
 // Prepare and send response to binary command
 //----------------------------------------------------
 static void cmd_response(uint32_t stat, uint32_t dlen)
 {
-	cmd.cmd = stat;
-	if (dlen) {
-		cmd.data_crc = crc32((const void *)cmd.cmd_data, dlen, 0);
-		cmd.data_len = dlen;
+	set_response(&cmd, stat, dlen);
+	// send response, the data follows the header in 'cmd', both are sent as one transfer
+	// short response is copied into the transmit queue, otherwise waits for the transfer
+	cdc_write_buf((const void *)&cmd, CMD_SIZE + dlen);
+}
+
+// Write session journal state, the bitmap is the copy of the journal's second page
+typedef struct _journal_t_ {
+	journal_hdr_t hdr;
+	uint32_t sectors;				// number of sectors in the range
+	uint32_t committed;			// number of committed sectors
+	uint32_t dirty;					// sectors committed and not yet programmed to the journal
+	bool active;						// the written sectors are committed to the journal
+	uint8_t bitmap[FLASH_PAGE_SIZE];
+}	journal_t;
+
+static journal_t journal;
+
+// Program the committed sectors bitmap to the journal sector
+//-------------------------
+static void journal_flush()
+{
+	if ((journal.active) && (journal.dirty > 0)) {
+		if (flash_program_page(SESSION_JOURNAL_ADDRESS + FLASH_PAGE_SIZE, journal.bitmap) != FERR_OK) journal.active = false;
+		journal.dirty = 0;
 	}
-	else {
-		cmd.data_len = 0;
+}
+
+// Read the journal from flash, returns true if it is valid
+//-------------------------
+static bool journal_load()
+{
+	journal_flush();
+	journal.active = false;
+	flash_read(SESSION_JOURNAL_ADDRESS, (void *)&journal.hdr, sizeof(journal_hdr_t));
+	if (memcmp(journal.hdr.ID, SESSION_JOURNAL_ID, sizeof(journal.hdr.ID)) != 0) return false;
+	if (journal.hdr.crc != crc32((const void *)&journal.hdr, sizeof(journal_hdr_t)-sizeof(uint32_t), 0)) return false;
+	journal.sectors = (journal.hdr.length + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	if ((journal.sectors == 0) || (journal.sectors > JOURNAL_MAX_SECTORS)) return false;
+
+	flash_read(SESSION_JOURNAL_ADDRESS + FLASH_PAGE_SIZE, (void *)journal.bitmap, FLASH_PAGE_SIZE);
+	journal.committed = 0;
+	for (uint32_t i=0; i<journal.sectors; i++) {
+		if ((journal.bitmap[i >> 3] & (1 << (i & 7))) == 0) journal.committed++;
+	}
+	journal.dirty = 0;
+	return true;
+}
+
+// Write the new journal of the range with no sectors committed
+// Returns false if the journal could not be written
+//--------------------------------------------------------------------------------
+static bool journal_create(uint32_t address, uint32_t length, const uint8_t *sha256)
+{
+	uint8_t page_buf[FLASH_PAGE_SIZE];
+
+	memset((void *)&journal, 0, sizeof(journal_t));
+	memcpy(journal.hdr.ID, SESSION_JOURNAL_ID, sizeof(journal.hdr.ID));
+	journal.hdr.address = address;
+	journal.hdr.length = length;
+	memcpy(journal.hdr.sha256, sha256, SHA_HASH_SIZE);
+	journal.hdr.crc = crc32((const void *)&journal.hdr, sizeof(journal_hdr_t)-sizeof(uint32_t), 0);
+	journal.sectors = (length + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	memset(journal.bitmap, 0xFF, FLASH_PAGE_SIZE);
+
+	if (flash_erase_journal() != FERR_OK) return false;
+	memset(page_buf, 0xFF, FLASH_PAGE_SIZE);
+	memcpy(page_buf, (void *)&journal.hdr, sizeof(journal_hdr_t));
+	if (flash_program_page(SESSION_JOURNAL_ADDRESS, page_buf) != FERR_OK) return false;
+	journal.active = true;
+	return true;
+}
+
+// Start the journal of the range, the existing journal of the same range and image is continued
+//-------------------------------------------------------------------------------
+static bool journal_begin(uint32_t address, uint32_t length, const uint8_t *sha256)
+{
+	if ((journal_load()) && (journal.hdr.address == address) && (journal.hdr.length == length) &&
+			(memcmp(journal.hdr.sha256, sha256, SHA_HASH_SIZE) == 0)) {
+		journal.active = true;
+		return true;
+	}
+	return journal_create(address, length, sha256);
+}
+
+// The range is going to be erased, the active journal covering it starts again
+//---------------------------------------------------------
+static void journal_restart(uint32_t address, uint32_t length)
+{
+	if ((!journal.active) || (journal.committed == 0)) return;
+	if ((address < (journal.hdr.address + journal.hdr.length)) && ((address + length) > journal.hdr.address)) {
+		journal_hdr_t hdr = journal.hdr;
+		journal_create(hdr.address, hdr.length, hdr.sha256);
 	}
-	cmd.crc = crc32((const void *)&cmd, CMD_SIZE_BASE, 0);
-	// send response
-	cdc_write_buf((const void *)&cmd, CMD_SIZE);
-	if (dlen) cdc_write_buf((const void *)cmd.cmd_data, dlen);
+}
+
+// Erase the journal if it covers the flash range
+//---------------------------------------------------------
+static void journal_clear(uint32_t address, uint32_t length)
+{
+	bool active = journal.active;
+
+	if (!journal_load()) return;
+	if ((address < (journal.hdr.address + journal.hdr.length)) && ((address + length) > journal.hdr.address)) {
+		flash_erase_journal();
+	}
+	else journal.active = active;
+}
+
+// Commit the journal range sectors completely written by the verified block
+//----------------------------------------------------------
+static void journal_commit(uint32_t address, uint32_t length)
+{
+	uint32_t jend = journal.hdr.address + journal.hdr.length;
+	uint32_t sect_end, idx;
+
+	if (!journal.active) return;
+	// first sector starting in the block
+	uint32_t addr = address + ((SECTOR_SIZE - (address % SECTOR_SIZE)) % SECTOR_SIZE);
+	if (addr < journal.hdr.address) addr = journal.hdr.address;
+	for (; addr < jend; addr += SECTOR_SIZE) {
+		// the last sector of the range can be written partially
+		sect_end = ((addr + SECTOR_SIZE) < jend) ? (addr + SECTOR_SIZE) : jend;
+		if (sect_end > (address + length)) break;
+		idx = (addr - journal.hdr.address) / SECTOR_SIZE;
+		if (journal.bitmap[idx >> 3] & (1 << (idx & 7))) {
+			journal.bitmap[idx >> 3] &= ~(1 << (idx & 7));
+			journal.committed++;
+			journal.dirty++;
+		}
+	}
+	if ((journal.dirty >= JOURNAL_FLUSH_SECTORS) || (journal.committed == journal.sectors)) journal_flush();
+}
+
+// Install the application record 'rec' to the boot slot 'idx' after checking the application SHA256
+// Returns the command error code
+//-----------------------------------------------------
+uint32_t app_record_install(const app_rec_t *rec, int idx)
+{
+	// check the application SHA256
+	app_sha256(rec->address, rec->size & 0x00FFFFFF);
+	if (memcmp(rec->sha256, sha256_hash, SHA_HASH_SIZE) != 0) return CMD_ERR_SHA256;
+	if (checkBootRecord(true) < 0) return CMD_ERR_BOOTREC_READ;
+	// backup main boot sector
+	if (!writeBootRecord(false)) return CMD_ERR_BKPBOOTREC_WRITE;
+	// set the new app record in the main boot record
+	memcpy((void *)boot_rec.apps[idx].name, rec, sizeof(app_rec_t));
+	// only one application can be active
+	if (rec->size & APP_FLAG_ACTIVE) boot_rec.apps[idx ^ 1].size &= ~APP_FLAG_ACTIVE;
+	// calculate and set new boot record CRC32
+	boot_rec.crc = crc32((const void *)&boot_rec, sizeof(boot_rec_t)-sizeof(uint32_t), 0);
+	// save new main boot record
+	if (!writeBootRecord(true)) return CMD_ERR_BOOTREC_WRITE;
+	// the application is complete, its write session journal is not needed anymore
+	journal_clear(rec->address, rec->size & 0x00FFFFFF);
+	return CMD_ERR_OK;
+}
+
+// Boot slot for the new application at 'address'
+// The application with the same address is replaced, otherwise the inactive one
+//-------------------------------------
+int app_install_slot(uint32_t address)
+{
+	if (boot_rec.apps[0].address == address) return 0;
+	if (boot_rec.apps[1].address == address) return 1;
+	return (boot_rec.apps[0].size & APP_FLAG_ACTIVE) ? 1 : 0;
+}
+
+// Boot slot of the active application, or the first configured one
+// Returns -1 if no valid application is configured
+//------------------------
+int app_boot_slot(void)
+{
+	int idx = -1;
+
+	for (int i=0; i<2; i++) {
+		uint32_t size = boot_rec.apps[i].size & 0x00FFFFFF;
+		if ((size < MIN_APP_SIZE) || (size > MAX_APP_SIZE)) continue;
+		if (!flash_range_valid(boot_rec.apps[i].address, size, APP_START_ADDRESS, SESSION_JOURNAL_ADDRESS)) continue;
+		if ((idx < 0) || (boot_rec.apps[i].size & APP_FLAG_ACTIVE)) idx = i;
+	}
+	return idx;
+}
+
+// Program 'data_len' bytes from 'data' buffer to flash at 'data_addr' and verify if 'verify' is set
+// Returns the command error code, error details are returned in 'detail'
+//---------------------------------------------------------------------------------------------------------
+static uint32_t program_block(uint32_t data_addr, uint8_t *data, uint32_t data_len, bool verify, uint32_t *detail)
+{
+	status_t status = flash_program_buffer(data_addr, data, data_len);
+	if (kStatus_Success != status) {
+		app_sha256_invalidate(data_addr, data_len);
+		if (status == FERR_ERASE) {
+			// sector not erased
+			*detail = _sector_erased(data_addr);
+			return CMD_ERR_FLASHERASE;
+		}
+		*detail = (uint32_t)status;
+		return CMD_ERR_FLASH_WRITE;
+	}
+	if (!verify) {
+		// not checked data can not be used for the running SHA-256 and the journal
+		app_sha256_invalidate(data_addr, data_len);
+		return CMD_ERR_OK;
+	}
+	// flash write ok, check programmed data
+	uint32_t chkidx = _check_flash_data(data_addr, data, data_len);
+	if (chkidx != data_len) {
+		app_sha256_invalidate(data_addr, data_len);
+		*detail = chkidx;
+		return CMD_ERR_FLASHDATACRC;
+	}
+	// the verified data is added to the running SHA-256 and committed to the journal
+	app_sha256_update(data_addr, data, data_len);
+	journal_commit(data_addr, data_len);
+	return CMD_ERR_OK;
+}
+
+// Acknowledge the block in windowed write session
+// 'param' carries the block's sequence number and the lowest not committed one.
+// Separate header buffer is used, both command buffers may hold received blocks.
+// The header is copied into the transmit queue, the ack does not wait for the host.
+//--------------------------------------------------------------------
+static void session_ack(uint32_t stat, uint32_t seq, uint32_t detail)
+{
+	if (frx.v2) {
+		// compact acknowledge, NAK holds the reason
+		ack_v2.seq = seq;
+		ack_v2.base = session.base;
+		ack_v2.detail = detail;
+		ack_v2.status = stat;
+		ack_v2.crc = crc32((const void *)&ack_v2, sizeof(block_ack_v2_t)-sizeof(uint16_t), 0);
+		cdc_write_start((const void *)&ack_v2, sizeof(block_ack_v2_t), CDC_WRITE_TIMEOUT);
+		return;
+	}
+	ack_hdr.cmd = stat;
+	ack_hdr.param = (seq & 0xFFFF) | (session.base << 16);
+	ack_hdr.data_len = 0;
+	ack_hdr.data_crc = detail;
+	ack_hdr.crc = crc32((const void *)&ack_hdr, CMD_SIZE_BASE, 0);
+	cdc_write_start((const void *)&ack_hdr, CMD_SIZE, CDC_WRITE_TIMEOUT);
+}
+
+// Start receiving the block frame (header + data) into 'frame' buffer
+//----------------------------------------------------
+static void frame_rx_start(volatile command_t *frame)
+{
+	// the data is always received into 'cmd_data', the shorter v2 header is placed before it
+	frx.hdr_size = (frx.v2) ? sizeof(block_hdr_v2_t) : CMD_SIZE;
+	frx.buf = (uint8_t *)frame + CMD_SIZE - frx.hdr_size;
+	// the bytes received after the previous frame belong to this one
+	if (frx.spill_len > 0) memmove(frx.buf, frx.spill, frx.spill_len);
+	frx.frame = frame;
+	frx.count = frx.spill_len;
+	frx.size = frx.hdr_size;
+	frx.header = false;
+	frx.spill_len = 0;
+}
+
+// Stop the frame receiving, the pending transfer and the bytes following the frame are discarded
+//----------------------------
+static void frame_rx_stop(void)
+{
+	cdc_read_stop();
+	frx.spill_len = 0;
+}
+
+// Receive the CDC input into the frame buffer, does not wait
+// The frame is received directly by USB DMA: the first packet holds the header,
+// a single transfer sized for the rest of the block receives the data.
+// Returns true when the whole frame is received
+//----------------------------
+static bool frame_rx_poll(void)
+{
+	uint32_t n;
+
+	while (1) {
+		if ((!frx.header) && (frx.count >= frx.hdr_size)) {
+			// header received, expect the data only if the header is valid
+			frx.header = true;
+			if (frx.v2) {
+				block_hdr_v2_t *hdr = (block_hdr_v2_t *)frx.buf;
+				if ((hdr->crc == (uint16_t)crc32((const void *)hdr, sizeof(block_hdr_v2_t)-sizeof(uint16_t), 0)) && ((hdr->len & WRITE_V2_LEN_MASK) <= DATA_BLOCK_SIZE)) {
+					frx.size += hdr->len & WRITE_V2_LEN_MASK;
+				}
+			}
+			else if ((frx.frame->crc == crc32((const void *)frx.frame, CMD_SIZE_BASE, 0)) && ((frx.frame->data_len & ~WRITE_BLOCK_FLAGS) <= DATA_BLOCK_SIZE)) {
+				frx.size += frx.frame->data_len & ~WRITE_BLOCK_FLAGS;
+			}
+		}
+		if (frx.count >= frx.size) break;
+		n = cdc_read_direct(frx.buf + frx.count, frx.size - frx.count);
+		if (n == 0) break;
+		frx.count += n;
+	}
+	if (frx.count > frx.size) {
+		// the host has sent the next frame in the same transfer
+		frx.spill = frx.buf + frx.size;
+		frx.spill_len = frx.count - frx.size;
+		frx.count = frx.size;
+	}
+	return (frx.count >= frx.size);
+}
+
+// Called by the flash driver between page program operations
+//---------------------------------
+static void session_flash_yield(void)
+{
+	frame_rx_poll();
+}
+
+// Wait for the frame to be received
+// Returns the number of received bytes, waits max 'timeout' ms for new data
+//-----------------------------------------------
+static uint32_t frame_rx_wait(uint32_t timeout)
+{
+	uint32_t tmo = timeout * CPUFreq;
+	uint32_t count = frx.count;
+	DWT->CYCCNT = 0;
+	while (!frame_rx_poll()) {
+		if (frx.count != count) {
+			count = frx.count;
+			DWT->CYCCNT = 0;
+		}
+		if (DWT->CYCCNT > tmo) break;
+		// erase ahead of the incoming data
+		flash_erase_poll();
+	}
+	return frx.count;
+}
+
+// Receive the command's payload of 'length' bytes directly into 'cmd.cmd_data'
+// Returns the number of received bytes, waits max 'timeout' ms for new data
+//-----------------------------------------------------------
+static uint32_t payload_rx(uint32_t length, uint32_t timeout)
+{
+	frame_rx_start(&cmd);
+	frx.count = CMD_SIZE;
+	frx.size = CMD_SIZE + length;
+	frx.header = true;
+	length = frame_rx_wait(timeout) - CMD_SIZE;
+	frame_rx_stop();
+	return length;
+}
+
+// Check the received block's data, decompress it if it is LZ4 compressed
+// Sets 'data' and 'len' to the block data, returns CMD_ERR_OK or error code
+//------------------------------------------------------------------------------------------------
+static uint32_t block_data(volatile command_t *fr, uint8_t **data, uint32_t *len, uint32_t *detail)
+{
+	uint32_t block_flags = fr->data_len & WRITE_BLOCK_FLAGS;
+	int dlen;
+
+	*data = (uint8_t *)fr->cmd_data;
+	*len = fr->data_len & ~WRITE_BLOCK_FLAGS;
+	if (block_flags & ~(WRITE_BLOCK_LZ4 | WRITE_BLOCK_NOVERIFY)) {
+		*detail = block_flags;
+		return CMD_ERR_DATA;
+	}
+	if (block_flags & WRITE_BLOCK_LZ4) {
+		// the corrupted payload is detected by the decoder or by the crc check
+		dlen = lz4_decode_block(*data, *len, lz4_buf, DATA_BLOCK_SIZE);
+		if (dlen <= 0) {
+			*detail = (uint32_t)dlen;
+			return CMD_ERR_DATACRC;
+		}
+		*data = lz4_buf;
+		*len = dlen;
+	}
+	if (crc32((const void *)*data, *len, 0) != fr->data_crc) {
+		*detail = 0;
+		return CMD_ERR_DATACRC;
+	}
+	return CMD_ERR_OK;
+}
+
+// Convert the received v2 block header into the v1 header in the same frame buffer
+// Returns the frame length as if v1 header was received, the header crc is invalid if the v2 header is
+//-----------------------------------------------------------------------------
+static uint32_t block_hdr_v2_expand(volatile command_t *fr, uint32_t length)
+{
+	block_hdr_v2_t hdr;
+
+	// the v2 header overlaps the v1 fields
+	memcpy(&hdr, (const void *)((uint8_t *)fr + WRITE_V2_OFFSET), sizeof(block_hdr_v2_t));
+	fr->cmd = CMD_WRITE_BLOCK | ((uint32_t)hdr.seq << 16);
+	fr->param = session.start + ((uint32_t)hdr.index * DATA_BLOCK_SIZE);
+	fr->data_len = (hdr.len & WRITE_V2_LEN_MASK) | (((uint32_t)hdr.len & ~WRITE_V2_LEN_MASK) << WRITE_V2_FLAGS_SHIFT);
+	fr->data_crc = hdr.data_crc;
+	fr->crc = crc32((const void *)fr, CMD_SIZE_BASE, 0);
+	if ((length < sizeof(block_hdr_v2_t)) || (hdr.crc != (uint16_t)crc32((const void *)&hdr, sizeof(block_hdr_v2_t)-sizeof(uint16_t), 0))) fr->crc = ~fr->crc;
+	return length + WRITE_V2_OFFSET;
+}
+
+// Windowed write session
+// The host sends up to 'window' blocks without waiting for the response,
+// each block has its own header: [CMD_WRITE_BLOCK | seq<<16, address, length, data_crc, crc].
+// Every block is acknowledged, only the rejected blocks are resent by the host.
+// Block with zero length ends the session.
+// With WRITE_BLOCK_LZ4 flag in the block length the payload is LZ4 compressed,
+// it is decompressed into 'lz4_buf' before programming.
+// With 'version' WRITE_VERSION_V2 the blocks have the compact block_hdr_v2_t header
+// and are acknowledged with block_ack_v2_t.
+// Two frame buffers are used, the next block is received while the current one is programmed.
+//----------------------------------------------------------------------------------------------
+static void write_session(uint32_t data_addr, uint32_t data_len, uint32_t window, uint32_t version)
+{
+	volatile command_t *frame[2] = { &cmd, &cmd_alt };
+	volatile command_t *fr;
+	uint32_t seq, offs, length, block_addr, block_len, block_flags, stat;
+	uint32_t detail;
+	uint8_t *data;
+	int idx = 0;
+
+	session.start = data_addr;
+	session.end = data_addr + data_len;
+	session.window = (window == 0) ? 1 : ((window > WRITE_WINDOW_MAX) ? WRITE_WINDOW_MAX : window);
+	session.base = 0;
+	session.committed = 0;
+
+	// confirm the session, return the accepted window, block frame version and max block size
+	cdc_rx_ignore();
+	cmd.param = DATA_BLOCK_SIZE;
+	cmd.data_crc = session.window;
+	if (version == WRITE_VERSION_V2) cmd.data_crc |= WRITE_VERSION_V2 << WRITE_VERSION_SHIFT;
+	cmd_response(CMD_ERR_OK, 0);
+
+	frx.v2 = (version == WRITE_VERSION_V2);
+	frame_rx_start(frame[idx]);
+	flash_set_yield(session_flash_yield);
+
+	while (1) {
+		// wait for the block
+		fr = frame[idx];
+		length = frame_rx_wait(WRITE_SESSION_TIMEOUT);
+		if (length == 0) break;
+		// v2 frame is processed as v1 frame
+		if (frx.v2) length = block_hdr_v2_expand(fr, length);
+		if ((length < CMD_SIZE) || (fr->crc != crc32((const void *)fr, CMD_SIZE_BASE, 0))) {
+			// frame sync lost, the host will resend all not acknowledged blocks
+			session_ack(CMD_ERR_CRC, WRITE_SEQ_RESYNC, length);
+			frame_rx_stop();
+			cdc_rx_drain(WRITE_RESYNC_IDLE);
+			frame_rx_start(fr);
+			continue;
+		}
+		if ((fr->cmd & 0x0000FFFF) != CMD_WRITE_BLOCK) {
+			session_ack(CMD_ERR_UNKNOWN_CMD, WRITE_SEQ_RESYNC, 0);
+			break;
+		}
+		seq = fr->cmd >> 16;
+		block_addr = fr->param;
+		block_len = fr->data_len & ~WRITE_BLOCK_FLAGS;
+		block_flags = fr->data_len & WRITE_BLOCK_FLAGS;
+		if (block_len == 0) {
+			// end of session
+			session_ack(CMD_ERR_OK, seq, 0);
+			break;
+		}
+		if ((block_len > DATA_BLOCK_SIZE) || (length != (CMD_SIZE + block_len))) {
+			if (block_len > DATA_BLOCK_SIZE) session_ack(CMD_ERR_LENGTH, seq, block_len);
+			else session_ack(CMD_ERR_DATA, seq, (block_len << 16) | (length - CMD_SIZE));
+			frame_rx_stop();
+			cdc_rx_drain(WRITE_RESYNC_IDLE);
+			frame_rx_start(fr);
+			continue;
+		}
+
+		// block received, receive the next one into the other buffer
+		idx ^= 1;
+		frame_rx_start(frame[idx]);
+		LED_toggle();
+
+		stat = block_data(fr, &data, &block_len, &detail);
+		if (stat != CMD_ERR_OK) {
+			session_ack(stat, seq, detail);
+			continue;
+		}
+
+		offs = (seq - session.base) & 0xFFFF;
+		if ((offs >= 0x8000) || ((offs < session.window) && (session.committed & (1 << offs)))) {
+			// already committed, the acknowledge was lost
+			session_ack(CMD_ERR_OK, seq, 0);
+			continue;
+		}
+		if (offs >= session.window) {
+			session_ack(CMD_ERR_SEQ, seq, session.window);
+			continue;
+		}
+		if ((block_addr < session.start) || (block_addr > session.end) || (block_len > (session.end - block_addr))) {
+			session_ack(CMD_ERR_ADDRESS, seq, block_addr);
+			continue;
+		}
+
+		// program the block, the next block is received between the page writes
+		detail = 0;
+		stat = program_block(block_addr, data, block_len, ((block_flags & WRITE_BLOCK_NOVERIFY) == 0), &detail);
+		if (stat == CMD_ERR_OK) {
+			// commit the block and advance the window
+			session.committed |= (1 << offs);
+			while (session.committed & 1) {
+				session.committed >>= 1;
+				session.base = (session.base + 1) & 0xFFFF;
+			}
+		}
+		session_ack(stat, seq, detail);
+	}
+	flash_set_yield(NULL);
+	frx.v2 = false;
+	frame_rx_stop();
+	LED_off();
+	cdc_rx_ignore();
+}
+
+// Program the output block of the delta update
+//-------------------------------------------
+static uint32_t patch_flush(uint32_t *detail)
+{
+	uint32_t stat = CMD_ERR_OK;
+
+	if (patch.out_len > 0) {
+		stat = program_block(patch.dst, patch.out, patch.out_len, true, detail);
+		patch.dst += patch.out_len;
+		patch.out_len = 0;
+	}
+	return stat;
+}
+
+// Apply 'len' bytes of the patch stream, the full output blocks are programmed to flash
+//---------------------------------------------------------------------------
+static uint32_t patch_apply(const uint8_t *data, uint32_t len, uint32_t *detail)
+{
+	const uint8_t *old;
+	uint32_t n, i, room, stat;
+
+	while (1) {
+		// advance to the next state when the current one is done
+		if ((patch.state == PATCH_DIFF) && (patch.count == 0)) {
+			patch.state = PATCH_EXTRA;
+			patch.count = patch.ctrl[1];
+		}
+		if ((patch.state == PATCH_EXTRA) && (patch.count == 0)) {
+			patch.opos += patch.ctrl[2];
+			patch.state = PATCH_CTRL;
+		}
+		if (len == 0) break;
+
+		if (patch.state == PATCH_CTRL) {
+			((uint8_t *)patch.ctrl)[patch.ctrl_len++] = *data++;
+			len--;
+			if (patch.ctrl_len == sizeof(patch.ctrl)) {
+				patch.ctrl_len = 0;
+				// the record must fit into the base and the target image
+				if ((patch.ctrl[0] > patch.src_size) || (patch.opos > (patch.src_size - patch.ctrl[0]))) {
+					*detail = patch.opos;
+					return CMD_ERR_ADDRESS;
+				}
+				room = patch.dst_end - patch.dst - patch.out_len;
+				if ((patch.ctrl[0] > room) || (patch.ctrl[1] > (room - patch.ctrl[0]))) {
+					*detail = patch.dst + patch.out_len;
+					return CMD_ERR_LENGTH;
+				}
+				patch.state = PATCH_DIFF;
+				patch.count = patch.ctrl[0];
+			}
+			continue;
+		}
+
+		n = DATA_BLOCK_SIZE - patch.out_len;
+		if (n > len) n = len;
+		if (n > patch.count) n = patch.count;
+		if (patch.state == PATCH_DIFF) {
+			// the base image is read directly from flash
+			old = (const uint8_t *)(patch.src + patch.opos);
+			for (i=0; i<n; i++) {
+				patch.out[patch.out_len + i] = data[i] + old[i];
+			}
+			patch.opos += n;
+		}
+		else memcpy(patch.out + patch.out_len, data, n);
+		patch.out_len += n;
+		patch.count -= n;
+		data += n;
+		len -= n;
+		if (patch.out_len == DATA_BLOCK_SIZE) {
+			stat = patch_flush(detail);
+			if (stat != CMD_ERR_OK) return stat;
+		}
+	}
+	return CMD_ERR_OK;
+}
+
+// Delta update, the new image of 'data_len' bytes is rebuilt at 'data_addr'
+// from the image in boot slot 'slot' and the patch stream sent by the host.
+// The patch stream is a sequence of records: control record [diff_len, extra_len, seek] (3 x int32),
+// 'diff_len' bytes added to the base image bytes, 'extra_len' bytes copied as they are;
+// the base image offset is then moved by 'seek'.
+// The stream is sent in block frames (as in windowed write session), one at a time,
+// block with zero length ends the session.
+//---------------------------------------------------------------------------------
+static void patch_session(uint32_t data_addr, uint32_t data_len, uint32_t slot)
+{
+	uint32_t seq, length, block_len, stat, detail;
+	uint8_t *data;
+
+	patch.src = boot_rec.apps[slot].address;
+	patch.src_size = boot_rec.apps[slot].size & 0x00FFFFFF;
+	// the base image must not overlap the target
+	if ((patch.src_size == 0) || (!flash_range_valid(patch.src, patch.src_size, FLASH_START_ADDRESS, FLASH_END_ADDRESS)) ||
+			((data_addr < (patch.src + patch.src_size)) && (patch.src < (data_addr + data_len)))) {
+		cmd_response(CMD_ERR_ADDRESS, 0);
+		return;
+	}
+	// check the base image, it is read while the target is written
+	flash_erase_finish(patch.src, patch.src_size);
+	app_sha256(patch.src, patch.src_size);
+	if (memcmp((const void *)boot_rec.apps[slot].sha256, sha256_hash, SHA_HASH_SIZE) != 0) {
+		cmd_response(CMD_ERR_SHA256, 0);
+		return;
+	}
+
+	patch.opos = 0;
+	patch.dst = data_addr;
+	patch.dst_end = data_addr + data_len;
+	patch.state = PATCH_CTRL;
+	patch.count = 0;
+	patch.ctrl_len = 0;
+	patch.out = (uint8_t *)cmd_alt.cmd_data;
+	patch.out_len = 0;
+	session.base = 0;
+
+	cdc_rx_ignore();
+	cmd.param = DATA_BLOCK_SIZE;
+	cmd_response(CMD_ERR_OK, 0);
+
+	while (1) {
+		frame_rx_start(&cmd);
+		length = frame_rx_wait(WRITE_SESSION_TIMEOUT);
+		if (length == 0) break;
+		if ((length < CMD_SIZE) || (cmd.crc != crc32((const void *)&cmd, CMD_SIZE_BASE, 0))) {
+			session_ack(CMD_ERR_CRC, WRITE_SEQ_RESYNC, length);
+			frame_rx_stop();
+			cdc_rx_drain(WRITE_RESYNC_IDLE);
+			continue;
+		}
+		if ((cmd.cmd & 0x0000FFFF) != CMD_WRITE_BLOCK) {
+			session_ack(CMD_ERR_UNKNOWN_CMD, WRITE_SEQ_RESYNC, 0);
+			break;
+		}
+		seq = cmd.cmd >> 16;
+		block_len = cmd.data_len & ~WRITE_BLOCK_FLAGS;
+		if ((block_len > DATA_BLOCK_SIZE) || (length != (CMD_SIZE + block_len))) {
+			session_ack(CMD_ERR_DATA, seq, (block_len << 16) | (length - CMD_SIZE));
+			frame_rx_stop();
+			cdc_rx_drain(WRITE_RESYNC_IDLE);
+			continue;
+		}
+		LED_toggle();
+		if (block_len == 0) {
+			// end of session, the whole image must be rebuilt
+			detail = patch.dst + patch.out_len;
+			if ((patch.state == PATCH_CTRL) && (patch.ctrl_len == 0) && (detail == patch.dst_end)) stat = patch_flush(&detail);
+			else stat = CMD_ERR_LENGTH;
+			session_ack(stat, seq, detail);
+			break;
+		}
+		if (seq != session.base) {
+			// the previous block is resent if the acknowledge was lost
+			session_ack((seq == ((session.base - 1) & 0xFFFF)) ? CMD_ERR_OK : CMD_ERR_SEQ, seq, 0);
+			continue;
+		}
+		stat = block_data(&cmd, &data, &block_len, &detail);
+		if (stat == CMD_ERR_OK) {
+			detail = 0;
+			stat = patch_apply(data, block_len, &detail);
+			if (stat != CMD_ERR_OK) {
+				// the output can not be recovered
+				session_ack(stat, seq, detail);
+				break;
+			}
+			session.base = (session.base + 1) & 0xFFFF;
+		}
+		session_ack(stat, seq, detail);
+	}
+	frame_rx_stop();
+	LED_off();
+	cdc_rx_ignore();
+}
+
+// Stream 'data_len' bytes from flash at 'data_addr' to the host
+// Every chunk is sent as a response frame: [CMD_ERR_OK, address, length, data_crc, crc] + data.
+// The next chunk is read from flash and queued while the previous one is being transfered.
+//-------------------------------------------------------------
+static void read_stream(uint32_t data_addr, uint32_t data_len)
+{
+	volatile command_t *frame[2] = { &cmd, &cmd_alt };
+	volatile command_t *fr;
+	uint32_t len, pending;
+	uint32_t queued = 0;	// transmit queue entries taken by the previous chunk
+	int idx = 0;
+
+	// confirm the command, return the chunk size
+	cmd.param = DATA_BLOCK_SIZE;
+	cmd_response(CMD_ERR_OK, 0);
+
+	while (data_len > 0) {
+		len = (data_len > DATA_BLOCK_SIZE) ? DATA_BLOCK_SIZE : data_len;
+		fr = frame[idx];
+		// wait for the chunk sent from this buffer, the previous chunk can still be sending
+		if (!cdc_write_sync(queued, CDC_WRITE_TIMEOUT)) break;
+		flash_read(data_addr, (void *)fr->cmd_data, len);
+		fr->param = data_addr;
+		set_response(fr, CMD_ERR_OK, len);
+		pending = cdc_write_pending();
+		if (!cdc_write_start((const void *)fr, CMD_SIZE + len, CDC_WRITE_TIMEOUT)) break;
+		// the earlier entries can complete meanwhile, then less is counted and waited for longer
+		queued = cdc_write_pending();
+		queued = (queued > pending) ? (queued - pending) : 0;
+		LED_toggle();
+		data_addr += len;
+		data_len -= len;
+		idx ^= 1;
+	}
+	cdc_write_wait(CDC_WRITE_TIMEOUT);
+	LED_off();
+}
+
+// SHA-256 progress report state
+static uint32_t sha_progress_time;
+
+// Chunked SHA-256 progress callback
+// Sends [CMD_ERR_INPROGRESS, done, 0, length, crc] frame every SHA256_PROGRESS_INTERVAL ms,
+// any data received from the host cancels the calculation
+//----------------------------------------------------------
+static bool sha256_progress(uint32_t done, uint32_t length)
+{
+	if (cdc_rx_count() > 0) return false;
+	if ((done < length) && ((DWT->CYCCNT - sha_progress_time) >= (SHA256_PROGRESS_INTERVAL * CPUFreq))) {
+		sha_progress_time = DWT->CYCCNT;
+		cmd_alt.param = done;
+		cmd_alt.data_crc = length;
+		set_response(&cmd_alt, CMD_ERR_INPROGRESS, 0);
+		cdc_write_buf((const void *)&cmd_alt, CMD_SIZE);
+		LED_toggle();
+	}
+	return true;
 }
 
 // Process the received binary command and send the response
@@ -189,12 +968,18 @@ static void processBinCmd()
 {
 	// Analize and execute the command
 	uint32_t data_crc, data_addr, length, data_len;
-	status_t status;
 
 	data_addr = cmd.param;
 	data_len = cmd.data_len;
 	data_crc = cmd.data_crc;
 
+	// the flash read by the command must not be in a suspended background erase,
+	// the write commands are synchronized with the background erase when programming
+	if ((cmd.cmd != CMD_WRITE_FLASH) && (cmd.cmd != CMD_WRITE_FLASH_WIN) && (cmd.cmd != CMD_WRITE_PATCH) &&
+			(cmd.cmd != CMD_FLASH_ERASE) && (cmd.cmd != CMD_SESSION_BEGIN)) {
+		flash_erase_finish(BOOTLOADER_FLEXSPI_AMBA_BASE, FLASH_END_ADDRESS - BOOTLOADER_FLEXSPI_AMBA_BASE);
+	}
+
 	//-------------------------------
 	if (cmd.cmd == CMD_GET_VERSION) {
 		// ==============================
@@ -204,45 +989,45 @@ static void processBinCmd()
 		// send response
 		cmd_response(CMD_ERR_OK, strlen(RomBOOT_InfoString));
 	}
+	//-----------------------------------
+	else if (cmd.cmd == CMD_GET_CAPS) {
+		// ==================================================
+		// === Return bootloader capabilities and geometry ==
+		// ==================================================
+		caps_t *caps = (caps_t *)cmd.cmd_data;
+		memset((void *)caps, 0, sizeof(caps_t));
+		caps->version = PROTOCOL_VERSION;
+		caps->max_block = DATA_BLOCK_SIZE;
+		caps->max_window = WRITE_WINDOW_MAX;
+		caps->features = CAPS_FEATURES;
+		caps->flash_base = BOOTLOADER_FLEXSPI_AMBA_BASE;
+		caps->flash_size = FLASH_SIZE * 1024u;
+		caps->page_size = FLASH_PAGE_SIZE;
+		caps->sector_size = SECTOR_SIZE;
+		caps->erase_sizes = FLASH_ERASE_SIZES;
+		caps->app_address = FLASH_START_ADDRESS;
+		caps->app_max_size = MAX_APP_SIZE;
+		caps->usb_speed = cdc_get_speed();
+		cmd_response(CMD_ERR_OK, sizeof(caps_t));
+	}
 	//------------------------------------
 	else if (cmd.cmd == CMD_WRITE_FLASH) {
 		// =====================================================
 		// === Write received data to flash at given address ===
 		// =====================================================
 		if (data_len <= DATA_BLOCK_SIZE) {
-			if ((data_addr >= 0x60010000) && ((data_addr + data_len) < 0x60800000)) {
+			if (flash_range_valid(data_addr, data_len, FLASH_START_ADDRESS, SESSION_JOURNAL_ADDRESS)) {
 				// confirm command and request data
 				cdc_rx_ignore();
 				cmd_response(CMD_ERR_OK, 0);
 				// wait for Flash block data
-				length = cdc_read_buf((void *)cmd.cmd_data, data_len, 1000);
+				length = payload_rx(data_len, 1000);
 				if (length == data_len) {
 					if (crc32((const void *)(cmd.cmd_data), data_len, 0) == data_crc) {
-						status = flash_program_buffer(data_addr, (uint8_t *)(cmd.cmd_data), data_len);
-						if (kStatus_Success != status) {
-							if (status == FERR_ERASE) {
-								// sector not erased
-								uint32_t nes = _sector_erased(data_addr);
-								cmd.data_crc = nes;
-								cmd_response(CMD_ERR_FLASHERASE, 0);
-							}
-							else {
-								cmd.data_crc = (uint32_t)status;
-								cmd_response(CMD_ERR_FLASH_WRITE, 0);
-							}
-						}
-						else {
-							// flash write ok, check programmed data
-							uint32_t chkidx = _check_flash_data(data_addr, (uint8_t *)cmd.cmd_data, data_len);
-							if (chkidx == data_len) {
-								// All OK
-								cmd_response(CMD_ERR_OK, 0);
-							}
-							else {
-								cmd.data_crc = chkidx;
-								cmd_response(CMD_ERR_FLASHDATACRC, 0);
-							}
-						}
+						uint32_t detail = 0;
+						uint32_t stat = program_block(data_addr, (uint8_t *)cmd.cmd_data, data_len, true, &detail);
+						if (stat != CMD_ERR_OK) cmd.data_crc = detail;
+						cmd_response(stat, 0);
 					}
 					else {
 						cmd.data_crc = *(uint32_t *)(cmd.cmd_data);
@@ -259,13 +1044,57 @@ static void processBinCmd()
 		else cmd_response(CMD_ERR_LENGTH, 0);
 		cdc_rx_ignore();
 	}
+	//----------------------------------------
+	else if (cmd.cmd == CMD_WRITE_FLASH_WIN) {
+		// ===================================================
+		// === Windowed write of 'data_len' bytes to flash ===
+		// ===================================================
+		// 'data_crc' holds the requested window and the block frame version
+		if ((data_len > 0) && ((data_addr % FLASH_PAGE_SIZE) == 0)) {
+			if (flash_range_valid(data_addr, data_len, FLASH_START_ADDRESS, SESSION_JOURNAL_ADDRESS)) {
+				write_session(data_addr, data_len, data_crc & WRITE_WINDOW_MASK, (data_crc >> WRITE_VERSION_SHIFT) & 0xFF);
+				journal_flush();
+			}
+			else cmd_response(CMD_ERR_ADDRESS, 0);
+		}
+		else cmd_response(CMD_ERR_LENGTH, 0);
+	}
+	//------------------------------------
+	else if (cmd.cmd == CMD_WRITE_PATCH) {
+		// =========================================================
+		// === Delta update against the image in the other slot ===
+		// =========================================================
+		// 'data_crc' holds the boot slot of the base image
+		if ((data_len > 0) && ((data_addr % SECTOR_SIZE) == 0) && (data_crc < 2)) {
+			if (flash_range_valid(data_addr, data_len, FLASH_START_ADDRESS, SESSION_JOURNAL_ADDRESS)) {
+				patch_session(data_addr, data_len, data_crc);
+				journal_flush();
+			}
+			else cmd_response(CMD_ERR_ADDRESS, 0);
+		}
+		else cmd_response(CMD_ERR_LENGTH, 0);
+	}
 	else if (cmd.cmd == CMD_APP_GETSHA256) {
 		// =================================================
 		// === Calculate and return application's SHA256 ===
 		// =================================================
-		app_sha256(data_addr, data_len);
-		memcpy((void *)cmd.cmd_data, sha256_hash, SHA_HASH_SIZE);
-		cmd_response(CMD_ERR_OK, SHA_HASH_SIZE);
+		// with 'data_crc' = SHA256_REQ_PROGRESS the progress is reported while calculating
+		// and the host can cancel the calculation by sending any data
+		if (flash_range_valid(data_addr, data_len, BOOTLOADER_FLEXSPI_AMBA_BASE, FLASH_END_ADDRESS)) {
+			sha_progress_time = DWT->CYCCNT;
+			int stat = app_sha256_chunked(data_addr, data_len, (data_crc == SHA256_REQ_PROGRESS) ? sha256_progress : NULL);
+			LED_off();
+			if (stat == SHA256_CANCELED) {
+				cdc_rx_ignore();
+				cmd_response(CMD_ERR_CANCELED, 0);
+			}
+			else if (stat != SHA256_OK) cmd_response(CMD_ERR_SHA256, 0);
+			else {
+				memcpy((void *)cmd.cmd_data, sha256_hash, SHA_HASH_SIZE);
+				cmd_response(CMD_ERR_OK, SHA_HASH_SIZE);
+			}
+		}
+		else cmd_response(CMD_ERR_ADDRESS, 0);
 	}
 	//-----------------------------------
 	else if (cmd.cmd == CMD_READ_FLASH) {
@@ -278,6 +1107,138 @@ static void processBinCmd()
 		}
 		else cmd_response(CMD_ERR_LENGTH, 0);
 	}
+	//------------------------------------------
+	else if (cmd.cmd == CMD_READ_FLASH_STREAM) {
+		// ======================================================
+		// === Stream 'data_len' bytes from Flash to the host ===
+		// ======================================================
+		if (data_len > 0) {
+			if (flash_range_valid(data_addr, data_len, BOOTLOADER_FLEXSPI_AMBA_BASE, FLASH_END_ADDRESS)) {
+				read_stream(data_addr, data_len);
+			}
+			else cmd_response(CMD_ERR_ADDRESS, 0);
+		}
+		else cmd_response(CMD_ERR_LENGTH, 0);
+	}
+	//---------------------------------------
+	else if (cmd.cmd == CMD_FLASH_MANIFEST) {
+		// ==================================================
+		// === Return CRC32 of every sector in the range ===
+		// ==================================================
+		// one response holds up to DATA_BLOCK_SIZE/4 sector crcs
+		length = data_len / SECTOR_SIZE;
+		if ((length > 0) && ((data_len % SECTOR_SIZE) == 0) && (length <= (DATA_BLOCK_SIZE / sizeof(uint32_t)))) {
+			if (((data_addr % SECTOR_SIZE) == 0) && (flash_range_valid(data_addr, data_len, BOOTLOADER_FLEXSPI_AMBA_BASE, FLASH_END_ADDRESS))) {
+				DCACHE_CleanInvalidateByRange(data_addr, data_len);
+				for (uint32_t i=0; i<length; i++) {
+					((uint32_t *)cmd.cmd_data)[i] = crc32((const void *)(data_addr + (i * SECTOR_SIZE)), SECTOR_SIZE, 0);
+				}
+				cmd_response(CMD_ERR_OK, length * sizeof(uint32_t));
+			}
+			else cmd_response(CMD_ERR_ADDRESS, 0);
+		}
+		else cmd_response(CMD_ERR_LENGTH, 0);
+	}
+	//------------------------------------
+	else if (cmd.cmd == CMD_FLASH_ERASE) {
+		// ==========================================
+		// === Erase 'data_len' bytes of flash ===
+		// ==========================================
+		// the range is erased with the largest blocks fitting into it, can take a few seconds
+		if ((data_len > 0) && ((data_len % SECTOR_SIZE) == 0) && ((data_addr % SECTOR_SIZE) == 0)) {
+			if (flash_range_valid(data_addr, data_len, FLASH_START_ADDRESS, SESSION_JOURNAL_ADDRESS)) {
+				status_t status = flash_erase(data_addr, data_len);
+				app_sha256_invalidate(data_addr, data_len);
+				journal_clear(data_addr, data_len);
+				if (status != FERR_OK) {
+					cmd.data_crc = (uint32_t)status;
+					cmd_response(CMD_ERR_FLASHERASE, 0);
+				}
+				else cmd_response(CMD_ERR_OK, 0);
+			}
+			else cmd_response(CMD_ERR_ADDRESS, 0);
+		}
+		else cmd_response(CMD_ERR_LENGTH, 0);
+	}
+	//--------------------------------------
+	else if (cmd.cmd == CMD_SESSION_BEGIN) {
+		// ==================================================
+		// === Queue background erase of the write range ===
+		// ==================================================
+		// the host will write the whole range, it is erased while waiting for the data
+		if ((data_len > 0) && ((data_addr % SECTOR_SIZE) == 0)) {
+			if (flash_range_valid(data_addr, data_len, FLASH_START_ADDRESS, SESSION_JOURNAL_ADDRESS)) {
+				journal_restart(data_addr, data_len);
+				status_t status = flash_erase_queue(data_addr, data_len);
+				if (status != FERR_OK) {
+					app_sha256_invalidate(data_addr, data_len);
+					cmd.data_crc = (uint32_t)status;
+					cmd_response(CMD_ERR_FLASHERASE, 0);
+				}
+				else {
+					// the SHA-256 of the range is calculated while writing
+					app_sha256_begin(data_addr, data_len);
+					cmd_response(CMD_ERR_OK, 0);
+				}
+			}
+			else cmd_response(CMD_ERR_ADDRESS, 0);
+		}
+		else cmd_response(CMD_ERR_LENGTH, 0);
+	}
+	//--------------------------------------
+	else if (cmd.cmd == CMD_JOURNAL_BEGIN) {
+		// ===================================================
+		// === Start or continue the write session journal ===
+		// ===================================================
+		// the image SHA-256 follows the command, the journal of the same range and image is continued
+		// 'param' of the response holds the number of already committed sectors
+		if ((data_len > 0) && ((data_addr % SECTOR_SIZE) == 0) && (((data_len + SECTOR_SIZE - 1) / SECTOR_SIZE) <= JOURNAL_MAX_SECTORS)) {
+			if (flash_range_valid(data_addr, data_len, FLASH_START_ADDRESS, SESSION_JOURNAL_ADDRESS)) {
+				// confirm command and request the SHA-256
+				cmd_response(CMD_ERR_OK, 0);
+				length = cdc_read_buf((void *)cmd.cmd_data, SHA_HASH_SIZE, 500);
+				if (length == SHA_HASH_SIZE) {
+					if (crc32((const void *)cmd.cmd_data, SHA_HASH_SIZE, 0) == data_crc) {
+						if (journal_begin(data_addr, data_len, (const uint8_t *)cmd.cmd_data)) {
+							cmd.param = journal.committed;
+							cmd_response(CMD_ERR_OK, 0);
+						}
+						else cmd_response(CMD_ERR_JOURNAL, 0);
+					}
+					else cmd_response(CMD_ERR_DATACRC, 0);
+				}
+				else cmd_response(CMD_ERR_DATA, 0);
+			}
+			else cmd_response(CMD_ERR_ADDRESS, 0);
+		}
+		else cmd_response(CMD_ERR_LENGTH, 0);
+	}
+	//-------------------------------------
+	else if (cmd.cmd == CMD_JOURNAL_READ) {
+		// ========================================
+		// === Return the write session journal ===
+		// ========================================
+		// header followed by the committed sectors bitmap, 'param' holds the number of committed sectors
+		journal_flush();
+		if ((journal.active) || (journal_load())) {
+			length = (journal.sectors + 7) / 8;
+			memcpy((void *)cmd.cmd_data, (void *)&journal.hdr, sizeof(journal_hdr_t));
+			memcpy((void *)(cmd.cmd_data + sizeof(journal_hdr_t)), journal.bitmap, length);
+			cmd.param = journal.committed;
+			cmd_response(CMD_ERR_OK, sizeof(journal_hdr_t) + length);
+		}
+		else cmd_response(CMD_ERR_JOURNAL, 0);
+	}
+	//------------------------------------
+	else if (cmd.cmd == CMD_FLASH_STATS) {
+		// ===========================================
+		// === Return the flash operations counters ==
+		// ===========================================
+		// 'param' 1 resets the counters after reading
+		memcpy((void *)cmd.cmd_data, &flash_stats, sizeof(flash_stats_t));
+		if (data_addr == 1) memset(&flash_stats, 0, sizeof(flash_stats_t));
+		cmd_response(CMD_ERR_OK, sizeof(flash_stats_t));
+	}
 	//-------------------------------------------------------
 	else if ((cmd.cmd & 0x0000FFFF) == CMD_APP_RECORD_READ) {
 		// ========================================
@@ -302,10 +1263,11 @@ static void processBinCmd()
 		// =========================================
 		// === Write application boot record(s) ====
 		// =========================================
+		// 'data_len' upper 16 bits select the boot slot, as in CMD_APP_RECORD_READ
+		uint16_t data_flags = data_len >> 16;
+		data_len &= 0x0000FFFF;
 		if (data_len == sizeof(app_rec_t)) {
-			uint16_t data_flags = data_len >> 16;
-			data_len &= 0x0000FFFF;
-			if ((data_addr >= 0x60010000) && (data_addr < 0x60200000)) {
+			if ((data_addr >= FLASH_START_ADDRESS) && (data_addr < SESSION_JOURNAL_ADDRESS)) {
 				// confirm command and request data
 				cmd_response(CMD_ERR_OK, 0);
 				// wait for app boot record data
@@ -313,30 +1275,7 @@ static void processBinCmd()
 				if (length == sizeof(app_rec_t)) {
 					if (crc32((const void *)&app_record, data_len, 0) == data_crc) {
 						// boot record received, analize and save
-						// check the application SHA256
-						app_sha256(app_record.address, app_record.size & 0x00FFFFFF);
-						if (memcmp(app_record.sha256, sha256_hash, SHA_HASH_SIZE) == 0) {
-							int idx = (data_flags & 2) ? 1 : 0;
-							int res = checkBootRecord(true);
-							if (res >= 0) {
-								// backup main boot sector
-								if (writeBootRecord(false)) {
-									// set the new app record in the meina boot record
-									memcpy((void *)boot_rec.apps[idx].name, &app_record, sizeof(app_rec_t));
-									// calculate and set new boot record CRC32
-									uint32_t crc = crc32((const void *)&boot_rec, sizeof(boot_rec_t)-sizeof(uint32_t), 0);
-									boot_rec.crc = crc;
-									// save new main boot record
-									if (writeBootRecord(true)) {
-										cmd_response(CMD_ERR_OK, 0);
-									}
-									else cmd_response(CMD_ERR_BOOTREC_WRITE, 0);
-								}
-								else cmd_response(CMD_ERR_BKPBOOTREC_WRITE, 0);
-							}
-							else cmd_response(CMD_ERR_BOOTREC_READ, 0);
-						}
-						else cmd_response(CMD_ERR_SHA256, 0);
+						cmd_response(app_record_install(&app_record, (data_flags & 2) ? 1 : 0), 0);
 					}
 					else cmd_response(CMD_ERR_DATACRC, 0);
 				}
@@ -352,10 +1291,106 @@ static void processBinCmd()
 	}
 }
 
+// Print cycles per byte with two decimals
+//------------------------------------------------------------------
+static void print_cpb(const char *name, uint32_t cycles, uint32_t length)
+{
+	uint32_t cpb = (cycles * 100) / length;
+	print("  %s: %u.%02u cycles/byte\r\n", name, cpb / 100, cpb % 100);
+}
+
+// Measure CRC32 speed of the software and DCP implementations
+//-----------------------------
+static void crc_benchmark(void)
+{
+	const void *ram_buf = (const void *)cmd_alt.cmd_data;
+	const void *flash_buf = (const void *)FLASH_START_ADDRESS;
+	uint32_t start, cycles, crc;
+
+	print("CRC32 benchmark (%u bytes):\r\n", DATA_BLOCK_SIZE);
+	crc = crc32("123456789", 9, 0);
+	print("  check: %08X (%s)\r\n", crc, (crc == 0xCBF43926) ? "ok" : "error");
+
+	start = DWT->CYCCNT;
+	crc32(ram_buf, DATA_BLOCK_SIZE, 0);
+	cycles = DWT->CYCCNT - start;
+	print_cpb("slicing-by-8, RAM  ", cycles, DATA_BLOCK_SIZE);
+
+	start = DWT->CYCCNT;
+	crc32(flash_buf, DATA_BLOCK_SIZE, 0);
+	cycles = DWT->CYCCNT - start;
+	print_cpb("slicing-by-8, flash", cycles, DATA_BLOCK_SIZE);
+
+	start = DWT->CYCCNT;
+	if (crc32_dcp(ram_buf, DATA_BLOCK_SIZE, &crc)) {
+		cycles = DWT->CYCCNT - start;
+		print_cpb("DCP, RAM           ", cycles, DATA_BLOCK_SIZE);
+	}
+	else print("  DCP not available\r\n");
+
+	start = DWT->CYCCNT;
+	if (crc32_dcp(flash_buf, DATA_BLOCK_SIZE, &crc)) {
+		cycles = DWT->CYCCNT - start;
+		print_cpb("DCP, flash         ", cycles, DATA_BLOCK_SIZE);
+	}
+	print("> ");
+}
+
+// Byte by byte compare, the reference for the flash scan benchmark
+//------------------------------------------------------------------------------------
+static uint32_t cmp_len_bytes(const uint8_t *data1, const uint8_t *data2, uint32_t length)
+{
+	uint32_t i;
+	for (i=0; i<length; i++) {
+		if (data1[i] != data2[i]) break;
+	}
+	return i;
+}
+
+// Measure the speed of the blank check and verify kernels
+//------------------------------
+static void scan_benchmark(void)
+{
+	uint8_t *ram_buf = (uint8_t *)cmd_alt.cmd_data;
+	const uint8_t *flash_buf = (const uint8_t *)FLASH_START_ADDRESS;
+	uint32_t start, cycles, idx;
+	bool ok = true;
+
+	print("Flash scan benchmark (%u bytes):\r\n", DATA_BLOCK_SIZE);
+	// the exact first mismatch index must be returned
+	flash_read(FLASH_START_ADDRESS, ram_buf, DATA_BLOCK_SIZE);
+	for (idx=0; idx<DATA_BLOCK_SIZE; idx+=37) {
+		ram_buf[idx] ^= 0x01;
+		if (flash_cmp_len(flash_buf, ram_buf, DATA_BLOCK_SIZE) != idx) ok = false;
+		ram_buf[idx] ^= 0x01;
+	}
+	if (flash_cmp_len(flash_buf, ram_buf, DATA_BLOCK_SIZE) != DATA_BLOCK_SIZE) ok = false;
+	print("  check: %s\r\n", (ok) ? "ok" : "error");
+
+	start = DWT->CYCCNT;
+	cmp_len_bytes(flash_buf, ram_buf, DATA_BLOCK_SIZE);
+	cycles = DWT->CYCCNT - start;
+	print_cpb("verify, bytes, flash", cycles, DATA_BLOCK_SIZE);
+
+	start = DWT->CYCCNT;
+	flash_cmp_len(flash_buf, ram_buf, DATA_BLOCK_SIZE);
+	cycles = DWT->CYCCNT - start;
+	print_cpb("verify, words, flash", cycles, DATA_BLOCK_SIZE);
+
+	memset(ram_buf, 0xFF, DATA_BLOCK_SIZE);
+	start = DWT->CYCCNT;
+	flash_blank_len(ram_buf, DATA_BLOCK_SIZE);
+	cycles = DWT->CYCCNT - start;
+	print_cpb("blank, words, RAM   ", cycles, DATA_BLOCK_SIZE);
+	print("> ");
+}
+
 // Terminal commands processing
 //--------------------------
 static void processTermCmd()
 {
+	flash_erase_finish(BOOTLOADER_FLEXSPI_AMBA_BASE, FLASH_END_ADDRESS - BOOTLOADER_FLEXSPI_AMBA_BASE);
+
 	if (termcmd[0] == 'v') {
 		print("%s on %s board\r\n> ", RomBOOT_InfoString, BOARD_NAME);
 	}
@@ -365,7 +1400,7 @@ static void processTermCmd()
 	else if (termcmd[0] == 'L') {
 		print("Boot log:\r\n");
 		if (log_data_ptr > 0) {
-			print("%s", log_data);
+			print_str(log_data);
 		}
 		print("\r\n> ");
 	}
@@ -408,6 +1443,12 @@ static void processTermCmd()
 			print("No valid boot record found\r\n> ");
 		}
 	}
+	else if (termcmd[0] == 'C') {
+		crc_benchmark();
+	}
+	else if (termcmd[0] == 'S') {
+		scan_benchmark();
+	}
 	else if ((termcmd[0] == 't') | (termcmd[0] == 'T')) {
 		print("Binary transfer mode\r\n\r\n");
 		termMode = false;
@@ -429,8 +1470,17 @@ void imxrt_ba_monitor_run(void)
 	uint32_t length;
 
 	while (1) {
+		// flash the blocks written to the UF2 volume or received by DFU until the next command is received
+		do {
+			uf2_poll();
+			dfu_poll();
+		} while (((uf2_busy()) || (dfu_busy())) && (cdc_rx_count() == 0));
 		if (!wait_ready()) continue;
+		// erase in background until the next command is received
+		while ((flash_erase_pending()) && (cdc_rx_count() == 0) && (!uf2_busy()) && (!dfu_busy())) flash_erase_poll();
 		LED_toggle();
+		// the blocks written to the UF2 volume or received by DFU meanwhile are flashed before the command is read
+		if (!cmd_wait((termMode) ? 400:200)) continue;
 		length = cdc_read_buf((void *)&cmd, CMD_SIZE, (termMode) ? 400:200);
 		if (length == 0) continue;
 
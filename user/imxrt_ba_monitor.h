@@ -36,14 +36,27 @@
 #include <stdio.h>
 #include <stdint.h>
 #include "app.h"
+#include "imxrt_ba_crc.h"
+#include "imxrt_ba_cdc.h"
 
 // Binary command constants
 #define CMD_GET_VERSION							0x0000D001
+#define CMD_GET_CAPS								0x0000D00A
 #define CMD_READ_FLASH							0x0000D102
 #define CMD_WRITE_FLASH							0x0000D103
 #define CMD_APP_RECORD_READ					0x0000D204
 #define CMD_APP_RECORD_WRITE				0x0000D205
 #define CMD_APP_GETSHA256						0x0000D206
+#define CMD_WRITE_FLASH_WIN					0x0000D107
+#define CMD_WRITE_BLOCK							0x0000D108
+#define CMD_READ_FLASH_STREAM				0x0000D109
+#define CMD_WRITE_PATCH							0x0000D10B
+#define CMD_FLASH_MANIFEST					0x0000D10C
+#define CMD_FLASH_ERASE							0x0000D10D
+#define CMD_FLASH_STATS							0x0000D10E
+#define CMD_SESSION_BEGIN						0x0000D10F
+#define CMD_JOURNAL_BEGIN						0x0000D110
+#define CMD_JOURNAL_READ						0x0000D111
 
 // Command error codes
 #define CMD_ERR_OK									0x00000000
@@ -61,12 +74,86 @@
 #define CMD_ERR_BKPBOOTREC_WRITE		0x0000E10C
 #define CMD_ERR_FLASHDATACRC				0x0000E10D
 #define CMD_ERR_FLASHERASE					0x0000E10E
+#define CMD_ERR_SEQ									0x0000E10F
+#define CMD_ERR_INPROGRESS					0x0000E110
+#define CMD_ERR_CANCELED						0x0000E111
+#define CMD_ERR_JOURNAL							0x0000E112
 
 // Other definitions
 #define DATA_BLOCK_SIZE		4096
 #define CMD_SIZE					20
 #define CMD_SIZE_BASE			16
 
+// Binary protocol version reported by CMD_GET_CAPS
+#define PROTOCOL_VERSION			2
+
+// Capabilities feature flags
+#define CAPS_FEAT_WRITE_WIN		0x00000001		// windowed write session (CMD_WRITE_FLASH_WIN)
+#define CAPS_FEAT_READ_STREAM	0x00000002		// streaming read (CMD_READ_FLASH_STREAM)
+#define CAPS_FEAT_VERIFY			0x00000004		// programmed data is verified by read back
+#define CAPS_FEAT_LZ4					0x00000008		// LZ4 compressed blocks in windowed write session
+#define CAPS_FEAT_PATCH				0x00000010		// delta update against the image in the other boot slot (CMD_WRITE_PATCH)
+#define CAPS_FEAT_MANIFEST		0x00000020		// per sector CRC32 of the flash range (CMD_FLASH_MANIFEST)
+#define CAPS_FEAT_ERASE				0x00000040		// flash range erase with block erases (CMD_FLASH_ERASE)
+#define CAPS_FEAT_STATS				0x00000080		// flash operations counters (CMD_FLASH_STATS)
+#define CAPS_FEAT_PREERASE		0x00000100		// background erase of the range to be written (CMD_SESSION_BEGIN)
+#define CAPS_FEAT_SHA_PROGRESS	0x00000200	// SHA-256 progress reports and cancel (CMD_APP_GETSHA256)
+#define CAPS_FEAT_JOURNAL			0x00000400		// resumable write with the on-flash journal (CMD_JOURNAL_BEGIN, CMD_JOURNAL_READ)
+#define CAPS_FEAT_USB_VENDOR	0x00000800		// the protocol is also carried by the vendor specific USB bulk interface
+
+#define CAPS_FEATURES					(CAPS_FEAT_WRITE_WIN | CAPS_FEAT_READ_STREAM | CAPS_FEAT_VERIFY | CAPS_FEAT_LZ4 | \
+															 CAPS_FEAT_PATCH | CAPS_FEAT_MANIFEST | CAPS_FEAT_ERASE | \
+															 CAPS_FEAT_STATS | CAPS_FEAT_PREERASE | CAPS_FEAT_SHA_PROGRESS | \
+															 CAPS_FEAT_JOURNAL | CAPS_FEAT_USB_VENDOR)
+
+// SHA-256 calculation
+#define SHA256_REQ_PROGRESS		1					// CMD_APP_GETSHA256 'data_crc' requesting the progress reports
+#define SHA256_PROGRESS_INTERVAL	200		// progress report interval (ms)
+
+// Write session journal
+// The header is in the first page of the journal sector, the second page holds the bitmap
+// of the committed sectors of the range, the bit is cleared when the sector is written and verified
+#define JOURNAL_MAX_SECTORS		(FLASH_PAGE_SIZE * 8)
+#define JOURNAL_FLUSH_SECTORS	16				// the bitmap is programmed after that many sectors are committed
+
+// Windowed write session
+#define WRITE_WINDOW_MAX			16				// max number of blocks the host may have in flight (<= 32)
+#define WRITE_SEQ_RESYNC			0xFFFF		// sequence number reported when the frame sync is lost
+#define WRITE_RESYNC_IDLE			20				// input must be idle that long (ms) before resuming after an error
+#define WRITE_SESSION_TIMEOUT	1000			// session ends if no block header is received for that long (ms)
+
+// CMD_WRITE_FLASH_WIN 'data_crc' field: window in the low 16 bits, block frame version in bits 16-23
+// The version is returned in the response if the session uses it, v1 block frames are used otherwise
+#define WRITE_WINDOW_MASK			0x0000FFFF
+#define WRITE_VERSION_SHIFT		16
+#define WRITE_VERSION_V2			2
+
+// Block frame 'data_len' field: payload length in the low 16 bits, flags in the high 8 bits
+#define WRITE_BLOCK_LEN_MASK	0x0000FFFF
+#define WRITE_BLOCK_FLAGS			0xFF000000
+#define WRITE_BLOCK_LZ4				0x01000000		// LZ4 compressed payload, 'data_crc' is the crc of the decompressed data
+#define WRITE_BLOCK_NOVERIFY	0x02000000		// programmed data is not read back, the host checks the image SHA-256
+
+// v2 block header 'len' field: payload length in the low 13 bits, WRITE_BLOCK_xxx flags >> 11 in the high 3 bits
+#define WRITE_V2_LEN_MASK			0x1FFF
+#define WRITE_V2_FLAGS_SHIFT	11
+#define WRITE_V2_OFFSET				(CMD_SIZE - sizeof(block_hdr_v2_t))	// v2 header offset in the frame buffer, the data is in 'cmd_data'
+
+// Delta update patch stream states
+#define PATCH_CTRL						0					// receiving the control record [diff_len, extra_len, seek]
+#define PATCH_DIFF						1					// diff bytes, added to the base image bytes
+#define PATCH_EXTRA						2					// extra bytes, copied to the target image
+
+// Binary command header
+//-----------------------
+typedef struct _command_hdr_t_ {
+	uint32_t cmd;
+	uint32_t param;
+	uint32_t data_len;
+	uint32_t data_crc;
+	uint32_t crc;
+}	command_hdr_t;
+
 // Binary command structure
 //--------------------------
 typedef struct _command_t_ {
@@ -75,12 +162,67 @@ typedef struct _command_t_ {
 	uint32_t data_len;
 	uint32_t data_crc;
 	uint32_t crc;
-	uint8_t  cmd_data[DATA_BLOCK_SIZE+256];
+	uint8_t  cmd_data[DATA_BLOCK_SIZE+CDC_RX_PACKET_SIZE];	// room for the direct receive rounded to the packet size
 }	command_t;
 
 
+// v2 block frame header, 'data_len' is followed by the payload
+// The block address is 'session start + index * DATA_BLOCK_SIZE'
+//-----------------------------------------------------------------
+typedef struct _block_hdr_v2_t_ {
+	uint32_t data_crc;						// CRC32 of the (decompressed) data
+	uint16_t seq;									// sequence number
+	uint16_t index;								// block index in the session range
+	uint16_t len;									// payload length and flags
+	uint16_t crc;									// low 16 bits of CRC32 of the previous fields
+}	block_hdr_v2_t;								// size: 12 bytes
+
+// v2 block acknowledge, 'status' 0 acknowledges the block,
+// otherwise it is NAK and holds the reason (CMD_ERR_xxx code)
+//-----------------------------------------------------------------
+typedef struct _block_ack_v2_t_ {
+	uint16_t seq;									// block's sequence number or WRITE_SEQ_RESYNC
+	uint16_t base;								// lowest not committed sequence number
+	uint32_t detail;							// error details
+	uint16_t status;
+	uint16_t crc;									// low 16 bits of CRC32 of the previous fields
+}	block_ack_v2_t;								// size: 12 bytes
+
+// Write session journal header, returned by CMD_JOURNAL_READ followed by the bitmap
+//-----------------------------------------------------------------------------------
+typedef struct _journal_hdr_t_ {
+	char     ID[16];								// SESSION_JOURNAL_ID
+	uint32_t address;							// target range
+	uint32_t length;
+	uint8_t  sha256[SHA_HASH_SIZE];	// expected image SHA-256
+	uint32_t crc;									// CRC32 of the header
+}	journal_hdr_t;								// size: 60 bytes
+
+// Bootloader capabilities, returned by CMD_GET_CAPS
+//---------------------------------------------------
+typedef struct _caps_t_ {
+	uint32_t version;				// binary protocol version
+	uint32_t max_block;			// max data block size
+	uint32_t max_window;		// max blocks in flight in windowed write
+	uint32_t features;			// CAPS_FEAT_xxx flags
+	uint32_t flash_base;		// flash start address
+	uint32_t flash_size;		// flash size in bytes
+	uint32_t page_size;			// flash program page size
+	uint32_t sector_size;		// flash sector size
+	uint32_t erase_sizes;		// supported erase sizes, OR-ed
+	uint32_t app_address;		// lowest application address
+	uint32_t app_max_size;	// max application size
+	uint32_t usb_speed;			// USB_SPEED_FULL or USB_SPEED_HIGH
+}	caps_t;
+
 //uint16_t crc16(const void* data, size_t length, uint16_t previousCrc16);
-uint32_t crc32(const void* data, size_t length, uint32_t previousCrc32);
+
+// Install the application record to the boot slot, returns the command error code
+uint32_t app_record_install(const app_rec_t *rec, int idx);
+// Boot slot to install the application at the address to
+int app_install_slot(uint32_t address);
+// Boot slot of the active application, -1 if none is configured
+int app_boot_slot(void);
 
 // Main function of the bootloader monitor
 void imxrt_ba_monitor_run(void);
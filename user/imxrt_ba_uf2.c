@@ -0,0 +1,362 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Part of the iMX RT MicroPython port
+ * iMX RT CDC ACM Bootloader with OTA support
+ *
+ * Code inspired by CDC Arduino bootloader for SeeedStudio's ArchMix board
+ * https://github.com/Seeed-Studio/ArduinoCore-imxrt/tree/master/bootloaders
+ * 
+ * Author: LoBo (loboris@gmail.com)
+ * 
+ * Copyright (C) 2021  LoBo
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "imxrt_ba_uf2.h"
+
+#if ((defined(USB_DEVICE_CONFIG_MSC)) && (USB_DEVICE_CONFIG_MSC > 0U))
+
+#include "virtual_com.h"
+#include "usb_device_msc.h"
+#include "imxrt_ba_monitor.h"
+#include "imxrt_ba_flash.h"
+#include "board_drive_led.h"
+#include "app.h"
+
+// Virtual FAT16 volume, one sector per cluster
+#define UF2_VOLUME_SECTORS		32768			// 16 MB
+#define UF2_FAT_SECTORS				128
+#define UF2_ROOT_ENTRIES			64
+#define UF2_FAT_START					1
+#define UF2_ROOT_START				(UF2_FAT_START + 2*UF2_FAT_SECTORS)
+#define UF2_DATA_START				(UF2_ROOT_START + (UF2_ROOT_ENTRIES*32)/USB_DEVICE_MSC_BLOCK_SIZE)
+#define UF2_INFO_CLUSTER			2
+#define UF2_CURRENT_CLUSTER		3
+#define UF2_FAT_DATE					0x5221		// 2021-01-01
+
+#define UF2_MAX_BLOCKS				(MAX_APP_SIZE / FLASH_PAGE_SIZE)
+#define UF2_MAX_SECTORS				(MAX_APP_SIZE / SECTOR_SIZE)
+
+// FAT directory entry
+//----------------------------
+typedef struct _fat_dir_t_ {
+	char     name[11];
+	uint8_t  attr;
+	uint8_t  reserved[8];
+	uint16_t clusterHigh;
+	uint16_t time;
+	uint16_t date;
+	uint16_t cluster;
+	uint32_t size;
+}	fat_dir_t;										// size: 32 bytes
+
+// UF2 image being written
+//----------------------------
+typedef struct _uf2_session_t_ {
+	bool     active;
+	uint32_t address;							// image start, sector aligned
+	uint32_t blocks;							// number of UF2 blocks of the image
+	uint32_t received;						// number of blocks written
+	uint8_t  written[UF2_MAX_BLOCKS / 8];	// blocks written
+	uint8_t  erased[UF2_MAX_SECTORS / 8];		// sectors erased by the session
+}	uf2_session_t;
+
+static const uint8_t uf2_boot_sector[62] = {
+	0xEB, 0x3C, 0x90, 'U', 'F', '2', ' ', 'U', 'F', '2', ' ',
+	0x00, 0x02,																// bytes per sector
+	0x01,																			// sectors per cluster
+	0x01, 0x00,																// reserved sectors
+	0x02,																			// number of FATs
+	UF2_ROOT_ENTRIES, 0x00,
+	(UF2_VOLUME_SECTORS & 0xFF), (UF2_VOLUME_SECTORS >> 8),
+	0xF8,																			// media descriptor
+	UF2_FAT_SECTORS, 0x00,
+	0x01, 0x00, 0x01, 0x00,										// sectors per track, heads
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x80, 0x00, 0x29,													// drive number, extended boot signature
+	0x4C, 0x42, 0x55, 0x46,										// volume serial number
+	'I', 'M', 'X', 'R', 'T', '-', 'B', 'O', 'O', 'T', ' ',
+	'F', 'A', 'T', '1', '6', ' ', ' ', ' ',
+};
+
+static const char uf2_info[] =	"UF2 Bootloader\r\n"
+																"Model: i.MX RT10XX\r\n"
+																"Board-ID: " BOARD_NAME "\r\n"
+																"Copy the .uf2 file to this drive to flash the application\r\n";
+
+static class_handle_t uf2_handle = 0;
+static uf2_block_t * volatile uf2_pending = NULL;
+static uint8_t * volatile uf2_read_buf = NULL;		// sector read deferred to uf2_poll()
+static uint32_t uf2_read_lba = 0;
+static uf2_session_t uf2;
+
+// Application shown as CURRENT.UF2, read by the USB interrupt
+static uint32_t uf2_app_address = 0;
+static uint32_t uf2_app_blocks = 0;
+static uint32_t uf2_app_crc = 0;
+static bool uf2_app_valid = false;
+
+// Take the snapshot of the active application, or the first configured one
+// The host reads the volume again if the application changed
+//----------------------------
+static void uf2_app_snapshot()
+{
+	uint32_t address = 0, blocks = 0;
+	int idx = app_boot_slot();
+
+	if (idx >= 0) {
+		address = boot_rec.apps[idx].address;
+		blocks = ((boot_rec.apps[idx].size & 0x00FFFFFF) + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+	}
+
+	uint32_t primask = DisableGlobalIRQ();
+	bool changed = (uf2_app_address != address) || (uf2_app_blocks != blocks);
+	uf2_app_address = address;
+	uf2_app_blocks = blocks;
+	EnableGlobalIRQ(primask);
+
+	uf2_app_crc = boot_rec.crc;
+	if ((changed) && (uf2_app_valid) && (uf2_handle)) USB_DeviceMscMediumChanged(uf2_handle);
+	uf2_app_valid = true;
+}
+
+// FAT entry of the 'cluster'
+//---------------------------------------------
+static uint16_t uf2_fat_entry(uint32_t cluster)
+{
+	if (cluster < UF2_CURRENT_CLUSTER) return (cluster == 0) ? 0xFFF8 : 0xFFFF;
+	cluster -= UF2_CURRENT_CLUSTER;
+	if (cluster >= uf2_app_blocks) return 0;
+	// CURRENT.UF2 clusters are chained in order
+	return ((cluster + 1) == uf2_app_blocks) ? 0xFFFF : (cluster + UF2_CURRENT_CLUSTER + 1);
+}
+
+// Set the directory entry
+//--------------------------------------------------------------------------------------------------
+static void uf2_dir_entry(fat_dir_t *dir, const char *name, uint8_t attr, uint16_t cluster, uint32_t size)
+{
+	memcpy(dir->name, name, sizeof(dir->name));
+	dir->attr = attr;
+	dir->time = 0;
+	dir->date = UF2_FAT_DATE;
+	dir->cluster = cluster;
+	dir->size = size;
+}
+
+// Generate the volume sector 'lba' into 'buf', called from the USB interrupt
+// CURRENT.UF2 blocks are read from flash, returns false if the block's flash
+// is in the background erase operation, it is finished and read by uf2_poll()
+//--------------------------------------------------------
+static bool uf2_read_sector(uint32_t lba, uint8_t *buf)
+{
+	memset(buf, 0, USB_DEVICE_MSC_BLOCK_SIZE);
+
+	if (lba == 0) {
+		memcpy(buf, uf2_boot_sector, sizeof(uf2_boot_sector));
+		buf[510] = 0x55;
+		buf[511] = 0xAA;
+	}
+	else if (lba < UF2_ROOT_START) {
+		// both FAT copies are the same
+		uint16_t *fat = (uint16_t *)buf;
+		uint32_t cluster = ((lba - UF2_FAT_START) % UF2_FAT_SECTORS) * (USB_DEVICE_MSC_BLOCK_SIZE / 2);
+		for (uint32_t i=0; i<(USB_DEVICE_MSC_BLOCK_SIZE / 2); i++) fat[i] = uf2_fat_entry(cluster + i);
+	}
+	else if (lba == UF2_ROOT_START) {
+		fat_dir_t *dir = (fat_dir_t *)buf;
+		uf2_dir_entry(dir++, "IMXRT-BOOT ", 0x08, 0, 0);
+		uf2_dir_entry(dir++, "INFO_UF2TXT", 0x01, UF2_INFO_CLUSTER, sizeof(uf2_info) - 1);
+		if (uf2_app_blocks) {
+			uf2_dir_entry(dir, "CURRENT UF2", 0x01, UF2_CURRENT_CLUSTER, uf2_app_blocks * USB_DEVICE_MSC_BLOCK_SIZE);
+		}
+	}
+	else if (lba >= UF2_DATA_START) {
+		uint32_t cluster = lba - UF2_DATA_START + 2;
+		if (cluster == UF2_INFO_CLUSTER) {
+			memcpy(buf, uf2_info, sizeof(uf2_info) - 1);
+		}
+		else if ((cluster - UF2_CURRENT_CLUSTER) < uf2_app_blocks) {
+			uf2_block_t *blk = (uf2_block_t *)buf;
+			blk->magicStart0 = UF2_MAGIC_START0;
+			blk->magicStart1 = UF2_MAGIC_START1;
+			blk->flags = UF2_FLAG_FAMILY_ID;
+			blk->blockNo = cluster - UF2_CURRENT_CLUSTER;
+			blk->targetAddr = uf2_app_address + (blk->blockNo * FLASH_PAGE_SIZE);
+			blk->payloadSize = FLASH_PAGE_SIZE;
+			blk->numBlocks = uf2_app_blocks;
+			blk->familyID = UF2_FAMILY_ID;
+			if (flash_erase_overlaps(blk->targetAddr, FLASH_PAGE_SIZE)) return false;
+			memcpy(blk->data, (const void *)blk->targetAddr, FLASH_PAGE_SIZE);
+			blk->magicEnd = UF2_MAGIC_END;
+		}
+	}
+	return true;
+}
+
+// Complete image is written, set it as the active application
+//-----------------------------
+static bool uf2_app_install()
+{
+	app_rec_t rec;
+	uint32_t size = uf2.blocks * FLASH_PAGE_SIZE;
+
+	uf2.active = false;
+	if (app_sha256(uf2.address, size)) return false;
+
+	memset(&rec, 0, sizeof(app_rec_t));
+	strcpy(rec.name, "UF2");
+	rec.address = uf2.address;
+	rec.size = size | APP_FLAG_ACTIVE;
+	memcpy(rec.sha256, sha256_hash, SHA_HASH_SIZE);
+
+	if (app_record_install(&rec, app_install_slot(uf2.address)) != CMD_ERR_OK) return false;
+
+	uf2_app_snapshot();
+	return true;
+}
+
+// Flash the UF2 block, blocks for other devices are ignored
+// The sector is erased when its first block is written, blocks can come in any order
+// Returns false on error
+//-----------------------------------------------
+static bool uf2_write_block(uf2_block_t *blk)
+{
+	if (blk->flags & UF2_FLAG_NOT_MAIN) return true;
+	if ((blk->flags & UF2_FLAG_FAMILY_ID) && (blk->familyID != UF2_FAMILY_ID)) return true;
+
+	// the image must be a valid application, written page by page
+	if ((blk->payloadSize != FLASH_PAGE_SIZE) || (blk->targetAddr % FLASH_PAGE_SIZE)) return false;
+	if ((blk->numBlocks < (MIN_APP_SIZE / FLASH_PAGE_SIZE)) || (blk->numBlocks > UF2_MAX_BLOCKS)) return false;
+	if (blk->blockNo >= blk->numBlocks) return false;
+	// the image start is derived from the block number, only contiguous images are supported
+	uint32_t address = blk->targetAddr - (blk->blockNo * FLASH_PAGE_SIZE);
+	if ((address % SECTOR_SIZE) || (address < APP_START_ADDRESS) || (address >= SESSION_JOURNAL_ADDRESS) ||
+			((blk->numBlocks * FLASH_PAGE_SIZE) > (SESSION_JOURNAL_ADDRESS - address))) return false;
+	// the image with a gap has the blocks of different start address
+	if ((uf2.active) && (uf2.blocks == blk->numBlocks) && (uf2.address != address)) {
+		uf2.active = false;
+		return false;
+	}
+
+	if ((!uf2.active) || (uf2.blocks != blk->numBlocks)) {
+		// new image
+		memset(&uf2, 0, sizeof(uf2_session_t));
+		uf2.active = true;
+		uf2.address = address;
+		uf2.blocks = blk->numBlocks;
+		app_sha256_begin(address, uf2.blocks * FLASH_PAGE_SIZE);
+	}
+	uint32_t idx = blk->blockNo;
+	// the host can write the file again
+	if (uf2.written[idx >> 3] & (1 << (idx & 7))) return true;
+
+	uint32_t sect = (blk->targetAddr - address) / SECTOR_SIZE;
+	if ((uf2.erased[sect >> 3] & (1 << (sect & 7))) == 0) {
+		uint32_t sect_addr = address + (sect * SECTOR_SIZE);
+		if ((_sector_erased(sect_addr) < SECTOR_SIZE) && (flash_erase(sect_addr, SECTOR_SIZE) != FERR_OK)) {
+			uf2.active = false;
+			return false;
+		}
+		uf2.erased[sect >> 3] |= (1 << (sect & 7));
+	}
+	if ((flash_program_page(blk->targetAddr, blk->data) != FERR_OK) ||
+			(_check_flash_data(blk->targetAddr, blk->data, FLASH_PAGE_SIZE) < FLASH_PAGE_SIZE)) {
+		uf2.active = false;
+		return false;
+	}
+	app_sha256_update(blk->targetAddr, blk->data, FLASH_PAGE_SIZE);
+	uf2.written[idx >> 3] |= (1 << (idx & 7));
+	uf2.received++;
+
+	if (uf2.received == uf2.blocks) return uf2_app_install();
+	return true;
+}
+
+// Mass storage class callback, called from the USB interrupt
+// The UF2 blocks are held by the class until flashed by uf2_poll(), other sectors are ignored
+//------------------------------------------------------------------------------------
+usb_status_t USB_DeviceMscDiskCallback(class_handle_t handle, uint32_t event, void *param)
+{
+	usb_device_lba_information_struct_t *lbaInfo;
+	usb_device_lba_app_struct_t *lbaData;
+	uf2_block_t *blk;
+
+	uf2_handle = handle;
+	switch (event) {
+		case kUSB_DeviceMscEventGetLbaInformation:
+			lbaInfo = (usb_device_lba_information_struct_t *)param;
+			lbaInfo->totalLbaNumberSupports = UF2_VOLUME_SECTORS;
+			break;
+		case kUSB_DeviceMscEventReadRequest:
+			lbaData = (usb_device_lba_app_struct_t *)param;
+			if (!uf2_read_sector(lbaData->offset, lbaData->buffer)) {
+				// the class sends nothing until uf2_poll() reads the sector
+				uf2_read_lba = lbaData->offset;
+				uf2_read_buf = lbaData->buffer;
+				return kStatus_USB_Busy;
+			}
+			break;
+		case kUSB_DeviceMscEventWriteResponse:
+			lbaData = (usb_device_lba_app_struct_t *)param;
+			blk = (uf2_block_t *)lbaData->buffer;
+			if ((blk->magicStart0 == UF2_MAGIC_START0) && (blk->magicStart1 == UF2_MAGIC_START1) &&
+					(blk->magicEnd == UF2_MAGIC_END)) {
+				uf2_pending = blk;
+				return kStatus_USB_Busy;
+			}
+			break;
+		default:
+			break;
+	}
+	return kStatus_USB_Success;
+}
+
+//------------------
+bool uf2_busy(void)
+{
+	return ((uf2_pending != NULL) || (uf2_read_buf != NULL));
+}
+
+//------------------
+void uf2_poll(void)
+{
+	if ((!uf2_app_valid) || (boot_rec.crc != uf2_app_crc)) uf2_app_snapshot();
+
+	uint8_t *buf = uf2_read_buf;
+	if (buf != NULL) {
+		// finish the background erase outside of the USB interrupt and read the sector
+		flash_erase_finish(BOOTLOADER_FLEXSPI_AMBA_BASE, FLASH_END_ADDRESS - BOOTLOADER_FLEXSPI_AMBA_BASE);
+		bool res = uf2_read_sector(uf2_read_lba, buf);
+		uf2_read_buf = NULL;
+		USB_DeviceMscReadDone(uf2_handle, (res) ? kStatus_USB_Success : kStatus_USB_Error);
+	}
+
+	uf2_block_t *blk = uf2_pending;
+	if (blk == NULL) return;
+
+	LED_toggle();
+	bool res = uf2_write_block(blk);
+	uf2_pending = NULL;
+	USB_DeviceMscWriteDone(uf2_handle, (res) ? kStatus_USB_Success : kStatus_USB_Error);
+}
+
+#endif
@@ -0,0 +1,77 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Part of the iMX RT MicroPython port
+ * iMX RT CDC ACM Bootloader with OTA support
+ *
+ * Code inspired by CDC Arduino bootloader for SeeedStudio's ArchMix board
+ * https://github.com/Seeed-Studio/ArduinoCore-imxrt/tree/master/bootloaders
+ * 
+ * Author: LoBo (loboris@gmail.com)
+ * 
+ * Copyright (C) 2021  LoBo
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+ 
+#ifndef _IMRXT_BA_UF2_H
+#define _IMRXT_BA_UF2_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "usb_device_config.h"
+
+// UF2 block, https://github.com/microsoft/uf2
+#define UF2_MAGIC_START0			0x0A324655
+#define UF2_MAGIC_START1			0x9E5D5157
+#define UF2_MAGIC_END					0x0AB16F30
+#define UF2_FLAG_NOT_MAIN			0x00000001		// not main flash, the block is ignored
+#define UF2_FLAG_FAMILY_ID		0x00002000		// 'familyID' field is present
+#define UF2_FAMILY_ID					0x4FB2D5BD		// MIMXRT10XX
+#define UF2_DATA_SIZE					476
+
+typedef struct _uf2_block_t_ {
+	uint32_t magicStart0;
+	uint32_t magicStart1;
+	uint32_t flags;
+	uint32_t targetAddr;
+	uint32_t payloadSize;
+	uint32_t blockNo;
+	uint32_t numBlocks;
+	uint32_t familyID;
+	uint8_t  data[UF2_DATA_SIZE];
+	uint32_t magicEnd;
+}	uf2_block_t;									// size: 512 bytes
+
+#if ((defined(USB_DEVICE_CONFIG_MSC)) && (USB_DEVICE_CONFIG_MSC > 0U))
+
+// A block written to the mass storage volume waits for uf2_poll()
+bool uf2_busy(void);
+// Flash the pending block, the boot record is written when the image is complete
+// The volume shows the active application as CURRENT.UF2
+void uf2_poll(void);
+
+#else
+
+#define uf2_busy()		false
+#define uf2_poll()
+
+#endif
+
+#endif /*IMRXT_BA_UF2_H*/